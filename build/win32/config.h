@@ -3,6 +3,7 @@
 /* #undef DEBUG -- XXX: defined in the VS project */
 /* #undef HAVE__MINGW_H */
 /* #undef HAVE_ARPA_INET_H */
+/* #undef HAVE_AVX2_TARGET */
 #define HAVE_ATEXIT 1
 /* #undef HAVE_COCOA_COCOA_H */
 /* #undef HAVE_CONIO_H */
@@ -33,6 +34,10 @@
 /* #undef HAVE_NCURSES_NCURSES_H */
 /* #undef HAVE_NETINET_IN_H */
 /* #undef HAVE_OPENGL_GL_H */
+/* #undef HAVE_PIPE */
+/* #undef HAVE_POLL_H */
+/* #undef HAVE_POSIX_OPENPT */
+/* #undef HAVE_PTHREAD_H */
 #define HAVE_PUTENV 1
 /* #undef HAVE_RESIZETERM */
 /* #undef HAVE_RESIZE_TERM */
@@ -45,6 +50,7 @@
 /* #undef HAVE_SLSMG_UTF8_ENABLE */
 #define HAVE_SNPRINTF 1
 #define HAVE_SPRINTF_S 1
+/* #undef HAVE_SSE2_INTRINSICS */
 #define HAVE_STDARG_H 1
 #define HAVE_STDIO_H 1
 /* #undef HAVE_STDINT_H */
@@ -52,7 +58,9 @@
 #define HAVE_STRCASECMP 1
 #define HAVE_STRINGS_H 1
 #define HAVE_STRING_H 1
+/* #undef HAVE_SYS_EPOLL_H */
 /* #undef HAVE_SYS_IOCTL_H */
+/* #undef HAVE_SYS_RESOURCE_H */
 #define HAVE_SYS_SOCKET_H 1
 #define HAVE_SYS_STAT_H 1
 /* #undef HAVE_SYS_TIME_H */
@@ -64,7 +72,9 @@
 #define HAVE_VSNPRINTF_S 1
 #define HAVE_WINDOWS_H 1
 #define HAVE_WINSOCK2_H 1
+/* #undef HAVE_X11_EXTENSIONS_XSHM_H */
 /* #undef HAVE_X11_XKBLIB_H */
+/* #undef HAVE_XSHM */
 /* #undef HAVE_ZLIB_H */
 /* #undef LT_OBJDIR -- XXX: unneeded */
 /* #undef NO_MINUS_C_MINUS_O */
@@ -86,6 +96,7 @@
 /* #undef USE_PLUGINS */
 /* #undef USE_SLANG */
 /* #undef USE_VGA */
+/* #undef USE_VT */
 #define USE_WIN32 1
 /* #undef USE_X11 */
 /* #undef const */
@@ -209,7 +209,7 @@ int caca_put_attr(caca_canvas_t *cv, int x, int y, uint32_t attr)
     }
 
     if(!cv->dirty_disabled)
-        caca_add_dirty_rect(cv, xmin, y, xmax - xmin + 1, 1);
+        _caca_mark_dirty_cells(cv, xmin, y, xmax - xmin + 1);
 
     return 0;
 }
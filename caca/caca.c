@@ -177,6 +177,9 @@ char const * const * caca_get_display_driver_list(void)
 #if defined(USE_NCURSES)
         "ncurses", "ncurses console library",
 #endif
+#if defined(USE_VT)
+        "vt", "VT100/ANSI terminal",
+#endif
 #if defined(USE_VGA)
         "vga", "direct VGA memory",
 #endif
@@ -305,6 +308,7 @@ static int caca_install_driver(caca_display_t *dp, char const *driver)
 #if defined(USE_PLUGINS)
     dp->plugin = NULL;
 #endif
+    dp->resize.pipe[0] = dp->resize.pipe[1] = -1;
 
     if(caca_select_driver(dp, driver))
     {
@@ -317,6 +321,7 @@ static int caca_install_driver(caca_display_t *dp, char const *driver)
 
     if(dp->drv.init_graphics(dp))
     {
+        _caca_close_resize_pipe(dp);
 #if defined(USE_PLUGINS)
         if(dp->plugin)
             dlclose(dp->plugin);
@@ -336,7 +341,8 @@ static int caca_install_driver(caca_display_t *dp, char const *driver)
     dp->events.autorepeat_ticks = 0;
     dp->events.last_key_event.type = CACA_EVENT_NONE;
 #endif
-#if defined(USE_SLANG) || defined(USE_NCURSES) || defined(USE_CONIO) || defined(USE_GL)
+#if defined(USE_SLANG) || defined(USE_NCURSES) || defined(USE_CONIO) \
+     || defined(USE_GL) || defined(USE_VT)
     dp->events.queue = 0;
 #endif
 
@@ -364,6 +370,7 @@ static int caca_install_driver(caca_display_t *dp, char const *driver)
 static int caca_uninstall_driver(caca_display_t *dp)
 {
     dp->drv.end_graphics(dp);
+    _caca_close_resize_pipe(dp);
 #if defined(USE_PLUGINS)
     if(dp->plugin)
         dlclose(dp->plugin);
@@ -414,6 +421,9 @@ static int caca_select_driver(caca_display_t *dp, char const *driver)
 #if defined(USE_NCURSES)
         if(!strcasecmp(var, "ncurses")) return ncurses_install(dp);
 #endif
+#if defined(USE_VT)
+        if(!strcasecmp(var, "vt")) return vt_install(dp);
+#endif
 #if defined(USE_VGA)
         if(!strcasecmp(var, "vga")) return vga_install(dp);
 #endif
@@ -449,6 +459,10 @@ static int caca_select_driver(caca_display_t *dp, char const *driver)
 #endif
 #if defined(USE_SLANG)
     if(slang_install(dp) == 0) return 0;
+#endif
+    /* The VT driver only knows about ANSI terminals, so it comes last. */
+#if defined(USE_VT)
+    if(vt_install(dp) == 0) return 0;
 #endif
     /* Of course we don't try "raw" or "null" if the user did not
      * specifically ask for them. */
@@ -57,6 +57,8 @@ typedef struct caca_charfont caca_charfont_t;
 typedef struct caca_font caca_font_t;
 /** file handle structure */
 typedef struct caca_file caca_file_t;
+/** stream decoder structure */
+typedef struct caca_decoder caca_decoder_t;
 /** \e libcaca display context */
 typedef struct caca_display caca_display_t;
 /** \e libcaca event structure */
@@ -412,6 +414,10 @@ __extern int caca_set_dither_algorithm(caca_dither_t *, char const *);
 __extern char const * const * caca_get_dither_algorithm_list(caca_dither_t
                                                               const *);
 __extern char const * caca_get_dither_algorithm(caca_dither_t const *);
+__extern int caca_set_dither_lookup(caca_dither_t *, int);
+__extern int caca_get_dither_lookup(caca_dither_t const *);
+__extern int caca_set_dither_threads(caca_dither_t *, int);
+__extern int caca_get_dither_threads(caca_dither_t const *);
 __extern int caca_dither_bitmap(caca_canvas_t *, int, int, int, int,
                          caca_dither_t const *, void const *);
 __extern int caca_free_dither(caca_dither_t *);
@@ -439,6 +445,15 @@ __extern int caca_get_font_height(caca_font_t const *);
 __extern uint32_t const *caca_get_font_blocks(caca_font_t const *);
 __extern int caca_render_canvas(caca_canvas_t const *, caca_font_t const *,
                                  void *, int, int, int);
+__extern int caca_render_canvas_area(caca_canvas_t const *,
+                                     caca_font_t const *, void *,
+                                     int, int, int, int, int, char const *);
+__extern int caca_render_canvas_stream(caca_canvas_t const *,
+                                       caca_font_t const *, char const *,
+                                       int, int,
+                                       int (*)(void *, void const *,
+                                               int, int, int),
+                                       void *);
 __extern int caca_free_font(caca_font_t *);
 /*  @} */
 
@@ -485,8 +500,18 @@ __extern ssize_t caca_import_area_from_memory(caca_canvas_t *, int, int,
 __extern ssize_t caca_import_area_from_file(caca_canvas_t *, int, int,
                                             char const *, char const *);
 __extern char const * const * caca_get_import_list(void);
+__extern caca_decoder_t *caca_create_decoder(char const *);
+__extern ssize_t caca_decode_canvas(caca_decoder_t *, caca_canvas_t *,
+                                    void const *, size_t);
+__extern size_t caca_get_decoder_needed(caca_decoder_t const *);
+__extern int caca_free_decoder(caca_decoder_t *);
 __extern void *caca_export_canvas_to_memory(caca_canvas_t const *,
                                             char const *, size_t *);
+__extern ssize_t caca_export_canvas_to_buffer(caca_canvas_t const *,
+                                              char const *, void *, size_t);
+__extern ssize_t caca_export_canvas_delta_to_buffer(caca_canvas_t const *,
+                                                    caca_canvas_t const *,
+                                                    void *, size_t);
 __extern void *caca_export_area_to_memory(caca_canvas_t const *, int, int,
                                           int, int, char const *, size_t *);
 __extern char const * const * caca_get_export_list(void);
@@ -523,6 +548,7 @@ __extern int caca_set_cursor(caca_display_t *, int);
  *
  *  @{ */
 __extern int caca_get_event(caca_display_t *, int, caca_event_t *, int);
+__extern int caca_get_event_fd(caca_display_t const *);
 __extern int caca_get_mouse_x(caca_display_t const *);
 __extern int caca_get_mouse_y(caca_display_t const *);
 __extern enum caca_event_type caca_get_event_type(caca_event_t const *);
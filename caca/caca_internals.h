@@ -23,7 +23,7 @@ typedef struct caca_privevent caca_privevent_t;
 #if !defined(_DOXYGEN_SKIP_ME)
 #   define STAT_VALUES 32
 #   define EVENTBUF_LEN 10
-#   define MAX_DIRTY_COUNT 8
+#   define MAX_DIRTY_COUNT 8 /* initial size of the dirty rectangle list */
 #endif
 
 #undef __extern
@@ -66,13 +66,17 @@ struct caca_canvas
     int (*resize_callback)(void *);
     void *resize_data;
 
-    /* Dirty rectangles */
-    int ndirty, dirty_disabled;
-    struct
+    /* Dirty cells, one bit per cell, and the dirty rectangle list that
+     * is derived from them when needed */
+    int dirty_disabled;
+    uint32_t *dirty_bits;
+    int dirty_stride, dirty_valid;
+    int ndirty, dirty_size;
+    struct caca_dirty_rect
     {
         int xmin, ymin, xmax, ymax;
     }
-    dirty[MAX_DIRTY_COUNT + 1];
+    *dirty;
 
     /* Shortcut to the active frame information */
     int width, height;
@@ -113,6 +117,9 @@ enum caca_driver
 #if defined(USE_X11)
     CACA_DRIVER_X11 = 9,
 #endif
+#if defined(USE_VT)
+    CACA_DRIVER_VT = 10,
+#endif
 };
 
 /* Available external drivers */
@@ -136,6 +143,9 @@ int slang_install(caca_display_t *);
 #if defined(USE_VGA)
 int vga_install(caca_display_t *);
 #endif
+#if defined(USE_VT)
+int vt_install(caca_display_t *);
+#endif
 #if defined(USE_WIN32)
 int win32_install(caca_display_t *);
 #endif
@@ -198,6 +208,7 @@ struct caca_display
         int (* get_event) (caca_display_t *, caca_privevent_t *);
         void (* set_mouse) (caca_display_t *, int);
         void (* set_cursor) (caca_display_t *, int);
+        int (* get_fd) (caca_display_t const *);
     } drv;
 
     /* Mouse position */
@@ -212,6 +223,7 @@ struct caca_display
         int resized;   /* A resize event was requested */
         int allow;     /* The display driver allows resizing */
         int w, h; /* Requested width and height */
+        int pipe[2];   /* Written to by signal handlers to wake up waits */
     } resize;
 
     /* Framerate handling */
@@ -225,7 +237,8 @@ struct caca_display
 
     struct events
     {
-#if defined(USE_SLANG) || defined(USE_NCURSES) || defined(USE_CONIO) || defined(USE_GL)
+#if defined(USE_SLANG) || defined(USE_NCURSES) || defined(USE_CONIO) \
+     || defined(USE_GL) || defined(USE_VT)
         caca_privevent_t buf[EVENTBUF_LEN];
         int queue;
 #endif
@@ -242,7 +255,20 @@ struct caca_display
 };
 
 /* Dirty rectangle functions */
-extern void _caca_clip_dirty_rect_list(caca_canvas_t *);
+extern int _caca_resize_dirty(caca_canvas_t *, int, int);
+
+/* Mark a few cells of a line as dirty, for per-cell drawing functions.
+ * The cells must lie within the canvas. */
+static inline void _caca_mark_dirty_cells(caca_canvas_t *cv,
+                                          int x, int y, int n)
+{
+    uint32_t *row = cv->dirty_bits + y * cv->dirty_stride;
+
+    for( ; n--; x++)
+        row[x / 32] |= (uint32_t)1 << (x % 32);
+
+    cv->dirty_valid = 0;
+}
 
 /* Colour functions */
 extern uint32_t _caca_attr_to_rgb24fg(uint32_t);
@@ -258,7 +284,11 @@ extern int _caca_getticks(caca_timer_t *);
 
 /* Internal event functions */
 extern void _caca_handle_resize(caca_display_t *);
-#if defined(USE_SLANG) || defined(USE_NCURSES) || defined(USE_CONIO) || defined(USE_GL)
+extern void _caca_open_resize_pipe(caca_display_t *);
+extern void _caca_close_resize_pipe(caca_display_t *);
+extern void _caca_signal_resize(caca_display_t *);
+#if defined(USE_SLANG) || defined(USE_NCURSES) || defined(USE_CONIO) \
+     || defined(USE_GL) || defined(USE_VT)
 /* Expose this with ‘__extern’ because the GL driver uses it */
 __extern void _caca_push_event(caca_display_t *, caca_privevent_t *);
 extern int _caca_pop_event(caca_display_t *, caca_privevent_t *);
@@ -92,13 +92,20 @@ caca_canvas_t * caca_create_canvas(int width, int height)
     _caca_load_frame_info(cv);
     caca_set_color_ansi(cv, CACA_DEFAULT, CACA_TRANSPARENT);
 
-    cv->ndirty = 0;
     cv->dirty_disabled = 0;
+    cv->dirty_bits = NULL;
+    cv->dirty_stride = 0;
+    cv->dirty_valid = 1;
+    cv->ndirty = 0;
+    cv->dirty_size = MAX_DIRTY_COUNT;
+    cv->dirty = malloc(MAX_DIRTY_COUNT * sizeof(cv->dirty[0]));
     cv->ff = NULL;
 
-    if(caca_resize(cv, width, height) < 0)
+    if(!cv->dirty || caca_resize(cv, width, height) < 0)
     {
-        int saved_errno = geterrno();
+        int saved_errno = cv->dirty ? geterrno() : ENOMEM;
+        free(cv->dirty_bits);
+        free(cv->dirty);
         free(cv->frames[0].name);
         free(cv->frames);
         free(cv);
@@ -326,6 +333,8 @@ int caca_free_canvas(caca_canvas_t *cv)
 
     caca_canvas_set_figfont(cv, NULL);
 
+    free(cv->dirty_bits);
+    free(cv->dirty);
     free(cv->frames);
     free(cv);
 
@@ -386,10 +395,14 @@ int caca_resize(caca_canvas_t *cv, int width, int height)
     cv->width = width;
     cv->height = height;
 
-    /* If width or height is smaller (or both), we have the opportunity to
-     * reduce or even remove dirty rectangles */
-    if(width < old_width || height < old_height)
-        _caca_clip_dirty_rect_list(cv);
+    /* Resize the dirty cell map; cells that are still within the canvas
+     * keep their state */
+    if(_caca_resize_dirty(cv, old_width, old_height) < 0)
+    {
+        cv->width = old_width;
+        cv->height = old_height;
+        return -1;
+    }
 
     /* Step 1: if new area is bigger, resize the memory area now. */
     if(new_size > old_size)
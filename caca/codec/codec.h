@@ -17,5 +17,9 @@ ssize_t _import_bin(caca_canvas_t *, void const *, size_t);
 
 void *_export_ansi(caca_canvas_t const *, size_t *);
 void *_export_utf8(caca_canvas_t const *, size_t *, int);
+size_t _encode_ansi(caca_canvas_t const *, void *, size_t);
+size_t _encode_utf8(caca_canvas_t const *, void *, size_t, int);
+size_t _encode_utf8_delta(caca_canvas_t const *, caca_canvas_t const *,
+                          void *, size_t);
 void *_export_irc(caca_canvas_t const *, size_t *);
 
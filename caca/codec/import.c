@@ -20,6 +20,11 @@
 #   include <stdlib.h>
 #   include <string.h>
 #   include <stdio.h>
+#   if defined HAVE_SSE2_INTRINSICS
+#       include <emmintrin.h>
+#   endif
+#else
+#   undef HAVE_SSE2_INTRINSICS
 #endif
 
 #include "caca.h"
@@ -40,7 +45,35 @@ static inline uint16_t sscanu16(void const *s)
     return hton16(x);
 }
 
+/* A native caca stream being decoded. The header and control section of
+ * the current frame are kept whole; the cell data goes straight into the
+ * canvas, except for a cell split between two chunks. */
+struct caca_decoder
+{
+    uint8_t *header;
+    size_t got, size, max; /* Header bytes received, needed and allocated */
+    int data; /* The header is complete and cells are expected */
+    int done; /* A frame was completed by the last call */
+
+    /* Expected canvas geometry, and size, offset and position of the next
+     * cell in the frame being filled */
+    int width, height, xmin, ymin;
+    unsigned int frames, frame;
+    int fwidth, fheight, dx, dy, x, y;
+    size_t left; /* Cell data bytes until the end of the stream frame */
+
+    uint8_t cell[8];
+    int cellbytes;
+};
+
+#define CACA_HEADER 20
+
 static ssize_t import_caca(caca_canvas_t *, void const *, size_t);
+static int decode_header(caca_decoder_t *, caca_canvas_t *);
+static void decode_next_frame(caca_decoder_t *);
+static void decode_cells(caca_canvas_t *, unsigned int, int, int,
+                         uint8_t const *, int);
+static void import_cells(uint32_t *, uint32_t *, uint8_t const *, size_t);
 
 /** \brief Import a memory buffer into a canvas
  *
@@ -290,6 +323,231 @@ char const * const * caca_get_import_list(void)
     return list;
 }
 
+/** \brief Create a stream decoder
+ *
+ *  Create a decoder for data that arrives in pieces, for instance from a
+ *  pipe or a socket. Unlike caca_import_canvas_from_memory(), it does not
+ *  need a whole frame at once: see caca_decode_canvas().
+ *
+ *  The only valid value for \c format is \c "caca", for native libcaca
+ *  streams such as the ones written by the raw driver.
+ *
+ *  If an error occurs, NULL is returned and \b errno is set accordingly:
+ *  - \c EINVAL Unsupported format requested.
+ *  - \c ENOMEM Not enough memory to allocate the decoder.
+ *
+ *  \param format A string describing the input format.
+ *  \return A stream decoder, or NULL if an error occurred.
+ */
+caca_decoder_t *caca_create_decoder(char const *format)
+{
+    caca_decoder_t *d;
+
+    if(strcasecmp("caca", format))
+    {
+        seterrno(EINVAL);
+        return NULL;
+    }
+
+    d = malloc(sizeof(caca_decoder_t));
+    if(!d)
+    {
+        seterrno(ENOMEM);
+        return NULL;
+    }
+
+    /* Enough for the control section of a single frame */
+    d->max = CACA_HEADER + 32;
+    d->header = malloc(d->max);
+    if(!d->header)
+    {
+        free(d);
+        seterrno(ENOMEM);
+        return NULL;
+    }
+
+    d->got = 0;
+    d->size = CACA_HEADER;
+    d->data = 0;
+    d->done = 0;
+    d->cellbytes = 0;
+
+    return d;
+}
+
+/** \brief Feed data to a stream decoder
+ *
+ *  Decode a chunk of a stream into the given libcaca canvas. The chunk may
+ *  end anywhere, even in the middle of a header or of a character cell;
+ *  the decoder remembers where it stopped and the next call carries on.
+ *
+ *  The canvas is resized and its frames are recreated as with
+ *  caca_import_canvas_from_memory(), but only when the stream's geometry
+ *  differs from the canvas'. Otherwise the cells are written in place and
+ *  only the ones that changed are marked dirty. The same canvas must be
+ *  given, and not resized, until the frame is complete.
+ *
+ *  Decoding stops right after the end of a frame, so that the caller can
+ *  use the canvas before the next frame overwrites it: in that case
+ *  caca_get_decoder_needed() returns 0, and the remaining data must be
+ *  given again. Invalid data is skipped until the next valid header.
+ *
+ *  If an error occurs, -1 is returned, \b errno is set accordingly and the
+ *  frame being decoded is dropped:
+ *  - \c EINVAL The canvas was resized in the middle of a frame.
+ *  - \c EBUSY The canvas is in use by a display driver and cannot be resized.
+ *  - \c ENOMEM Not enough memory to resize the canvas or hold the header.
+ *
+ *  \param d A stream decoder.
+ *  \param cv A libcaca canvas in which to decode the stream.
+ *  \param data A memory area containing the next bytes of the stream.
+ *  \param len The size in bytes of the memory area.
+ *  \return The number of bytes used, or -1 if an error occurred.
+ */
+ssize_t caca_decode_canvas(caca_decoder_t *d, caca_canvas_t *cv,
+                           void const *data, size_t len)
+{
+    uint8_t const *buf = (uint8_t const *)data;
+    size_t used = 0, n;
+
+    d->done = 0;
+
+    while(used < len && !d->done)
+    {
+        if(!d->data)
+        {
+            /* Skip garbage until something that may be a header */
+            if(!d->got)
+            {
+                uint8_t const *p = memchr(buf + used, 0xca, len - used);
+                if(!p)
+                    return len;
+                used = p - buf;
+            }
+
+            n = d->size - d->got;
+            if(n > len - used)
+                n = len - used;
+            memcpy(d->header + d->got, buf + used, n);
+            d->got += n;
+            used += n;
+
+            if(d->got == d->size && decode_header(d, cv) < 0)
+                goto error;
+            continue;
+        }
+
+        if(cv->width != d->width || cv->height != d->height
+            || cv->framecount != (int)d->frames)
+        {
+            seterrno(EINVAL);
+            goto error;
+        }
+
+        /* Finish a cell split between two chunks, or copy as many whole
+         * cells of the current row as we have */
+        if(d->cellbytes)
+        {
+            n = 8 - d->cellbytes;
+            if(n > len - used)
+                n = len - used;
+            memcpy(d->cell + d->cellbytes, buf + used, n);
+            d->cellbytes += n;
+            used += n;
+            if(d->cellbytes < 8)
+                break;
+            d->cellbytes = 0;
+            decode_cells(cv, d->frame, d->dx + d->x, d->dy + d->y, d->cell, 1);
+            n = 1;
+        }
+        else
+        {
+            n = (len - used) / 8;
+            if(n > (size_t)(d->fwidth - d->x))
+                n = d->fwidth - d->x;
+            if(!n)
+            {
+                d->cellbytes = len - used;
+                memcpy(d->cell, buf + used, d->cellbytes);
+                return len;
+            }
+            decode_cells(cv, d->frame, d->dx + d->x, d->dy + d->y,
+                         buf + used, n);
+            used += n * 8;
+        }
+
+        d->left -= n * 8;
+        d->x += n;
+        if(d->x == d->fwidth)
+        {
+            d->x = 0;
+            if(++d->y == d->fheight)
+            {
+                d->frame++;
+                decode_next_frame(d);
+            }
+        }
+
+        if(!d->left)
+        {
+            d->data = 0;
+            d->got = 0;
+            d->size = CACA_HEADER;
+            d->done = 1;
+        }
+    }
+
+    return used;
+
+error:
+    d->data = 0;
+    d->got = 0;
+    d->size = CACA_HEADER;
+    d->cellbytes = 0;
+    return -1;
+}
+
+/** \brief Get the amount of data a stream decoder is waiting for
+ *
+ *  Return how many more bytes caca_decode_canvas() needs to complete the
+ *  current part of the stream: the rest of the header, or the rest of the
+ *  frame once the header is known. It is 0 if the last call to
+ *  caca_decode_canvas() completed a frame.
+ *
+ *  This function never fails.
+ *
+ *  \param d A stream decoder.
+ *  \return The number of bytes needed.
+ */
+size_t caca_get_decoder_needed(caca_decoder_t const *d)
+{
+    if(d->done)
+        return 0;
+
+    if(d->data)
+        return d->left - d->cellbytes;
+
+    return d->size - d->got;
+}
+
+/** \brief Free a stream decoder
+ *
+ *  Free the memory allocated by caca_create_decoder(). The canvas it was
+ *  decoding to is left as is.
+ *
+ *  This function never fails.
+ *
+ *  \param d A stream decoder.
+ *  \return This function always returns 0.
+ */
+int caca_free_decoder(caca_decoder_t *d)
+{
+    free(d->header);
+    free(d);
+
+    return 0;
+}
+
 /*
  * XXX: the following functions are local.
  */
@@ -384,7 +642,13 @@ static ssize_t import_caca(caca_canvas_t *cv, void const *data, size_t size)
 
         /* FIXME: check for return value */
 
-        for(n = width * height; n--; )
+        /* A frame that covers the whole canvas needs no placement or
+         * clipping, and caca_set_frame() already marked it dirty */
+        if(width == (unsigned int)cv->width
+            && height == (unsigned int)cv->height)
+            import_cells(cv->chars, cv->attrs,
+                         buf + 4 + control_size + offset, width * height);
+        else for(n = width * height; n--; )
         {
             int x = (n % width) - cv->frames[f].handlex - xmin;
             int y = (n / width) - cv->frames[f].handley - ymin;
@@ -411,6 +675,230 @@ invalid_caca:
     return -1;
 }
 
+/* Parse the header and control section of a caca stream frame, and get
+ * the canvas ready for its cells. Invalid headers are dropped, keeping
+ * anything after their first byte that may start a valid one. */
+static int decode_header(caca_decoder_t *d, caca_canvas_t *cv)
+{
+    uint8_t *buf = d->header;
+    size_t control_size, data_size, expected_size;
+    unsigned int frames, f;
+    int32_t xmin = 0, ymin = 0, xmax = 0, ymax = 0;
+    int reuse;
+
+    control_size = sscanu32(buf + 4);
+    data_size = sscanu32(buf + 8);
+    frames = sscanu32(buf + 14);
+
+    if(buf[0] != 0xca || buf[1] != 0xca || buf[2] != 'C' || buf[3] != 'V'
+        || control_size < 16 || (control_size - 16) / 32 < frames)
+    {
+        uint8_t *p = memchr(buf + 1, 0xca, d->got - 1);
+
+        debug("caca decode error: invalid header");
+        d->got = p ? d->got - (p - buf) : 0;
+        memmove(buf, p ? p : buf, d->got);
+        return 0;
+    }
+
+    d->size = 4 + control_size;
+    if(d->size > d->max)
+    {
+        uint8_t *header = realloc(d->header, d->size);
+        if(!header)
+        {
+            seterrno(ENOMEM);
+            return -1;
+        }
+        d->header = header;
+        d->max = d->size;
+    }
+    if(d->got < d->size)
+        return 0;
+
+    for(expected_size = 0, f = 0; f < frames; f++)
+    {
+        uint8_t const *info = buf + 4 + 16 + f * 32;
+        unsigned int width = sscanu32(info), height = sscanu32(info + 4);
+        int handlex = (int32_t)sscanu32(info + 24);
+        int handley = (int32_t)sscanu32(info + 28);
+
+        if(height && width > (data_size - expected_size) / 8 / height)
+            break;
+        expected_size += (size_t)width * height * 8;
+        if(-handlex < xmin)
+            xmin = -handlex;
+        if(-handley < ymin)
+            ymin = -handley;
+        if((((int32_t) width) - handlex) > xmax)
+            xmax = ((int32_t) width) - handlex;
+        if((((int32_t) height) - handley) > ymax)
+            ymax = ((int32_t) height) - handley;
+    }
+
+    if(f < frames || expected_size != data_size)
+    {
+        debug("caca decode error: data size %u does not match the frames",
+              (unsigned int)data_size);
+        d->got = 0;
+        d->size = CACA_HEADER;
+        return 0;
+    }
+
+    /* Keep the canvas if every frame covers it, or clear it like
+     * import_caca() does */
+    reuse = cv->width == xmax - xmin && cv->height == ymax - ymin
+             && cv->framecount == (int)frames;
+    for(f = 0; reuse && f < frames; f++)
+        reuse = (int)sscanu32(buf + 4 + 16 + f * 32) == cv->width
+                 && (int)sscanu32(buf + 4 + 16 + f * 32 + 4) == cv->height;
+
+    if(!reuse)
+    {
+        if(caca_set_canvas_size(cv, 0, 0) < 0
+            || caca_set_canvas_size(cv, xmax - xmin, ymax - ymin) < 0)
+            return -1;
+        while(cv->framecount > 1 && cv->framecount > (int)frames)
+            caca_free_frame(cv, cv->framecount - 1);
+        while(cv->framecount < (int)frames)
+            if(caca_create_frame(cv, cv->framecount) < 0)
+                return -1;
+    }
+
+    if(cv->frame)
+        caca_set_frame(cv, 0);
+
+    for(f = 0; f < frames; f++)
+    {
+        uint8_t const *info = buf + 4 + 16 + f * 32;
+
+        cv->frames[f].curattr = sscanu32(info + 12);
+        cv->frames[f].x = (int32_t)sscanu32(info + 16)
+                           - (int32_t)sscanu32(info + 24);
+        cv->frames[f].y = (int32_t)sscanu32(info + 20)
+                           - (int32_t)sscanu32(info + 28);
+        cv->frames[f].handlex = -xmin;
+        cv->frames[f].handley = -ymin;
+    }
+    cv->curattr = cv->frames[0].curattr;
+
+    d->width = xmax - xmin;
+    d->height = ymax - ymin;
+    d->xmin = xmin;
+    d->ymin = ymin;
+    d->frames = frames;
+    d->left = data_size;
+
+    if(!data_size)
+    {
+        d->got = 0;
+        d->size = CACA_HEADER;
+        d->done = 1;
+        return 0;
+    }
+
+    d->data = 1;
+    d->frame = 0;
+    decode_next_frame(d);
+
+    return 0;
+}
+
+/* Move to the first frame from the current one that has cells */
+static void decode_next_frame(caca_decoder_t *d)
+{
+    for( ; d->frame < d->frames; d->frame++)
+    {
+        uint8_t const *info = d->header + 4 + 16 + d->frame * 32;
+
+        d->fwidth = sscanu32(info);
+        d->fheight = sscanu32(info + 4);
+        d->dx = -(int32_t)sscanu32(info + 24) - d->xmin;
+        d->dy = -(int32_t)sscanu32(info + 28) - d->ymin;
+        if(d->fwidth && d->fheight)
+            break;
+    }
+
+    d->x = d->y = 0;
+}
+
+/* Store cells of native caca data into a row of a canvas frame. In the
+ * current frame, only the cells that really change are marked dirty, so
+ * that a display showing a stream redraws what moved. */
+static void decode_cells(caca_canvas_t *cv, unsigned int f, int x, int y,
+                         uint8_t const *src, int n)
+{
+    uint32_t *chars = cv->frames[f].chars + x + y * cv->width;
+    uint32_t *attrs = cv->frames[f].attrs + x + y * cv->width;
+    int i, first = -1, last = -1;
+
+    if((int)f != cv->frame || cv->dirty_disabled)
+    {
+        import_cells(chars, attrs, src, n);
+        return;
+    }
+
+    for(i = 0; i < n; i++)
+    {
+        uint32_t ch = sscanu32(src + 8 * i);
+        uint32_t attr = sscanu32(src + 8 * i + 4);
+
+        if(ch == chars[i] && attr == attrs[i])
+            continue;
+
+        if(first < 0)
+            first = i;
+        last = i;
+        chars[i] = ch;
+        attrs[i] = attr;
+    }
+
+    if(first >= 0)
+        _caca_mark_dirty_cells(cv, x + first, y, last - first + 1);
+}
+
+/* Split n cells of native caca data into their characters and attributes,
+ * converting them to host byte order */
+static void import_cells(uint32_t *chars, uint32_t *attrs,
+                         uint8_t const *src, size_t n)
+{
+    size_t i = 0;
+
+#if defined HAVE_SSE2_INTRINSICS
+    /* Four cells at a time: gather the characters and the attributes,
+     * then swap the 16-bit halves of each word and the bytes of each
+     * half. SSE2 is only found on little-endian CPUs. */
+    for( ; i + 4 <= n; i += 4)
+    {
+        __m128i lo, hi, ch, attr;
+
+        lo = _mm_loadu_si128((__m128i const *)(src + 8 * i));
+        hi = _mm_loadu_si128((__m128i const *)(src + 8 * i + 16));
+        lo = _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0));
+        hi = _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0));
+        ch = _mm_unpacklo_epi64(lo, hi);
+        attr = _mm_unpackhi_epi64(lo, hi);
+
+        ch = _mm_shufflelo_epi16(ch, _MM_SHUFFLE(2, 3, 0, 1));
+        ch = _mm_shufflehi_epi16(ch, _MM_SHUFFLE(2, 3, 0, 1));
+        ch = _mm_or_si128(_mm_slli_epi16(ch, 8), _mm_srli_epi16(ch, 8));
+        attr = _mm_shufflelo_epi16(attr, _MM_SHUFFLE(2, 3, 0, 1));
+        attr = _mm_shufflehi_epi16(attr, _MM_SHUFFLE(2, 3, 0, 1));
+        attr = _mm_or_si128(_mm_slli_epi16(attr, 8),
+                            _mm_srli_epi16(attr, 8));
+
+        _mm_storeu_si128((__m128i *)(chars + i), ch);
+        _mm_storeu_si128((__m128i *)(attrs + i), attr);
+    }
+#endif
+
+    for( ; i < n; i++)
+    {
+        chars[i] = sscanu32(src + 8 * i);
+        attrs[i] = sscanu32(src + 8 * i + 4);
+    }
+}
+
 ssize_t _import_bin(caca_canvas_t *cv, void const *data, size_t len)
 {
     uint8_t const *buf = (uint8_t const *)data;
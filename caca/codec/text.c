@@ -500,8 +500,101 @@ ssize_t _import_ansi(caca_canvas_t *cv, void const *data, size_t size, int utf8)
     return i;
 }
 
-/* Generate UTF-8 representation of current canvas. */
-void *_export_utf8(caca_canvas_t const *cv, size_t *bytes, int cr)
+/* Output window for the streaming text encoders. Bytes past the end of
+ * the buffer are counted but not written, so that the caller learns the
+ * size it needs. */
+struct text_out
+{
+    char *buf;
+    size_t size, len;
+};
+
+/* Longest sequence emitted for one cell: '\e[0;1;3x;9x;5;4y;10ym' plus
+ * a 4-byte UTF-8 character. */
+#define TEXT_CELL_MAX 32
+
+static inline void out_write(struct text_out *out, char const *s, size_t n)
+{
+    if(out->len < out->size)
+        memcpy(out->buf + out->len, s,
+               n < out->size - out->len ? n : out->size - out->len);
+    out->len += n;
+}
+
+/* Get a pointer where up to TEXT_CELL_MAX bytes can be stored, directly
+ * in the output buffer if there is room, or in tmp otherwise. */
+static inline char *out_reserve(struct text_out *out, char *tmp)
+{
+    if(out->len <= out->size && out->size - out->len >= TEXT_CELL_MAX)
+        return out->buf + out->len;
+    return tmp;
+}
+
+static inline void out_commit(struct text_out *out, char const *start,
+                              char const *end, char const *tmp)
+{
+    if(start == tmp)
+        out_write(out, tmp, end - start);
+    else
+        out->len += end - start;
+}
+
+static inline char *sgr_utf8(char *cur, uint8_t fg, uint8_t bg)
+{
+    *cur++ = '\033'; *cur++ = '['; *cur++ = '0';
+
+    if(fg < 8)
+    {
+        *cur++ = ';'; *cur++ = '3'; *cur++ = '0' + fg;
+    }
+    else if(fg < 16)
+    {
+        *cur++ = ';'; *cur++ = '1'; *cur++ = ';'; *cur++ = '3';
+        *cur++ = '0' + fg - 8;
+        *cur++ = ';'; *cur++ = '9'; *cur++ = '0' + fg - 8;
+    }
+
+    if(bg < 8)
+    {
+        *cur++ = ';'; *cur++ = '4'; *cur++ = '0' + bg;
+    }
+    else if(bg < 16)
+    {
+        *cur++ = ';'; *cur++ = '5'; *cur++ = ';'; *cur++ = '4';
+        *cur++ = '0' + bg - 8;
+        *cur++ = ';'; *cur++ = '1'; *cur++ = '0'; *cur++ = '0' + bg - 8;
+    }
+
+    *cur++ = 'm';
+
+    return cur;
+}
+
+static inline char *sgr_ansi(char *cur, uint8_t fg, uint8_t bg)
+{
+    *cur++ = '\033'; *cur++ = '['; *cur++ = '0'; *cur++ = ';';
+
+    if(bg >= 8)
+    {
+        *cur++ = '5'; *cur++ = ';';
+        bg -= 8;
+    }
+
+    if(fg >= 8)
+    {
+        *cur++ = '1'; *cur++ = ';';
+        fg -= 8;
+    }
+
+    *cur++ = '3'; *cur++ = '0' + fg; *cur++ = ';';
+    *cur++ = '4'; *cur++ = '0' + bg; *cur++ = 'm';
+
+    return cur;
+}
+
+/* Encode the UTF-8 representation of the current canvas into buf, and
+ * return the number of bytes it needs. */
+size_t _encode_utf8(caca_canvas_t const *cv, void *buf, size_t size, int cr)
 {
     static uint8_t const palette[] =
     {
@@ -509,14 +602,13 @@ void *_export_utf8(caca_canvas_t const *cv, size_t *bytes, int cr)
         8, 12, 10, 14, 9, 13, 11, 15
     };
 
-    char *data, *cur;
+    struct text_out out;
+    char tmp[TEXT_CELL_MAX];
     int x, y;
 
-    /* 23 bytes assumed for max length per pixel ('\e[5;1;3x;4y;9x;10ym' plus
-     * 4 max bytes for a UTF-8 character).
-     * Add height*9 to that (zeroes color at the end and jump to next line) */
-    *bytes = (cv->height * 9) + (cv->width * cv->height * 23);
-    cur = data = malloc(*bytes);
+    out.buf = buf;
+    out.size = buf ? size : 0;
+    out.len = 0;
 
     for(y = 0; y < cv->height; y++)
     {
@@ -531,6 +623,7 @@ void *_export_utf8(caca_canvas_t const *cv, size_t *bytes, int cr)
             uint32_t attr = lineattr[x];
             uint32_t ch = linechar[x];
             uint8_t ansifg, ansibg, fg, bg;
+            char *start, *cur;
 
             if(ch == CACA_MAGIC_FULLWIDTH)
                 continue;
@@ -541,47 +634,71 @@ void *_export_utf8(caca_canvas_t const *cv, size_t *bytes, int cr)
             fg = ansifg < 0x10 ? palette[ansifg] : 0x10;
             bg = ansibg < 0x10 ? palette[ansibg] : 0x10;
 
+            start = cur = out_reserve(&out, tmp);
+
             /* TODO: the [0 could be omitted in some cases */
             if(fg != prevfg || bg != prevbg)
-            {
-                cur += sprintf(cur, "\033[0");
-
-                if(fg < 8)
-                    cur += sprintf(cur, ";3%d", fg);
-                else if(fg < 16)
-                    cur += sprintf(cur, ";1;3%d;9%d", fg - 8, fg - 8);
-
-                if(bg < 8)
-                    cur += sprintf(cur, ";4%d", bg);
-                else if(bg < 16)
-                    cur += sprintf(cur, ";5;4%d;10%d", bg - 8, bg - 8);
-
-                cur += sprintf(cur, "m");
-            }
+                cur = sgr_utf8(cur, fg, bg);
 
             cur += caca_utf32_to_utf8(cur, ch);
+            out_commit(&out, start, cur, tmp);
 
             prevfg = fg;
             prevbg = bg;
         }
 
         if(prevfg != 0x10 || prevbg != 0x10)
-            cur += sprintf(cur, "\033[0m");
+            out_write(&out, "\033[0m", 4);
+
+        if(cr)
+            out_write(&out, "\r\n", 2);
+        else
+            out_write(&out, "\n", 1);
+    }
 
-        cur += sprintf(cur, cr ? "\r\n" : "\n");
+    return out.len;
+}
+
+/* Generate UTF-8 representation of current canvas. */
+void *_export_utf8(caca_canvas_t const *cv, size_t *bytes, int cr)
+{
+    char *data;
+    size_t len;
+
+    /* 23 bytes assumed for max length per pixel ('\e[5;1;3x;4y;9x;10ym' plus
+     * 4 max bytes for a UTF-8 character).
+     * Add height*9 to that (zeroes color at the end and jump to next line) */
+    *bytes = (cv->height * 9) + (cv->width * cv->height * 23);
+    data = malloc(*bytes);
+
+    len = _encode_utf8(cv, data, *bytes, cr);
+
+    /* Bright colours on a bright background take 25 bytes per cell, so
+     * encode again if the estimate was too small. */
+    if(len > *bytes)
+    {
+        data = realloc(data, len);
+        _encode_utf8(cv, data, len, cr);
     }
 
     /* Crop to really used size */
     debug("utf8 export: alloc %lu bytes, realloc %lu",
-          (unsigned long int)*bytes, (unsigned long int)(cur - data));
-    *bytes = (uintptr_t)(cur - data);
+          (unsigned long int)*bytes, (unsigned long int)len);
+    *bytes = len;
     data = realloc(data, *bytes);
 
     return data;
 }
 
-/* Generate ANSI representation of current canvas. */
-void *_export_ansi(caca_canvas_t const *cv, size_t *bytes)
+/* Number of unchanged cells that are cheaper to print again than to skip
+ * with a cursor move, which costs up to 10 bytes. */
+#define DELTA_GAP 4
+
+/* Encode the UTF-8 terminal sequences that turn a screen showing prev into
+ * one showing cv, and return the number of bytes they need. If prev is
+ * NULL or has a different size, the screen is cleared and fully painted. */
+size_t _encode_utf8_delta(caca_canvas_t const *prev, caca_canvas_t const *cv,
+                          void *buf, size_t size)
 {
     static uint8_t const palette[] =
     {
@@ -589,17 +706,132 @@ void *_export_ansi(caca_canvas_t const *cv, size_t *bytes)
         8, 12, 10, 14, 9, 13, 11, 15
     };
 
-    char *data, *cur;
+    struct text_out out;
+    char tmp[TEXT_CELL_MAX];
+    uint8_t prevfg, prevbg;
+    int x, y, cx = -1, cy = -1;
+
+    out.buf = buf;
+    out.size = buf ? size : 0;
+    out.len = 0;
+
+    if(prev && (prev->width != cv->width || prev->height != cv->height))
+        prev = NULL;
+
+    if(prev)
+    {
+        /* The terminal colour is unknown until we set it */
+        prevfg = prevbg = 0x11;
+    }
+    else
+    {
+        out_write(&out, "\033[0m\033[H\033[J", 10);
+        prevfg = prevbg = 0x10;
+        cx = cy = 0;
+    }
+
+    for(y = 0; y < cv->height; y++)
+    {
+        uint32_t *lineattr = cv->attrs + y * cv->width;
+        uint32_t *linechar = cv->chars + y * cv->width;
+        uint32_t *oldattr = prev ? prev->attrs + y * cv->width : NULL;
+        uint32_t *oldchar = prev ? prev->chars + y * cv->width : NULL;
+
+        for(x = 0; x < cv->width; )
+        {
+            int start, end, i;
+
+            if(prev && linechar[x] == oldchar[x] && lineattr[x] == oldattr[x])
+            {
+                x++;
+                continue;
+            }
+
+            /* Find the end of the run, bridging short unchanged gaps */
+            start = x;
+            end = x + 1;
+            for(i = end; i < cv->width && i <= end + DELTA_GAP; i++)
+                if(!prev || linechar[i] != oldchar[i]
+                          || lineattr[i] != oldattr[i])
+                    end = i + 1;
+
+            /* Repaint the left half of a changed fullwidth character */
+            if(start > 0 && linechar[start] == CACA_MAGIC_FULLWIDTH)
+                start--;
+
+            if(cx != start || cy != y)
+            {
+                char *cur = tmp;
+                cur += sprintf(cur, "\033[%i;%iH", y + 1, start + 1);
+                out_write(&out, tmp, cur - tmp);
+            }
+
+            for(i = start; i < end; i++)
+            {
+                uint32_t attr = lineattr[i];
+                uint32_t ch = linechar[i];
+                uint8_t ansifg, ansibg, fg, bg;
+                char *begin, *cur;
+
+                if(ch == CACA_MAGIC_FULLWIDTH)
+                    continue;
+
+                ansifg = caca_attr_to_ansi_fg(attr);
+                ansibg = caca_attr_to_ansi_bg(attr);
+
+                fg = ansifg < 0x10 ? palette[ansifg] : 0x10;
+                bg = ansibg < 0x10 ? palette[ansibg] : 0x10;
+
+                begin = cur = out_reserve(&out, tmp);
+
+                if(fg != prevfg || bg != prevbg)
+                    cur = sgr_utf8(cur, fg, bg);
+
+                cur += caca_utf32_to_utf8(cur, ch);
+                out_commit(&out, begin, cur, tmp);
+
+                prevfg = fg;
+                prevbg = bg;
+            }
+
+            /* The cursor position is undefined after the last column */
+            cx = end;
+            if(end < cv->width && linechar[end] == CACA_MAGIC_FULLWIDTH)
+                cx++;
+            if(cx >= cv->width)
+                cx = -1;
+            cy = y;
+
+            x = end;
+        }
+    }
+
+    if(prevfg < 0x10 || prevbg < 0x10)
+        out_write(&out, "\033[0m", 4);
+
+    return out.len;
+}
+
+/* Encode the ANSI representation of the current canvas into buf, and
+ * return the number of bytes it needs. */
+size_t _encode_ansi(caca_canvas_t const *cv, void *buf, size_t size)
+{
+    static uint8_t const palette[] =
+    {
+        0,  4,  2,  6, 1,  5,  3,  7,
+        8, 12, 10, 14, 9, 13, 11, 15
+    };
+
+    struct text_out out;
+    char tmp[TEXT_CELL_MAX];
     int x, y;
 
     uint8_t prevfg = -1;
     uint8_t prevbg = -1;
 
-    /* 16 bytes assumed for max length per pixel ('\e[5;1;3x;4ym' plus
-     * 1 byte for a CP437 character).
-     * Add height*9 to that (zeroes color at the end and jump to next line) */
-    *bytes = (cv->height * 9) + (cv->width * cv->height * 16);
-    cur = data = malloc(*bytes);
+    out.buf = buf;
+    out.size = buf ? size : 0;
+    out.len = 0;
 
     for(y = 0; y < cv->height; y++)
     {
@@ -613,27 +845,18 @@ void *_export_ansi(caca_canvas_t const *cv, size_t *bytes)
             uint8_t fg = ansifg < 0x10 ? palette[ansifg] : CACA_LIGHTGRAY;
             uint8_t bg = ansibg < 0x10 ? palette[ansibg] : CACA_BLACK;
             uint32_t ch = linechar[x];
+            char *start, *cur;
 
             if(ch == CACA_MAGIC_FULLWIDTH)
                 ch = '?';
 
-            if(fg != prevfg || bg != prevbg)
-            {
-                cur += sprintf(cur, "\033[0;");
+            start = cur = out_reserve(&out, tmp);
 
-                if(fg < 8)
-                    if(bg < 8)
-                        cur += sprintf(cur, "3%d;4%dm", fg, bg);
-                    else
-                        cur += sprintf(cur, "5;3%d;4%dm", fg, bg - 8);
-                else
-                    if(bg < 8)
-                        cur += sprintf(cur, "1;3%d;4%dm", fg - 8, bg);
-                    else
-                        cur += sprintf(cur, "5;1;3%d;4%dm", fg - 8, bg - 8);
-            }
+            if(fg != prevfg || bg != prevbg)
+                cur = sgr_ansi(cur, fg, bg);
 
             *cur++ = caca_utf32_to_cp437(ch);
+            out_commit(&out, start, cur, tmp);
 
             prevfg = fg;
             prevbg = bg;
@@ -641,20 +864,37 @@ void *_export_ansi(caca_canvas_t const *cv, size_t *bytes)
 
         if(cv->width == 80)
         {
-            cur += sprintf(cur, "\033[s\n\033[u");
+            out_write(&out, "\033[s\n\033[u", 7);
         }
         else
         {
-            cur += sprintf(cur, "\033[0m\r\n");
+            out_write(&out, "\033[0m\r\n", 6);
             prevfg = -1;
             prevbg = -1;
         }
     }
 
+    return out.len;
+}
+
+/* Generate ANSI representation of current canvas. */
+void *_export_ansi(caca_canvas_t const *cv, size_t *bytes)
+{
+    char *data;
+    size_t len;
+
+    /* 16 bytes assumed for max length per pixel ('\e[5;1;3x;4ym' plus
+     * 1 byte for a CP437 character).
+     * Add height*9 to that (zeroes color at the end and jump to next line) */
+    *bytes = (cv->height * 9) + (cv->width * cv->height * 16);
+    data = malloc(*bytes);
+
+    len = _encode_ansi(cv, data, *bytes);
+
     /* Crop to really used size */
     debug("ansi export: alloc %lu bytes, realloc %lu",
-          (unsigned long int)*bytes, (unsigned long int)(cur - data));
-    *bytes = (uintptr_t)(cur - data);
+          (unsigned long int)*bytes, (unsigned long int)len);
+    *bytes = len;
     data = realloc(data, *bytes);
 
     return data;
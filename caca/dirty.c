@@ -16,23 +16,36 @@
  *
  *  About dirty rectangles:
  *
+ *  * Dirty cells are tracked with one bit per canvas cell, so that any
+ *  number of small scattered updates stays exact and areas can be marked
+ *  clean again with caca_remove_dirty_rect().
+ *
+ *  * The dirty rectangle list is only a view of that bitmap. It is built
+ *  on demand by caca_get_dirty_rect_count() or caca_get_dirty_rect(),
+ *  from the runs of dirty cells on each line, merging runs that span the
+ *  same columns on consecutive lines.
+ *
  *  * Dirty rectangles MUST NOT be larger than the canvas. If the user
- *  provides a large rectangle through caca_add_dirty_rect(), or if the
- *  canvas changes size to become smaller, all dirty rectangles MUST
- *  immediately be clipped to the canvas size.
+ *  provides a large rectangle through caca_add_dirty_rect(), it is
+ *  clipped to the canvas size. If the canvas changes size, the bitmap is
+ *  resized with it.
  */
 
 #include "config.h"
 
 #if !defined(__KERNEL__)
 #   include <stdio.h>
+#   include <stdlib.h>
 #   include <string.h>
 #endif
 
 #include "caca.h"
 #include "caca_internals.h"
 
-static void merge_new_rect(caca_canvas_t *cv, int n);
+static void mark_rect(caca_canvas_t *cv, int x, int y, int width, int height,
+                      int dirty);
+static int next_cell(uint32_t const *row, int x, int width, int dirty);
+static void build_rect_list(caca_canvas_t *cv);
 
 /** \brief Disable dirty rectangles.
  *
@@ -97,6 +110,9 @@ int caca_enable_dirty_rect(caca_canvas_t *cv)
  */
 int caca_get_dirty_rect_count(caca_canvas_t *cv)
 {
+    if(!cv->dirty_valid)
+        build_rect_list(cv);
+
     return cv->ndirty;
 }
 
@@ -125,6 +141,9 @@ int caca_get_dirty_rect_count(caca_canvas_t *cv)
 int caca_get_dirty_rect(caca_canvas_t *cv, int r,
                         int *x, int *y, int *width, int *height)
 {
+    if(!cv->dirty_valid)
+        build_rect_list(cv);
+
     if(r < 0 || r >= cv->ndirty)
     {
         seterrno(EINVAL);
@@ -183,17 +202,7 @@ int caca_add_dirty_rect(caca_canvas_t *cv, int x, int y, int width, int height)
         return -1;
     }
 
-    /* Add the new rectangle to the list; it works even if cv->ndirty
-     * is MAX_DIRTY_COUNT because there's an extra cell in the array. */
-    cv->dirty[cv->ndirty].xmin = x;
-    cv->dirty[cv->ndirty].ymin = y;
-    cv->dirty[cv->ndirty].xmax = x + width - 1;
-    cv->dirty[cv->ndirty].ymax = y + height - 1;
-    cv->ndirty++;
-
-    /* Try to merge the new rectangle with existing ones. This also ensures
-     * that cv->ndirty is brought back below MAX_DIRTY_COUNT. */
-    merge_new_rect(cv, cv->ndirty - 1);
+    mark_rect(cv, x, y, width, height, 1);
 
     return 0;
 }
@@ -237,9 +246,7 @@ int caca_remove_dirty_rect(caca_canvas_t *cv, int x, int y,
         return -1;
     }
 
-    /* FIXME: implement this function. It's OK to have it do nothing,
-     * since we take a conservative approach in dirty rectangle handling,
-     * but we ought to help the rendering eventually. */
+    mark_rect(cv, x, y, width, height, 0);
 
     return 0;
 }
@@ -255,7 +262,10 @@ int caca_remove_dirty_rect(caca_canvas_t *cv, int x, int y,
  */
 int caca_clear_dirty_rect_list(caca_canvas_t *cv)
 {
+    memset(cv->dirty_bits, 0,
+           cv->height * cv->dirty_stride * sizeof(uint32_t));
     cv->ndirty = 0;
+    cv->dirty_valid = 1;
 
     return 0;
 }
@@ -264,118 +274,194 @@ int caca_clear_dirty_rect_list(caca_canvas_t *cv)
  * XXX: the following functions are local.
  */
 
-static inline int int_min(int a, int b) { return a < b ? a : b; }
-static inline int int_max(int a, int b) { return a > b ? a : b; }
-
-/* Merge a newly added rectangle, if necessary. */
-static void merge_new_rect(caca_canvas_t *cv, int n)
+/* Mark or unmark the cells of a rectangle that lies within the canvas */
+static void mark_rect(caca_canvas_t *cv, int x, int y, int width, int height,
+                      int dirty)
 {
-    int wasted[MAX_DIRTY_COUNT + 1];
-    int i, sn, best, best_score;
+    int j;
 
-    best = -1;
-    best_score = cv->width * cv->height;
-
-    sn = (cv->dirty[n].xmax - cv->dirty[n].xmin + 1)
-           * (cv->dirty[n].ymax - cv->dirty[n].ymin + 1);
-
-    /* Check whether the new rectangle can be merged with an existing one. */
-    for(i = 0; i < cv->ndirty; i++)
+    for(j = y; j < y + height; j++)
     {
-        int si, sf, xmin, ymin, xmax, ymax;
-
-        if(i == n)
-            continue;
-
-        xmin = int_min(cv->dirty[i].xmin, cv->dirty[n].xmin);
-        ymin = int_min(cv->dirty[i].ymin, cv->dirty[n].ymin);
-        xmax = int_max(cv->dirty[i].xmax, cv->dirty[n].xmax);
-        ymax = int_max(cv->dirty[i].ymax, cv->dirty[n].ymax);
-
-        sf = (xmax - xmin + 1) * (ymax - ymin + 1);
+        uint32_t *row = cv->dirty_bits + j * cv->dirty_stride;
+        int i = x, n = width;
 
-        /* Shortcut: if the current rectangle is inside the new rectangle,
-         * we remove the current rectangle and continue trying merges. */
-        if(sf == sn)
+        while(n > 0)
         {
-            memmove(&cv->dirty[i], &cv->dirty[i + 1],
-                    (cv->ndirty - i) * sizeof(cv->dirty[0]));
-            cv->ndirty--;
+            int bit = i % 32, len = n < 32 - bit ? n : 32 - bit;
+            uint32_t mask = (len == 32 ? 0xffffffff : (1u << len) - 1) << bit;
 
-            if(i < n)
-                n--;
+            if(dirty)
+                row[i / 32] |= mask;
             else
-                i--;
+                row[i / 32] &= ~mask;
 
-            continue;
+            i += len;
+            n -= len;
         }
+    }
+
+    cv->dirty_valid = 0;
+}
+
+/* Return the first dirty (or clean) cell of a line at or after x, or the
+ * line width if there is none */
+static int next_cell(uint32_t const *row, int x, int width, int dirty)
+{
+    uint32_t const flip = dirty ? 0 : 0xffffffff;
 
-        si = (cv->dirty[i].xmax - cv->dirty[i].xmin + 1)
-               * (cv->dirty[i].ymax - cv->dirty[i].ymin + 1);
+    while(x < width)
+    {
+        uint32_t word = (row[x / 32] ^ flip) >> (x % 32);
 
-        /* Shortcut: if the new rectangle is inside the current rectangle,
-         * we get rid of the new rectangle and bail out. */
-        if(sf == si)
+        if(word)
         {
-            cv->ndirty--;
-            memmove(&cv->dirty[n], &cv->dirty[n + 1],
-                    (cv->ndirty - n) * sizeof(cv->dirty[0]));
-            return;
+#if defined __GNUC__
+            x += __builtin_ctz(word);
+#else
+            while(!(word & 1))
+            {
+                word >>= 1;
+                x++;
+            }
+#endif
+            return x < width ? x : width;
         }
 
-        /* We store approximately how many bytes were wasted. FIXME: this is
-         * not an exact computation, we need to be more precise. */
-        wasted[i] = sf - si - sn;
+        x = (x / 32 + 1) * 32;
+    }
+
+    return width;
+}
 
-        if(wasted[i] < best_score)
+/* Rebuild the dirty rectangle list from the dirty cells. Each line is
+ * split into runs of dirty cells, and a run that spans exactly the same
+ * columns as a rectangle ending on the previous line extends it. */
+static void build_rect_list(caca_canvas_t *cv)
+{
+    int half = cv->width / 2 + 1;
+    int *open = malloc(2 * half * sizeof(int));
+    int nopen = 0, n = 0, x, y;
+
+    for(y = 0; open && y < cv->height; y++)
+    {
+        uint32_t const *row = cv->dirty_bits + y * cv->dirty_stride;
+        int const *prev = open + (y & 1) * half;
+        int *cur = open + (~y & 1) * half;
+        int i = 0, ncur = 0;
+
+        for(x = next_cell(row, 0, cv->width, 1); x < cv->width;
+            x = next_cell(row, x, cv->width, 1))
         {
-             best = i;
-             best_score = wasted[i];
+            int end = next_cell(row, x, cv->width, 0);
+
+            while(i < nopen && cv->dirty[prev[i]].xmin < x)
+                i++;
+
+            if(i < nopen && cv->dirty[prev[i]].xmin == x
+                 && cv->dirty[prev[i]].xmax == end - 1)
+            {
+                cv->dirty[prev[i]].ymax = y;
+                cur[ncur++] = prev[i++];
+            }
+            else
+            {
+                if(n == cv->dirty_size)
+                {
+                    struct caca_dirty_rect *tmp;
+
+                    tmp = realloc(cv->dirty, 2 * n * sizeof(cv->dirty[0]));
+                    if(!tmp)
+                    {
+                        free(open);
+                        open = NULL;
+                        break;
+                    }
+
+                    cv->dirty = tmp;
+                    cv->dirty_size = 2 * n;
+                }
+
+                cv->dirty[n].xmin = x;
+                cv->dirty[n].ymin = cv->dirty[n].ymax = y;
+                cv->dirty[n].xmax = end - 1;
+                cur[ncur++] = n++;
+            }
+
+            x = end;
         }
-    }
 
-    /* FIXME: we only try to merge the current rectangle, ignoring
-     * potentially better merges. */
+        nopen = ncur;
+    }
 
-    /* If no acceptable score was found and the dirty rectangle list is
-     * not full, we bail out. */
-    if(best_score > 0 && cv->ndirty < MAX_DIRTY_COUNT)
-        return;
+    /* If we ran out of memory, fall back to the bounding box of the
+     * dirty cells, which always fits in the list. */
+    if(!open)
+    {
+        n = 0;
 
-    /* Otherwise, merge the rectangle with the best candidate */
-    cv->dirty[best].xmin = int_min(cv->dirty[best].xmin, cv->dirty[n].xmin);
-    cv->dirty[best].ymin = int_min(cv->dirty[best].ymin, cv->dirty[n].ymin);
-    cv->dirty[best].xmax = int_max(cv->dirty[best].xmax, cv->dirty[n].xmax);
-    cv->dirty[best].ymax = int_max(cv->dirty[best].ymax, cv->dirty[n].ymax);
+        for(y = 0; y < cv->height; y++)
+        {
+            uint32_t const *row = cv->dirty_bits + y * cv->dirty_stride;
+
+            for(x = next_cell(row, 0, cv->width, 1); x < cv->width;
+                x = next_cell(row, x + 1, cv->width, 1))
+            {
+                if(!n)
+                {
+                    cv->dirty[0].xmin = cv->dirty[0].xmax = x;
+                    cv->dirty[0].ymin = y;
+                    n = 1;
+                }
+
+                if(x < cv->dirty[0].xmin)
+                    cv->dirty[0].xmin = x;
+                if(x > cv->dirty[0].xmax)
+                    cv->dirty[0].xmax = x;
+                cv->dirty[0].ymax = y;
+            }
+        }
+    }
 
-    memmove(&cv->dirty[n], &cv->dirty[n + 1],
-            (cv->ndirty - n) * sizeof(cv->dirty[0]));
-    cv->ndirty--;
+    free(open);
 
-    if(best < n)
-        merge_new_rect(cv, best);
-    else
-        merge_new_rect(cv, best - 1);
+    cv->ndirty = n;
+    cv->dirty_valid = 1;
 }
 
-/* Clip all dirty rectangles in case they're larger than the canvas */
-void _caca_clip_dirty_rect_list(caca_canvas_t *cv)
+/* Resize the dirty cell bitmap after the canvas size changed, keeping the
+ * state of the cells that are still within the canvas */
+int _caca_resize_dirty(caca_canvas_t *cv, int old_width, int old_height)
 {
-    int i;
-
-    for(i = 0; i < cv->ndirty; i++)
+    int stride = (cv->width + 31) / 32;
+    int height = cv->height < old_height ? cv->height : old_height;
+    int width = cv->width < old_width ? cv->width : old_width;
+    uint32_t *bits;
+    int y;
+
+    bits = malloc((cv->height * stride + 1) * sizeof(uint32_t));
+    if(!bits)
     {
-        if(cv->dirty[i].xmin < 0)
-            cv->dirty[i].xmin = 0;
+        seterrno(ENOMEM);
+        return -1;
+    }
 
-        if(cv->dirty[i].ymin < 0)
-            cv->dirty[i].ymin = 0;
+    memset(bits, 0, (cv->height * stride + 1) * sizeof(uint32_t));
 
-        if(cv->dirty[i].xmax >= cv->width)
-            cv->dirty[i].xmax = cv->width - 1;
+    for(y = 0; y < height; y++)
+    {
+        uint32_t *row = bits + y * stride;
 
-        if(cv->dirty[i].ymax >= cv->height)
-            cv->dirty[i].ymax = cv->height - 1;
+        memcpy(row, cv->dirty_bits + y * cv->dirty_stride,
+               (width + 31) / 32 * sizeof(uint32_t));
+        if(width % 32)
+            row[width / 32] &= (1u << (width % 32)) - 1;
     }
+
+    free(cv->dirty_bits);
+    cv->dirty_bits = bits;
+    cv->dirty_stride = stride;
+    cv->dirty_valid = 0;
+
+    return 0;
 }
 
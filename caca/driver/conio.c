@@ -175,6 +175,7 @@ int conio_install(caca_display_t *dp)
     dp->drv.get_event = conio_get_event;
     dp->drv.set_mouse = NULL;
     dp->drv.set_cursor = NULL;
+    dp->drv.get_fd = NULL;
 
     return 0;
 }
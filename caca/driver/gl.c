@@ -56,7 +56,9 @@ static void gl_handle_mouse_motion(int, int);
 static void gl_handle_close(void);
 #endif
 static void _display(void);
-static void gl_compute_font(caca_display_t *);
+static int gl_compute_font(caca_display_t *);
+static int gl_resize_arrays(caca_display_t *, int, int);
+static void gl_build_row(caca_display_t *, int);
 
 struct driver_private
 {
@@ -67,7 +69,6 @@ struct driver_private
     float font_width, font_height;
     float incx, incy;
     uint32_t const *blocks;
-    int *txid;
     uint8_t close;
     uint8_t bit;
     uint8_t mouse_changed, mouse_clicked;
@@ -77,7 +78,18 @@ struct driver_private
     uint8_t key;
     int special_key;
 
-    float sw, sh;
+    /* All the glyphs are in one texture, in slots of two cells. The first
+     * slot is opaque and used for the background quads. */
+    GLuint texture;
+    int tex_width, tex_height, slot_width, slots_per_row;
+    uint16_t *glyphs; /* Slot of each BMP character, 0 if missing */
+
+    /* One background quad per cell, followed by one glyph quad per cell,
+     * only rebuilt for the rows that changed */
+    GLfloat *vertices, *texcoords;
+    GLubyte *colors;
+    uint8_t *dirty_rows;
+    int cols, rows;
 };
 
 static int gl_init_graphics(caca_display_t *dp)
@@ -108,12 +120,14 @@ static int gl_init_graphics(caca_display_t *dp)
     if(fonts[0] == NULL)
     {
         fprintf(stderr, "error: libcaca was compiled without any fonts\n");
+        free(dp->drv.p);
         return -1;
     }
     dp->drv.p->f = caca_load_font(fonts[0], 0);
     if(dp->drv.p->f == NULL)
     {
         fprintf(stderr, "error: could not load font \"%s\"\n", fonts[0]);
+        free(dp->drv.p);
         return -1;
     }
 
@@ -134,8 +148,10 @@ static int gl_init_graphics(caca_display_t *dp)
     dp->drv.p->key = 0;
     dp->drv.p->special_key = 0;
 
-    dp->drv.p->sw = ((float)dp->drv.p->font_width) / 16.0f;
-    dp->drv.p->sh = ((float)dp->drv.p->font_height) / 16.0f;
+    dp->drv.p->vertices = dp->drv.p->texcoords = NULL;
+    dp->drv.p->colors = NULL;
+    dp->drv.p->dirty_rows = NULL;
+    dp->drv.p->cols = dp->drv.p->rows = 0;
 
     if(!glut_init)
     {
@@ -181,7 +197,17 @@ static int gl_init_graphics(caca_display_t *dp)
 
     glEnable(GL_TEXTURE_2D);
 
-    gl_compute_font(dp);
+    if(gl_compute_font(dp))
+    {
+        glutDestroyWindow(dp->drv.p->window);
+        caca_free_font(dp->drv.p->f);
+        free(dp->drv.p);
+        return -1;
+    }
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
 
     return 0;
 }
@@ -191,7 +217,12 @@ static int gl_end_graphics(caca_display_t *dp)
     glutHideWindow();
     glutDestroyWindow(dp->drv.p->window);
     caca_free_font(dp->drv.p->f);
-    free(dp->drv.p->txid);
+    glDeleteTextures(1, &dp->drv.p->texture);
+    free(dp->drv.p->glyphs);
+    free(dp->drv.p->vertices);
+    free(dp->drv.p->texcoords);
+    free(dp->drv.p->colors);
+    free(dp->drv.p->dirty_rows);
     free(dp->drv.p);
     return 0;
 }
@@ -214,99 +245,44 @@ static int gl_get_display_height(caca_display_t const *dp)
 
 static void gl_display(caca_display_t *dp)
 {
-    uint32_t const *cvchars = caca_get_canvas_chars(dp->cv);
-    uint32_t const *cvattrs = caca_get_canvas_attrs(dp->cv);
     int width = caca_get_canvas_width(dp->cv);
-    int x, y, line;
+    int height = caca_get_canvas_height(dp->cv);
+    int i, y;
 
-    glClear(GL_COLOR_BUFFER_BIT);
-    glDisable(GL_TEXTURE_2D);
-    glDisable(GL_BLEND);
-    line = 0;
-    for(y = 0; y < dp->drv.p->height; y += dp->drv.p->font_height)
+    /* Only rebuild the vertices of the rows that changed */
+    if(dp->drv.p->cols != width || dp->drv.p->rows != height)
     {
-        uint32_t const *attrs = cvattrs + line * width;
-
-        /* FIXME: optimise using stride */
-        for(x = 0; x < dp->drv.p->width; x += dp->drv.p->font_width)
-        {
-            uint16_t bg = caca_attr_to_rgb12_bg(*attrs++);
-
-            glColor4b(((bg & 0xf00) >> 8) * 8,
-                      ((bg & 0x0f0) >> 4) * 8,
-                      (bg & 0x00f) * 8,
-                      0xff);
-            glBegin(GL_QUADS);
-            glVertex2f(x, y);
-            glVertex2f(x + dp->drv.p->font_width, y);
-            glVertex2f(x + dp->drv.p->font_width,
-                       y + dp->drv.p->font_height);
-            glVertex2f(x, y + dp->drv.p->font_height);
-            glEnd();
-        }
-
-        line++;
+        if(gl_resize_arrays(dp, width, height))
+            return;
+        memset(dp->drv.p->dirty_rows, 1, height);
     }
-
-    /* 2nd pass, avoids changing render state too much */
-    glEnable(GL_TEXTURE_2D);
-    glEnable(GL_BLEND);
-
-    line = 0;
-    for(y = 0; y < dp->drv.p->height; y += dp->drv.p->font_height, line++)
+    else
     {
-        uint32_t const *attrs = cvattrs + line * width;
-        uint32_t const *chars = cvchars + line * width;
-
-        for(x = 0; x < dp->drv.p->width; x += dp->drv.p->font_width, attrs++)
+        for(i = 0; i < caca_get_dirty_rect_count(dp->cv); i++)
         {
-            uint32_t ch = *chars++;
-            uint16_t fg;
-            int i, b, fullwidth;
-
-            fullwidth = caca_utf32_is_fullwidth(ch);
+            int dx, dy, dw, dh;
 
-            for(b = 0, i = 0; dp->drv.p->blocks[i + 1]; i += 2)
-            {
-                if(ch < (uint32_t)dp->drv.p->blocks[i])
-                     break;
-
-                if(ch >= (uint32_t)dp->drv.p->blocks[i + 1])
-                {
-                    b += (uint32_t)(dp->drv.p->blocks[i + 1]
-                                     - dp->drv.p->blocks[i]);
-                    continue;
-                }
-
-                glBindTexture(GL_TEXTURE_2D,
-                              dp->drv.p->txid[b + ch
-                                        - (uint32_t)dp->drv.p->blocks[i]]);
-
-                fg = caca_attr_to_rgb12_fg(*attrs);
-                glColor3b(((fg & 0xf00) >> 8) * 8,
-                          ((fg & 0x0f0) >> 4) * 8,
-                          (fg & 0x00f) * 8);
-                /* FIXME: handle fullwidth glyphs here */
-                glBegin(GL_QUADS);
-                glTexCoord2f(0, dp->drv.p->sh);
-                glVertex2f(x, y);
-                glTexCoord2f(dp->drv.p->sw, dp->drv.p->sh);
-                glVertex2f(x + dp->drv.p->font_width * (fullwidth ? 2 : 1), y);
-                glTexCoord2f(dp->drv.p->sw, 0);
-                glVertex2f(x + dp->drv.p->font_width * (fullwidth ? 2 : 1),
-                           y + dp->drv.p->font_height);
-                glTexCoord2f(0, 0);
-                glVertex2f(x, y + dp->drv.p->font_height);
-                glEnd();
-            }
-
-            if(fullwidth)
-            {
-                chars++; attrs++; x += dp->drv.p->font_width;
-            }
+            caca_get_dirty_rect(dp->cv, i, &dx, &dy, &dw, &dh);
+            memset(dp->drv.p->dirty_rows + dy, 1, dh);
         }
     }
 
+    for(y = 0; y < height; y++)
+        if(dp->drv.p->dirty_rows[y])
+        {
+            gl_build_row(dp, y);
+            dp->drv.p->dirty_rows[y] = 0;
+        }
+
+    /* Backgrounds use an opaque part of the texture, so that everything
+     * is drawn at once */
+    glClear(GL_COLOR_BUFFER_BIT);
+    glBindTexture(GL_TEXTURE_2D, dp->drv.p->texture);
+    glVertexPointer(2, GL_FLOAT, 0, dp->drv.p->vertices);
+    glTexCoordPointer(2, GL_FLOAT, 0, dp->drv.p->texcoords);
+    glColorPointer(4, GL_UNSIGNED_BYTE, 0, dp->drv.p->colors);
+    glDrawArrays(GL_QUADS, 0, 8 * width * height);
+
 #ifdef HAVE_GLUTCHECKLOOP
     glutCheckLoop();
 #else
@@ -519,85 +495,237 @@ static void _display(void)
     gl_display(dp);
 }
 
-static void gl_compute_font(caca_display_t *dp)
+static int gl_compute_font(caca_display_t *dp)
 {
     caca_canvas_t *cv;
     uint32_t *image;
-    int i, b, w, h, x, y;
+    uint8_t *atlas;
+    int fw = (int)dp->drv.p->font_width, fh = (int)dp->drv.p->font_height;
+    int i, b, n, x, y, rows, max;
 
     /* Count how many glyphs this font has */
     dp->drv.p->blocks = caca_get_font_blocks(dp->drv.p->f);
 
-    for(b = 0, i = 0; dp->drv.p->blocks[i + 1]; i += 2)
-        b += (int)(dp->drv.p->blocks[i + 1] - dp->drv.p->blocks[i]);
+    for(n = 0, i = 0; dp->drv.p->blocks[i + 1]; i += 2)
+        n += (int)(dp->drv.p->blocks[i + 1] - dp->drv.p->blocks[i]);
+
+    /* Choose a texture size, keeping to powers of two for old hardware */
+    dp->drv.p->slot_width = 2 * fw;
+    dp->drv.p->slots_per_row = 1024 / dp->drv.p->slot_width;
+    if(dp->drv.p->slots_per_row < 1)
+        dp->drv.p->slots_per_row = 1;
+    rows = (n + 1 + dp->drv.p->slots_per_row - 1) / dp->drv.p->slots_per_row;
+
+    for(x = 1; x < dp->drv.p->slots_per_row * dp->drv.p->slot_width; x *= 2)
+        ;
+    for(y = 1; y < rows * fh; y *= 2)
+        ;
+    dp->drv.p->tex_width = x;
+    dp->drv.p->tex_height = y;
+
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max);
+    if(dp->drv.p->tex_width > max || dp->drv.p->tex_height > max)
+    {
+        fprintf(stderr, "error: font texture is too large\n");
+        return -1;
+    }
 
     /* Allocate a libcaca canvas and print all the glyphs on it */
-    cv = caca_create_canvas(2, b);
+    cv = caca_create_canvas(2, n);
     caca_set_color_ansi(cv, CACA_WHITE, CACA_BLACK);
 
+    dp->drv.p->glyphs = calloc(0x10000, sizeof(uint16_t));
     for(b = 0, i = 0; dp->drv.p->blocks[i + 1]; i += 2)
     {
-        int j, n = (int)(dp->drv.p->blocks[i + 1] - dp->drv.p->blocks[i]);
+        int j, m = (int)(dp->drv.p->blocks[i + 1] - dp->drv.p->blocks[i]);
 
-        for(j = 0; j < n; j++)
-            caca_put_char(cv, 0, b + j, dp->drv.p->blocks[i] + j);
+        for(j = 0; j < m; j++)
+        {
+            uint32_t ch = dp->drv.p->blocks[i] + j;
+
+            caca_put_char(cv, 0, b + j, ch);
+            if(ch < 0x10000 && dp->drv.p->glyphs)
+                dp->drv.p->glyphs[ch] = b + j + 1;
+        }
 
-        b += n;
+        b += m;
     }
 
     /* Draw the caca canvas onto an image buffer */
-    image = malloc(b * dp->drv.p->font_height *
-                   2 * dp->drv.p->font_width * sizeof(uint32_t));
-    caca_render_canvas(cv, dp->drv.p->f, image, 2 * dp->drv.p->font_width,
-                        b * dp->drv.p->font_height, 8 * dp->drv.p->font_width);
+    image = malloc(n * fh * 2 * fw * sizeof(uint32_t));
+    atlas = calloc(dp->drv.p->tex_width * dp->drv.p->tex_height, 4);
+    if(!dp->drv.p->glyphs || !image || !atlas)
+    {
+        caca_free_canvas(cv);
+        free(dp->drv.p->glyphs);
+        free(image);
+        free(atlas);
+        return -1;
+    }
+
+    caca_render_canvas(cv, dp->drv.p->f, image, 2 * fw, n * fh, 8 * fw);
     caca_free_canvas(cv);
 
-    /* Convert all glyphs in the image buffer to GL textures */
-    dp->drv.p->txid = malloc(b * sizeof(int));
+    /* The first slot is opaque white, the others are white glyphs with
+     * their coverage in the alpha channel */
+    for(i = 0; i <= n; i++)
+    {
+        int sx = i % dp->drv.p->slots_per_row * dp->drv.p->slot_width;
+        int sy = i / dp->drv.p->slots_per_row * fh;
+
+        for(y = 0; y < fh; y++)
+            for(x = 0; x < 2 * fw; x++)
+            {
+                uint8_t *pixel = atlas + ((sy + y) * dp->drv.p->tex_width
+                                           + sx + x) * 4;
 
-    w = dp->drv.p->font_width <= 16 ? dp->drv.p->font_width : 16;
-    h = dp->drv.p->font_height <= 16 ? dp->drv.p->font_height : 16;
+                pixel[0] = pixel[1] = pixel[2] = 0xff;
+                pixel[3] = i ? image[((i - 1) * fh + y) * 2 * fw + x] >> 8
+                             : 0xff;
+            }
+    }
 
-    for(b = 0, i = 0; dp->drv.p->blocks[i + 1]; i += 2)
+    free(image);
+
+    glGenTextures(1, &dp->drv.p->texture);
+    glBindTexture(GL_TEXTURE_2D, dp->drv.p->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, dp->drv.p->tex_width,
+                 dp->drv.p->tex_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, atlas);
+
+    free(atlas);
+
+    return 0;
+}
+
+static int gl_resize_arrays(caca_display_t *dp, int width, int height)
+{
+    int quads = 2 * width * height;
+    int rows = height;
+    GLfloat *vertices, *texcoords;
+    GLubyte *colors;
+    uint8_t *dirty_rows;
+
+    /* realloc(p, 0) may free p and return NULL, which we would take for
+     * a failure and free again later, so always keep one cell around. */
+    if(quads < 2)
+        quads = 2;
+    if(rows < 1)
+        rows = 1;
+
+    vertices = realloc(dp->drv.p->vertices, quads * 8 * sizeof(GLfloat));
+    if(vertices)
+        dp->drv.p->vertices = vertices;
+    texcoords = realloc(dp->drv.p->texcoords, quads * 8 * sizeof(GLfloat));
+    if(texcoords)
+        dp->drv.p->texcoords = texcoords;
+    colors = realloc(dp->drv.p->colors, quads * 16);
+    if(colors)
+        dp->drv.p->colors = colors;
+    dirty_rows = realloc(dp->drv.p->dirty_rows, rows);
+    if(dirty_rows)
+        dp->drv.p->dirty_rows = dirty_rows;
+
+    if(!vertices || !texcoords || !colors || !dirty_rows)
     {
-        int j, n = (int)(dp->drv.p->blocks[i + 1] - dp->drv.p->blocks[i]);
+        /* Try again at the next refresh */
+        dp->drv.p->cols = dp->drv.p->rows = 0;
+        return -1;
+    }
 
-        for(j = 0; j < n; j++)
-        {
-            uint8_t tmp[16 * 8 * 16];
-            uint32_t *glyph = image + (int)((b + j) * dp->drv.p->font_width * 2
-                                            * dp->drv.p->font_height);
-            int fullwidth =
-                    caca_utf32_is_fullwidth(dp->drv.p->blocks[i] + j);
+    dp->drv.p->cols = width;
+    dp->drv.p->rows = height;
 
-            memset(tmp, 0, 16 * 8 * 16);
+    return 0;
+}
 
-            for(y = 0; y < h; y++)
+static void gl_build_row(caca_display_t *dp, int y)
+{
+    int width = caca_get_canvas_width(dp->cv);
+    int height = caca_get_canvas_height(dp->cv);
+    uint32_t const *chars = caca_get_canvas_chars(dp->cv) + y * width;
+    uint32_t const *attrs = caca_get_canvas_attrs(dp->cv) + y * width;
+    float fw = dp->drv.p->font_width, fh = dp->drv.p->font_height;
+    float tw = dp->drv.p->tex_width, th = dp->drv.p->tex_height;
+    float ox = fw / tw, oy = fh / 2 / th;
+    int x, i, j;
+
+    for(x = 0; x < width; x++)
+    {
+        int cell = y * width + x;
+        GLfloat *v = dp->drv.p->vertices + cell * 8;
+        GLfloat *t = dp->drv.p->texcoords + cell * 8;
+        GLubyte *c = dp->drv.p->colors + cell * 16;
+        uint32_t ch = chars[x];
+        uint16_t bg = caca_attr_to_rgb12_bg(attrs[x]);
+        uint16_t fg = caca_attr_to_rgb12_fg(attrs[x]);
+        int slot = 0, cols = caca_utf32_is_fullwidth(ch) ? 2 : 1;
+
+        /* Background, textured with the middle of the opaque slot */
+        v[0] = v[6] = x * fw;
+        v[2] = v[4] = (x + 1) * fw;
+        v[1] = v[3] = y * fh;
+        v[5] = v[7] = (y + 1) * fh;
+        for(j = 0; j < 8; j += 2)
+        {
+            t[j] = ox;
+            t[j + 1] = oy;
+        }
+        for(j = 0; j < 16; j += 4)
+        {
+            c[j] = ((bg >> 8) & 0xf) * 0x11;
+            c[j + 1] = ((bg >> 4) & 0xf) * 0x11;
+            c[j + 2] = (bg & 0xf) * 0x11;
+            c[j + 3] = 0xff;
+        }
+
+        /* Find the glyph's slot */
+        if(ch < 0x10000)
+            slot = dp->drv.p->glyphs[ch];
+        else
+            for(i = 0, j = 1; dp->drv.p->blocks[i + 1]; i += 2)
             {
-                for(x = 0; x < w * (fullwidth ? 2 : 1); x++)
+                if(ch < dp->drv.p->blocks[i])
+                    break;
+
+                if(ch < dp->drv.p->blocks[i + 1])
                 {
-                    int offset = x + (15 - y) * (fullwidth ? 32 : 16);
-                    uint8_t c = glyph[x + y * 2 * (int)dp->drv.p->font_width]
-                                 >> 8;
-                    tmp[offset * 4] = c;
-                    tmp[offset * 4 + 1] = c;
-                    tmp[offset * 4 + 2] = c;
-                    tmp[offset * 4 + 3] = c;
+                    slot = j + ch - dp->drv.p->blocks[i];
+                    break;
                 }
+
+                j += dp->drv.p->blocks[i + 1] - dp->drv.p->blocks[i];
             }
 
-            glGenTextures(1, (GLuint*)&dp->drv.p->txid[b + j]);
-            glBindTexture(GL_TEXTURE_2D, dp->drv.p->txid[b + j]);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-            glTexImage2D(GL_TEXTURE_2D, 0, 4, (fullwidth ? 32 : 16), 16, 0,
-                         GL_RGBA, GL_UNSIGNED_BYTE, tmp);
+        v += width * height * 8;
+        t += width * height * 8;
+        c += width * height * 16;
+
+        /* Empty quads for spaces and missing glyphs */
+        if(!slot || ch == ' ' || ch == CACA_MAGIC_FULLWIDTH)
+        {
+            memset(v, 0, 8 * sizeof(GLfloat));
+            continue;
         }
 
-        b += n;
+        v[0] = v[6] = x * fw;
+        v[2] = v[4] = (x + cols) * fw;
+        v[1] = v[3] = y * fh;
+        v[5] = v[7] = (y + 1) * fh;
+        t[0] = t[6] = (float)(slot % dp->drv.p->slots_per_row
+                               * dp->drv.p->slot_width) / tw;
+        t[2] = t[4] = t[0] + cols * fw / tw;
+        t[1] = t[3] = (float)(slot / dp->drv.p->slots_per_row) * fh / th;
+        t[5] = t[7] = t[1] + fh / th;
+        for(j = 0; j < 16; j += 4)
+        {
+            c[j] = ((fg >> 8) & 0xf) * 0x11;
+            c[j + 1] = ((fg >> 4) & 0xf) * 0x11;
+            c[j + 2] = (fg & 0xf) * 0x11;
+            c[j + 3] = 0xff;
+        }
     }
-
-    free(image);
 }
 
 /*
@@ -624,6 +752,7 @@ int gl_install(caca_display_t *dp)
     dp->drv.get_event = gl_get_event;
     dp->drv.set_mouse = gl_set_mouse;
     dp->drv.set_cursor = NULL;
+    dp->drv.get_fd = NULL;
 
     return 0;
 }
@@ -20,6 +20,7 @@
 #if defined USE_NCURSES
 
 #if defined HAVE_NCURSESW_NCURSES_H
+#   define _XOPEN_SOURCE_EXTENDED 1 /* For the wide character API */
 #   include <ncursesw/ncurses.h>
 #elif defined HAVE_NCURSES_NCURSES_H
 #   include <ncurses/ncurses.h>
@@ -195,13 +196,21 @@ static caca_display_t *sigwinch_d; /* FIXME: we ought to get rid of this */
 static void ncurses_install_terminal(caca_display_t *);
 static void ncurses_uninstall_terminal(caca_display_t *);
 #endif
+static attr_t ncurses_get_attr(caca_display_t *, uint32_t);
+static void ncurses_write_run(uint32_t const *, int, attr_t);
+#if !defined HAVE_NCURSESW_NCURSES_H
 static void ncurses_write_utf32(uint32_t);
+#endif
 
 struct driver_private
 {
     int attr[16*16];
     mmask_t oldmask;
     char *term;
+
+    /* The last libcaca attribute seen, and its curses equivalent */
+    uint32_t last;
+    attr_t last_attr;
 };
 
 static int ncurses_init_graphics(caca_display_t *dp)
@@ -242,6 +251,7 @@ static int ncurses_init_graphics(caca_display_t *dp)
 
 #if defined HAVE_SIGNAL
     sigwinch_d = dp;
+    _caca_open_resize_pipe(dp);
     signal(SIGWINCH, sigwinch_handler);
 #endif
 
@@ -308,6 +318,10 @@ static int ncurses_init_graphics(caca_display_t *dp)
             }
         }
 
+    /* Prime the attribute cache */
+    dp->drv.p->last = 1;
+    ncurses_get_attr(dp, 0);
+
     caca_add_dirty_rect(dp->cv, 0, 0, dp->cv->width, dp->cv->height);
     dp->resize.allow = 1;
     caca_set_canvas_size(dp->cv, COLS, LINES);
@@ -368,24 +382,24 @@ static void ncurses_display(caca_display_t *dp)
 
         for(y = dy; y < dy + dh; y++)
         {
-            move(y, dx);
-            for(x = dx; x < dx + dw; x++)
+            /* Send runs of cells sharing the same curses attribute in
+             * one go, since curses does a lot of work for every call. */
+            for(x = 0; x < dw; )
             {
-                uint32_t attr = *cvattrs++;
+                attr_t attr = ncurses_get_attr(dp, cvattrs[x]);
+                int start = x;
 
-                (void)attrset(dp->drv.p->attr[caca_attr_to_ansi(attr)]);
-                if(attr & CACA_BOLD)
-                    attron(A_BOLD);
-                if(attr & CACA_BLINK)
-                    attron(A_BLINK);
-                if(attr & CACA_UNDERLINE)
-                    attron(A_UNDERLINE);
+                for(x++; x < dw; x++)
+                    if(cvattrs[x] != cvattrs[x - 1]
+                        && ncurses_get_attr(dp, cvattrs[x]) != attr)
+                        break;
 
-                ncurses_write_utf32(*cvchars++);
+                move(y, dx + start);
+                ncurses_write_run(cvchars + start, x - start, attr);
             }
 
-            cvchars += dp->cv->width - dw;
-            cvattrs += dp->cv->width - dw;
+            cvchars += dp->cv->width;
+            cvattrs += dp->cv->width;
         }
     }
 
@@ -589,6 +603,11 @@ static void ncurses_set_cursor(caca_display_t *dp, int flags)
         curs_set(1);
 }
 
+static int ncurses_get_fd(caca_display_t const *dp)
+{
+    return fileno(stdin);
+}
+
 /*
  * XXX: following functions are local
  */
@@ -596,7 +615,7 @@ static void ncurses_set_cursor(caca_display_t *dp, int flags)
 #if defined HAVE_SIGNAL
 static void sigwinch_handler(int sig)
 {
-    sigwinch_d->resize.resized = 1;
+    _caca_signal_resize(sigwinch_d);
 
     signal(SIGWINCH, sigwinch_handler);
 }
@@ -646,21 +665,77 @@ static void ncurses_uninstall_terminal(caca_display_t *dp)
 }
 #endif
 
-static void ncurses_write_utf32(uint32_t ch)
+static attr_t ncurses_get_attr(caca_display_t *dp, uint32_t attr)
+{
+    struct driver_private *p = dp->drv.p;
+
+    if(attr != p->last)
+    {
+        p->last = attr;
+        p->last_attr = p->attr[caca_attr_to_ansi(attr)];
+        if(attr & CACA_BOLD)
+            p->last_attr |= A_BOLD;
+        if(attr & CACA_BLINK)
+            p->last_attr |= A_BLINK;
+        if(attr & CACA_UNDERLINE)
+            p->last_attr |= A_UNDERLINE;
+    }
+
+    return p->last_attr;
+}
+
+static void ncurses_write_run(uint32_t const *chars, int n, attr_t attr)
 {
 #if defined HAVE_NCURSESW_NCURSES_H
-    char buf[10];
-    int bytes;
+    /* Store the cells directly into the window, which spares curses the
+     * multibyte decoding and cursor handling that waddstr() does. */
+    cchar_t buf[256];
+    wchar_t wch[2] = { 0, 0 };
+    int len = 0, cols = 0, x, y;
+
+    while(n--)
+    {
+        uint32_t ch = *chars++;
+
+        /* The right half of a wide character that was already written */
+        if(ch == CACA_MAGIC_FULLWIDTH && !len)
+        {
+            getyx(stdscr, y, x);
+            move(y, x + 1);
+            continue;
+        }
+
+        cols++;
+
+        if(ch != CACA_MAGIC_FULLWIDTH)
+        {
+            /* Control characters would be sent to the terminal as is */
+            wch[0] = ch < 0x20 || ch == 0x7f ? ' ' : ch;
+            setcchar(buf + len++, wch, attr & ~A_COLOR, PAIR_NUMBER(attr),
+                      NULL);
+        }
+
+        if(len && (!n || len == sizeof(buf) / sizeof(*buf)))
+        {
+            wadd_wchnstr(stdscr, buf, len);
+            getyx(stdscr, y, x);
+            move(y, x + cols);
+            len = cols = 0;
+        }
+    }
+#else
+    (void)attrset(attr);
+    while(n--)
+        ncurses_write_utf32(*chars++);
 #endif
+}
 
+#if !defined HAVE_NCURSESW_NCURSES_H
+static void ncurses_write_utf32(uint32_t ch)
+{
     if(ch == CACA_MAGIC_FULLWIDTH)
         return;
 
-#if defined HAVE_NCURSESW_NCURSES_H
-    bytes = caca_utf32_to_utf8(buf, ch);
-    buf[bytes] = '\0';
-    addstr(buf);
-#else
     if(ch < 0x80)
     {
         addch(ch);
@@ -857,8 +932,8 @@ static void ncurses_write_utf32(uint32_t ch)
             addch(cch2);
         }
     }
-#endif
 }
+#endif
 
 /*
  * Driver initialisation
@@ -879,6 +954,7 @@ int ncurses_install(caca_display_t *dp)
     dp->drv.get_event = ncurses_get_event;
     dp->drv.set_mouse = NULL;
     dp->drv.set_cursor = ncurses_set_cursor;
+    dp->drv.get_fd = ncurses_get_fd;
 
     return 0;
 }
@@ -83,6 +83,7 @@ int null_install(caca_display_t *dp)
     dp->drv.get_event = null_get_event;
     dp->drv.set_mouse = NULL;
     dp->drv.set_cursor = NULL;
+    dp->drv.get_fd = NULL;
 
     return 0;
 }
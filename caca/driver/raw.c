@@ -24,12 +24,26 @@
 #include "caca.h"
 #include "caca_internals.h"
 
+struct driver_private
+{
+    /* Export buffer, reused across frames */
+    void *buffer;
+    size_t size;
+};
+
 static int raw_init_graphics(caca_display_t *dp)
 {
     int width = caca_get_canvas_width(dp->cv);
     int height = caca_get_canvas_height(dp->cv);
     char const *geometry;
 
+    dp->drv.p = malloc(sizeof(struct driver_private));
+    if(dp->drv.p == NULL)
+        return -1;
+
+    dp->drv.p->buffer = NULL;
+    dp->drv.p->size = 0;
+
 #if defined(HAVE_GETENV)
     geometry = getenv("CACA_GEOMETRY");
     if(geometry && *geometry)
@@ -45,6 +59,9 @@ static int raw_init_graphics(caca_display_t *dp)
 
 static int raw_end_graphics(caca_display_t *dp)
 {
+    free(dp->drv.p->buffer);
+    free(dp->drv.p);
+
     return 0;
 }
 
@@ -65,15 +82,24 @@ static int raw_get_display_height(caca_display_t const *dp)
 
 static void raw_display(caca_display_t *dp)
 {
-    void *buffer;
-    size_t len;
-
-    buffer = caca_export_canvas_to_memory(dp->cv, "caca", &len);
-    if(!buffer)
-        return;
-    fwrite(buffer, len, 1, stdout);
+    ssize_t len;
+
+    /* Export straight into our buffer, growing it when the canvas does */
+    len = caca_export_canvas_to_buffer(dp->cv, "caca",
+                                       dp->drv.p->buffer, dp->drv.p->size);
+    if(len > (ssize_t)dp->drv.p->size)
+    {
+        void *buffer = realloc(dp->drv.p->buffer, len);
+        if(!buffer)
+            return;
+        dp->drv.p->buffer = buffer;
+        dp->drv.p->size = len;
+        caca_export_canvas_to_buffer(dp->cv, "caca",
+                                     dp->drv.p->buffer, dp->drv.p->size);
+    }
+
+    fwrite(dp->drv.p->buffer, len, 1, stdout);
     fflush(stdout);
-    free(buffer);
 }
 
 static void raw_handle_resize(caca_display_t *dp)
@@ -106,6 +132,7 @@ int raw_install(caca_display_t *dp)
     dp->drv.get_event = raw_get_event;
     dp->drv.set_mouse = NULL;
     dp->drv.set_cursor = NULL;
+    dp->drv.get_fd = NULL;
 
     return 0;
 }
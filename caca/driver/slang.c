@@ -133,6 +133,7 @@ static int slang_init_graphics(caca_display_t *dp)
 
 #if defined(HAVE_SIGNAL)
     sigwinch_d = dp;
+    _caca_open_resize_pipe(dp);
     signal(SIGWINCH, sigwinch_handler);
 #endif
 
@@ -464,6 +465,11 @@ static void slang_set_cursor(caca_display_t *dp, int flags)
     SLtt_set_cursor_visibility(flags ? 1 : 0);
 }
 
+static int slang_get_fd(caca_display_t const *dp)
+{
+    return SLang_TT_Read_FD;
+}
+
 /*
  * XXX: following functions are local
  */
@@ -538,7 +544,7 @@ static void slang_write_utf32(uint32_t ch)
 #if defined(HAVE_SIGNAL)
 static void sigwinch_handler(int sig)
 {
-    sigwinch_d->resize.resized = 1;
+    _caca_signal_resize(sigwinch_d);
 
     signal(SIGWINCH, sigwinch_handler);
 }
@@ -602,6 +608,7 @@ int slang_install(caca_display_t *dp)
     dp->drv.get_event = slang_get_event;
     dp->drv.set_mouse = NULL;
     dp->drv.set_cursor = slang_set_cursor;
+    dp->drv.get_fd = slang_get_fd;
 
     return 0;
 }
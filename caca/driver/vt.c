@@ -0,0 +1,838 @@
+/*
+ *  libcaca     Colour ASCII-Art library
+ *  Copyright © 2026 agent <agent@local>
+ *              All Rights Reserved
+ *
+ *  This library is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by Sam Hocevar. See
+ *  http://www.wtfpl.net/ for more details.
+ */
+
+/*
+ *  This file contains the libcaca VT/ANSI terminal input and output
+ *  driver. It does not depend on any terminal library: it keeps its own
+ *  copy of what the terminal shows, and sends escape sequences for the
+ *  cells of the dirty rectangles that actually differ from it.
+ */
+
+#include "config.h"
+
+#if defined USE_VT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <termios.h>
+
+#if defined HAVE_SIGNAL_H
+#   include <signal.h>
+#endif
+#if defined HAVE_SYS_IOCTL_H
+#   include <sys/ioctl.h>
+#endif
+#if defined HAVE_POLL_H
+#   include <poll.h>
+#endif
+
+#include "caca.h"
+#include "caca_internals.h"
+
+/* Terminal renditions are stored as a foreground colour (0-15, or 16 for
+ * the default colour), a background colour and the libcaca style bits. */
+#define KEY_DEFAULT (0x10 | 0x10 << 5)
+#define KEY_UNKNOWN 0xffffffff
+
+/* Longest sequence that vt_put_cell() may write for one cell */
+#define CELL_MAX 64
+
+/* How long to wait for the end of an escape sequence, in milliseconds */
+#define ESC_DELAY 10
+
+/*
+ * Local functions
+ */
+
+#if defined HAVE_SIGNAL
+static void sigwinch_handler(int);
+static caca_display_t *sigwinch_d; /* FIXME: we ought to get rid of this */
+#endif
+static int vt_set_front(caca_display_t *);
+static uint32_t vt_get_key(caca_display_t *, uint32_t);
+static int vt_put_cell(caca_display_t *, int, int);
+static char *vt_move(caca_display_t *, char *, int, int);
+static char *vt_sgr(char *, uint32_t, uint32_t);
+static char *vt_reserve(caca_display_t *, size_t);
+static void vt_write(char const *, size_t);
+static int vt_parse_key(caca_display_t *, caca_privevent_t *, int);
+static int vt_parse_mouse(caca_display_t *, caca_privevent_t *, int);
+
+struct driver_private
+{
+    struct termios tio;
+
+    /* What the terminal currently shows, and its cursor position and
+     * rendition; x is negative if the cursor position is unknown. */
+    uint32_t *chars, *keys;
+    int width, height;
+    int x, y, cursor;
+    uint32_t key;
+
+    /* The last libcaca attribute seen, and its rendition */
+    uint32_t last, last_key;
+
+    /* Output buffer, sent with one write() per frame */
+    char *buf;
+    size_t size, len;
+
+    /* Input bytes that were not parsed yet */
+    unsigned char in[64];
+    int inlen;
+};
+
+static int vt_init_graphics(caca_display_t *dp)
+{
+    struct termios tio;
+    int width = 80, height = 24;
+#if defined HAVE_SYS_IOCTL_H
+    struct winsize size;
+#endif
+
+    if(!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO))
+        return -1;
+
+    dp->drv.p = malloc(sizeof(struct driver_private));
+    if(dp->drv.p == NULL)
+        return -1;
+
+    if(tcgetattr(STDIN_FILENO, &dp->drv.p->tio) < 0)
+    {
+        free(dp->drv.p);
+        return -1;
+    }
+
+    /* Like curses’ raw(): no echo, no signals, no line or output
+     * processing, and non-blocking reads */
+    tio = dp->drv.p->tio;
+    tio.c_iflag &= ~(BRKINT | ICRNL | INLCR | IGNCR | ISTRIP | IXON);
+    tio.c_oflag &= ~OPOST;
+    tio.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &tio);
+
+    dp->drv.p->chars = dp->drv.p->keys = NULL;
+    dp->drv.p->width = dp->drv.p->height = 0;
+    dp->drv.p->cursor = 0;
+    dp->drv.p->last = 0;
+    dp->drv.p->last_key = KEY_DEFAULT;
+    dp->drv.p->buf = NULL;
+    dp->drv.p->size = dp->drv.p->len = 0;
+    dp->drv.p->inlen = 0;
+
+#if defined HAVE_SIGNAL
+    sigwinch_d = dp;
+    _caca_open_resize_pipe(dp);
+    signal(SIGWINCH, sigwinch_handler);
+#endif
+
+    _caca_set_term_title("caca for VT terminals");
+
+    /* Use the alternate screen, hide the cursor, disable line wrapping,
+     * and report all mouse events using the SGR encoding. */
+    vt_write("\033[?1049h\033[?25l\033[?7l\033[?1003h\033[?1006h", 35);
+
+#if defined HAVE_SYS_IOCTL_H
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0
+        && size.ws_col && size.ws_row)
+    {
+        width = size.ws_col;
+        height = size.ws_row;
+    }
+#endif
+
+    dp->resize.allow = 1;
+    caca_set_canvas_size(dp->cv, width, height);
+    dp->resize.allow = 0;
+
+    return 0;
+}
+
+static int vt_end_graphics(caca_display_t *dp)
+{
+    vt_write("\033[0m\033[?1006l\033[?1003l\033[?7h\033[?25h\033[?1049l", 39);
+    _caca_set_term_title("");
+
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &dp->drv.p->tio);
+
+#if defined HAVE_SIGNAL
+    signal(SIGWINCH, SIG_DFL);
+#endif
+
+    free(dp->drv.p->chars);
+    free(dp->drv.p->keys);
+    free(dp->drv.p->buf);
+    free(dp->drv.p);
+
+    return 0;
+}
+
+static int vt_set_display_title(caca_display_t *dp, char const *title)
+{
+    _caca_set_term_title(title);
+
+    return 0;
+}
+
+static int vt_get_display_width(caca_display_t const *dp)
+{
+    /* Fallback to a 6x10 font */
+    return caca_get_canvas_width(dp->cv) * 6;
+}
+
+static int vt_get_display_height(caca_display_t const *dp)
+{
+    /* Fallback to a 6x10 font */
+    return caca_get_canvas_height(dp->cv) * 10;
+}
+
+static void vt_display(caca_display_t *dp)
+{
+    struct driver_private *p = dp->drv.p;
+    int width = caca_get_canvas_width(dp->cv);
+    int height = caca_get_canvas_height(dp->cv);
+    int full = p->width != width || p->height != height;
+    int i, x, y, dx, dy, dw, dh, count;
+
+    p->len = 0;
+
+    /* After a resize, clear the screen and paint everything */
+    if(full)
+    {
+        if(vt_set_front(dp))
+            return;
+        count = 1;
+    }
+    else
+        count = caca_get_dirty_rect_count(dp->cv);
+
+    for(i = 0; i < count; i++)
+    {
+        uint32_t const *chars, *keys;
+
+        if(full)
+        {
+            dx = dy = 0;
+            dw = width;
+            dh = height;
+        }
+        else
+            caca_get_dirty_rect(dp->cv, i, &dx, &dy, &dw, &dh);
+
+        for(y = dy; y < dy + dh; y++)
+        {
+            chars = caca_get_canvas_chars(dp->cv) + y * width;
+            keys = p->keys + y * width;
+
+            /* Also repaint cells that were damaged by a neighbour */
+            for(x = dx; x < width && (x < dx + dw || keys[x] == KEY_UNKNOWN); )
+            {
+                uint32_t ch = chars[x];
+
+                if(ch == p->chars[y * width + x]
+                    && keys[x] != KEY_UNKNOWN
+                    && vt_get_key(dp, caca_get_canvas_attrs(dp->cv)
+                                       [y * width + x]) == keys[x])
+                {
+                    x++;
+                    continue;
+                }
+
+                /* Repaint both halves of fullwidth characters */
+                if(x > 0 && ((ch == CACA_MAGIC_FULLWIDTH
+                               && caca_utf32_is_fullwidth(chars[x - 1]))
+                             || (p->chars[y * width + x]
+                                   == CACA_MAGIC_FULLWIDTH
+                                 && caca_utf32_is_fullwidth(
+                                        p->chars[y * width + x - 1]))))
+                    x--;
+
+                x += vt_put_cell(dp, x, y);
+            }
+        }
+    }
+
+    if(p->cursor)
+    {
+        char *cur = vt_reserve(dp, CELL_MAX);
+
+        /* Clamp the position like the terminal would, so that the next
+         * frame knows where the cursor is */
+        x = caca_wherex(dp->cv);
+        y = caca_wherey(dp->cv);
+        x = x < 0 ? 0 : x >= width ? width - 1 : x;
+        y = y < 0 ? 0 : y >= height ? height - 1 : y;
+
+        if(cur)
+        {
+            cur = vt_move(dp, cur, x, y);
+            p->len = cur - p->buf;
+            p->x = x;
+            p->y = y;
+        }
+    }
+
+    vt_write(p->buf, p->len);
+}
+
+static void vt_handle_resize(caca_display_t *dp)
+{
+#if defined HAVE_SYS_IOCTL_H
+    struct winsize size;
+
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0
+        && size.ws_col && size.ws_row)
+    {
+        dp->resize.w = size.ws_col;
+        dp->resize.h = size.ws_row;
+        return;
+    }
+#endif
+
+    /* Fallback */
+    dp->resize.w = caca_get_canvas_width(dp->cv);
+    dp->resize.h = caca_get_canvas_height(dp->cv);
+}
+
+static int vt_get_event(caca_display_t *dp, caca_privevent_t *ev)
+{
+    struct driver_private *p = dp->drv.p;
+    ssize_t ret = 0;
+    int bytes;
+
+    if(p->inlen < (int)sizeof(p->in))
+    {
+        ret = read(STDIN_FILENO, p->in + p->inlen,
+                   sizeof(p->in) - p->inlen);
+        if(ret > 0)
+            p->inlen += ret;
+    }
+
+    ev->type = CACA_EVENT_NONE;
+
+    if(!p->inlen)
+        return 0;
+
+    for( ; ; )
+    {
+#if defined HAVE_POLL_H
+        struct pollfd pfd;
+#endif
+
+        if(p->in[0] == '\033' && p->inlen > 2 && p->in[1] == '['
+            && p->in[2] == '<')
+            bytes = vt_parse_mouse(dp, ev, ret > 0);
+        else
+            bytes = vt_parse_key(dp, ev, ret > 0);
+
+        if(bytes)
+            break;
+
+        /* Wait a little for the rest of the sequence, because the caller
+         * may now block until there is more input */
+        ret = 0;
+#if defined HAVE_POLL_H
+        pfd.fd = STDIN_FILENO;
+        pfd.events = POLLIN;
+        if(poll(&pfd, 1, ESC_DELAY) > 0)
+#endif
+        {
+            ret = read(STDIN_FILENO, p->in + p->inlen,
+                       sizeof(p->in) - p->inlen);
+            if(ret > 0)
+                p->inlen += ret;
+        }
+    }
+
+    p->inlen -= bytes;
+    memmove(p->in, p->in + bytes, p->inlen);
+
+    return ev->type != CACA_EVENT_NONE;
+}
+
+static void vt_set_cursor(caca_display_t *dp, int flags)
+{
+    dp->drv.p->cursor = flags;
+    vt_write(flags ? "\033[?25h" : "\033[?25l", 6);
+}
+
+static int vt_get_fd(caca_display_t const *dp)
+{
+    return STDIN_FILENO;
+}
+
+/*
+ * XXX: following functions are local
+ */
+
+/* Reset the terminal and our copy of it after a resize */
+static int vt_set_front(caca_display_t *dp)
+{
+    struct driver_private *p = dp->drv.p;
+    int width = caca_get_canvas_width(dp->cv);
+    int height = caca_get_canvas_height(dp->cv);
+    char *cur;
+    int i;
+
+    free(p->chars);
+    free(p->keys);
+    p->chars = _caca_alloc2d(width, height, sizeof(uint32_t));
+    p->keys = _caca_alloc2d(width, height, sizeof(uint32_t));
+    cur = vt_reserve(dp, 16);
+
+    if(!p->chars || !p->keys || !cur)
+    {
+        free(p->chars);
+        free(p->keys);
+        p->chars = p->keys = NULL;
+        p->width = p->height = 0;
+        return -1;
+    }
+
+    for(i = 0; i < width * height; i++)
+    {
+        p->chars[i] = ' ';
+        p->keys[i] = KEY_DEFAULT;
+    }
+
+    memcpy(cur, "\033[0m\033[H\033[2J", 11);
+    p->len += 11;
+    p->width = width;
+    p->height = height;
+    p->x = p->y = 0;
+    p->key = KEY_DEFAULT;
+
+    return 0;
+}
+
+static uint32_t vt_get_key(caca_display_t *dp, uint32_t attr)
+{
+    struct driver_private *p = dp->drv.p;
+
+    if(attr != p->last)
+    {
+        uint8_t fg = caca_attr_to_ansi_fg(attr);
+        uint8_t bg = caca_attr_to_ansi_bg(attr);
+
+        p->last = attr;
+        p->last_key = (fg < 0x10 ? fg : 0x10) | (bg < 0x10 ? bg : 0x10) << 5
+                    | (attr & (CACA_BOLD | CACA_ITALICS
+                                | CACA_UNDERLINE | CACA_BLINK)) << 10;
+    }
+
+    return p->last_key;
+}
+
+/* Send the cell at (x, y) to the terminal, and return how many columns
+ * it covers. */
+static int vt_put_cell(caca_display_t *dp, int x, int y)
+{
+    struct driver_private *p = dp->drv.p;
+    int width = caca_get_canvas_width(dp->cv);
+    int i = y * width + x, cols = 1;
+    uint32_t const *chars = caca_get_canvas_chars(dp->cv);
+    uint32_t ch = chars[i], out = ch;
+    uint32_t key = vt_get_key(dp, caca_get_canvas_attrs(dp->cv)[i]);
+    char *cur = vt_reserve(dp, CELL_MAX);
+
+    if(!cur)
+    {
+        /* Paint everything again at the next refresh */
+        p->width = p->height = 0;
+        return width - x;
+    }
+
+    /* The terminal decides the width from the character itself, so only
+     * send fullwidth characters that have their right half, and stray
+     * right halves as spaces. */
+    if(caca_utf32_is_fullwidth(ch))
+    {
+        if(x + 1 < width && chars[i + 1] == CACA_MAGIC_FULLWIDTH)
+            cols = 2;
+        else
+            out = ' ';
+    }
+    else if(ch == CACA_MAGIC_FULLWIDTH || ch < 0x20 || ch == 0x7f)
+        out = ' ';
+
+    cur = vt_move(dp, cur, x, y);
+
+    if(key != p->key)
+        cur = vt_sgr(cur, p->key, key);
+
+    cur += caca_utf32_to_utf8(cur, out);
+    p->len = cur - p->buf;
+
+    p->chars[i] = ch;
+    p->keys[i] = key;
+    if(cols == 2)
+    {
+        p->chars[i + 1] = CACA_MAGIC_FULLWIDTH;
+        p->keys[i + 1] = key;
+    }
+
+    /* The terminal erased the other half of a fullwidth character that
+     * we overwrote on the right, so it will need to be repainted. */
+    if(x + cols < width && p->chars[i + cols] == CACA_MAGIC_FULLWIDTH)
+    {
+        p->chars[i + cols] = ' ';
+        p->keys[i + cols] = KEY_UNKNOWN;
+    }
+
+    /* Stay away from the last column, where terminals disagree */
+    p->key = key;
+    p->x = x + cols < width ? x + cols : -1;
+    p->y = y;
+
+    return cols;
+}
+
+/* Move the cursor to (x, y), with whatever sequence is the shortest */
+static char *vt_move(caca_display_t *dp, char *cur, int x, int y)
+{
+    struct driver_private *p = dp->drv.p;
+    char tmp[CELL_MAX], *rel = tmp;
+    int i, abs;
+
+    if(p->x == x && p->y == y)
+        return cur;
+
+    abs = y ? sprintf(cur, "\033[%i;%iH", y + 1, x + 1)
+            : x ? sprintf(cur, "\033[;%iH", x + 1)
+                : sprintf(cur, "\033[H");
+
+    /* The row is always known, but not the column after the last one */
+    if(p->x < 0 && x)
+        return cur + abs;
+
+    /* Line feeds do not return the carriage since OPOST is off */
+    if(y > p->y && y - p->y <= 3)
+        for(i = p->y; i < y; i++)
+            *rel++ = '\n';
+    else if(y > p->y)
+        rel += sprintf(rel, "\033[%iB", y - p->y);
+    else if(y < p->y)
+        rel += y == p->y - 1 ? sprintf(rel, "\033[A")
+                             : sprintf(rel, "\033[%iA", p->y - y);
+
+    if(x == 0 && p->x)
+        *rel++ = '\r';
+    else if(x < p->x)
+        rel += x == p->x - 1 ? sprintf(rel, "\033[D")
+                             : sprintf(rel, "\033[%iD", p->x - x);
+    else if(x > p->x)
+    {
+        int n = x - p->x, width = caca_get_canvas_width(dp->cv);
+        uint32_t const *chars = p->chars + y * width + p->x;
+        uint32_t const *keys = p->keys + y * width + p->x;
+
+        /* Rewriting a few plain characters is cheaper than moving */
+        for(i = 0; i < n && i < 4; i++)
+            if(keys[i] != p->key || chars[i] < 0x20 || chars[i] >= 0x7f)
+                break;
+
+        if(i == n)
+            for(i = 0; i < n; i++)
+                *rel++ = chars[i];
+        else
+            rel += n == 1 ? sprintf(rel, "\033[C")
+                          : sprintf(rel, "\033[%iC", n);
+    }
+
+    if(rel - tmp < abs)
+    {
+        memcpy(cur, tmp, rel - tmp);
+        return cur + (rel - tmp);
+    }
+
+    return cur + abs;
+}
+
+/* Switch the terminal rendition from one key to another */
+static char *vt_sgr(char *cur, uint32_t from, uint32_t to)
+{
+    static uint8_t const palette[] =
+    {
+        0,  4,  2,  6, 1,  5,  3,  7,
+    };
+
+    static uint8_t const styles[] = { 1, 3, 4, 5 };
+
+    uint8_t fg = to & 0x1f, bg = (to >> 5) & 0x1f;
+    int i;
+
+    *cur++ = '\033';
+    *cur++ = '[';
+
+    /* Styles can only be turned off all at once */
+    if(from == KEY_UNKNOWN || (from >> 10) & ~(to >> 10))
+    {
+        *cur++ = '0';
+        *cur++ = ';';
+        from = KEY_DEFAULT;
+    }
+
+    for(i = 0; i < 4; i++)
+        if((to >> 10) & ~(from >> 10) & (1 << i))
+            cur += sprintf(cur, "%i;", styles[i]);
+
+    if(fg != (from & 0x1f))
+        cur += fg == 0x10 ? sprintf(cur, "39;")
+                          : sprintf(cur, "%i;", (fg < 8 ? 30 : 90)
+                                                 + palette[fg & 7]);
+
+    if(bg != ((from >> 5) & 0x1f))
+        cur += bg == 0x10 ? sprintf(cur, "49;")
+                          : sprintf(cur, "%i;", (bg < 8 ? 40 : 100)
+                                                 + palette[bg & 7]);
+
+    cur[-1] = 'm';
+
+    return cur;
+}
+
+static char *vt_reserve(caca_display_t *dp, size_t bytes)
+{
+    struct driver_private *p = dp->drv.p;
+
+    if(p->len + bytes > p->size)
+    {
+        size_t size = p->size ? p->size * 2 : 16384;
+        char *buf;
+
+        while(size < p->len + bytes)
+            size *= 2;
+
+        buf = realloc(p->buf, size);
+        if(!buf)
+            return NULL;
+
+        p->buf = buf;
+        p->size = size;
+    }
+
+    return p->buf + p->len;
+}
+
+static void vt_write(char const *buf, size_t len)
+{
+    while(len)
+    {
+        ssize_t ret = write(STDOUT_FILENO, buf, len);
+
+        if(ret < 0)
+        {
+            if(errno == EINTR || errno == EAGAIN)
+                continue;
+            return;
+        }
+
+        buf += ret;
+        len -= ret;
+    }
+}
+
+/* Parse a key from the input buffer and return the number of bytes it
+ * used, or zero if more bytes are needed. If nothing more was read, an
+ * incomplete sequence is taken literally. */
+static int vt_parse_key(caca_display_t *dp, caca_privevent_t *ev, int more)
+{
+    struct driver_private *p = dp->drv.p;
+    unsigned char const *in = p->in;
+    int i, n = 0, bytes;
+
+    if(in[0] == '\033' && p->inlen > 1 && (in[1] == '[' || in[1] == 'O'))
+    {
+        for(i = 2; i < p->inlen && in[i] >= 0x20 && in[i] < 0x40; i++)
+            if(in[i] >= '0' && in[i] <= '9')
+                n = n * 10 + in[i] - '0';
+            else if(in[i] == ';')
+                break;
+
+        /* Skip modifiers, only the final byte matters */
+        while(i < p->inlen && in[i] >= 0x20 && in[i] < 0x40)
+            i++;
+
+        if(i == p->inlen)
+        {
+            if(more && p->inlen < (int)sizeof(p->in))
+                return 0;
+        }
+        else
+        {
+            ev->data.key.ch = 0;
+
+            switch(in[i])
+            {
+                case 'A': ev->data.key.ch = CACA_KEY_UP; break;
+                case 'B': ev->data.key.ch = CACA_KEY_DOWN; break;
+                case 'C': ev->data.key.ch = CACA_KEY_RIGHT; break;
+                case 'D': ev->data.key.ch = CACA_KEY_LEFT; break;
+                case 'H': ev->data.key.ch = CACA_KEY_HOME; break;
+                case 'F': ev->data.key.ch = CACA_KEY_END; break;
+                case 'P': ev->data.key.ch = CACA_KEY_F1; break;
+                case 'Q': ev->data.key.ch = CACA_KEY_F2; break;
+                case 'R': ev->data.key.ch = CACA_KEY_F3; break;
+                case 'S': ev->data.key.ch = CACA_KEY_F4; break;
+                case '~':
+                    switch(n)
+                    {
+                        case 1: case 7: ev->data.key.ch = CACA_KEY_HOME; break;
+                        case 2: ev->data.key.ch = CACA_KEY_INSERT; break;
+                        case 3: ev->data.key.ch = CACA_KEY_DELETE; break;
+                        case 4: case 8: ev->data.key.ch = CACA_KEY_END; break;
+                        case 5: ev->data.key.ch = CACA_KEY_PAGEUP; break;
+                        case 6: ev->data.key.ch = CACA_KEY_PAGEDOWN; break;
+                        case 11: case 12: case 13: case 14: case 15:
+                            ev->data.key.ch = CACA_KEY_F1 + n - 11; break;
+                        case 17: case 18: case 19: case 20: case 21:
+                            ev->data.key.ch = CACA_KEY_F6 + n - 17; break;
+                        case 23: case 24:
+                            ev->data.key.ch = CACA_KEY_F11 + n - 23; break;
+                    }
+                    break;
+            }
+
+            /* Unknown sequences are dropped */
+            if(ev->data.key.ch)
+            {
+                ev->type = CACA_EVENT_KEY_PRESS;
+                ev->data.key.utf32 = 0;
+                ev->data.key.utf8[0] = '\0';
+            }
+
+            return i + 1;
+        }
+    }
+    else if(in[0] == '\033' && p->inlen == 1 && more)
+        return 0;
+
+    /* If the key was UTF-8, parse the whole sequence */
+    if(in[0] >= 0x80)
+    {
+        char utf8[7];
+        uint32_t utf32;
+        size_t len;
+
+        bytes = in[0] >= 0xf0 ? 4 : in[0] >= 0xe0 ? 3 : in[0] >= 0xc0 ? 2 : 1;
+        if(p->inlen < bytes)
+            return more ? 0 : p->inlen;
+
+        memcpy(utf8, in, bytes);
+        utf8[bytes] = '\0';
+        utf32 = caca_utf8_to_utf32(utf8, &len);
+
+        if(len == (size_t)bytes)
+        {
+            ev->type = CACA_EVENT_KEY_PRESS;
+            ev->data.key.ch = 0;
+            ev->data.key.utf32 = utf32;
+            strcpy(ev->data.key.utf8, utf8);
+        }
+
+        return bytes;
+    }
+
+    ev->type = CACA_EVENT_KEY_PRESS;
+    ev->data.key.ch = in[0] == 0x7f ? CACA_KEY_BACKSPACE : in[0];
+    ev->data.key.utf32 = in[0];
+    ev->data.key.utf8[0] = in[0];
+    ev->data.key.utf8[1] = '\0';
+
+    return 1;
+}
+
+/* Parse an SGR mouse report: ESC [ < button ; x ; y followed by M for
+ * presses and motion, or m for releases. */
+static int vt_parse_mouse(caca_display_t *dp, caca_privevent_t *ev, int more)
+{
+    struct driver_private *p = dp->drv.p;
+    unsigned char const *in = p->in;
+    int i, argc = 0, argv[3] = { 0, 0, 0 };
+
+    for(i = 3; i < p->inlen && in[i] >= 0x20 && in[i] < 0x40; i++)
+        if(in[i] == ';')
+            argc++;
+        else if(argc < 3 && in[i] >= '0' && in[i] <= '9')
+            argv[argc] = argv[argc] * 10 + in[i] - '0';
+
+    if(i == p->inlen)
+        return more && p->inlen < (int)sizeof(p->in) ? 0 : i;
+
+    if(argc != 2 || (in[i] != 'M' && in[i] != 'm'))
+        return i + 1;
+
+    /* Wheel events only come as presses */
+    if(!(argv[0] & 32))
+    {
+        ev->type = in[i] == 'M' ? CACA_EVENT_MOUSE_PRESS
+                                : CACA_EVENT_MOUSE_RELEASE;
+        ev->data.mouse.button = (argv[0] & 64) ? 4 + (argv[0] & 1)
+                                               : (argv[0] & 3) + 1;
+        _caca_push_event(dp, ev);
+    }
+
+    if(dp->mouse.x == argv[1] - 1 && dp->mouse.y == argv[2] - 1)
+    {
+        if(!_caca_pop_event(dp, ev))
+            ev->type = CACA_EVENT_NONE;
+        return i + 1;
+    }
+
+    dp->mouse.x = argv[1] - 1;
+    dp->mouse.y = argv[2] - 1;
+
+    ev->type = CACA_EVENT_MOUSE_MOTION;
+    ev->data.mouse.x = dp->mouse.x;
+    ev->data.mouse.y = dp->mouse.y;
+
+    return i + 1;
+}
+
+#if defined HAVE_SIGNAL
+static void sigwinch_handler(int sig)
+{
+    _caca_signal_resize(sigwinch_d);
+
+    signal(SIGWINCH, sigwinch_handler);
+}
+#endif
+
+/*
+ * Driver initialisation
+ */
+
+int vt_install(caca_display_t *dp)
+{
+    dp->drv.id = CACA_DRIVER_VT;
+    dp->drv.driver = "vt";
+
+    dp->drv.init_graphics = vt_init_graphics;
+    dp->drv.end_graphics = vt_end_graphics;
+    dp->drv.set_display_title = vt_set_display_title;
+    dp->drv.get_display_width = vt_get_display_width;
+    dp->drv.get_display_height = vt_get_display_height;
+    dp->drv.display = vt_display;
+    dp->drv.handle_resize = vt_handle_resize;
+    dp->drv.get_event = vt_get_event;
+    dp->drv.set_mouse = NULL;
+    dp->drv.set_cursor = vt_set_cursor;
+    dp->drv.get_fd = vt_get_fd;
+
+    return 0;
+}
+
+#endif /* USE_VT */
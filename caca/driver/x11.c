@@ -25,6 +25,11 @@
 #if defined HAVE_X11_XKBLIB_H
 #   include <X11/XKBlib.h>
 #endif
+#if defined HAVE_XSHM
+#   include <sys/ipc.h>
+#   include <sys/shm.h>
+#   include <X11/extensions/XShm.h>
+#endif
 
 #include <stdio.h> /* BUFSIZ */
 #include <stdlib.h>
@@ -36,12 +41,31 @@
 #include "caca.h"
 #include "caca_internals.h"
 
+/* An XImage, in shared memory if possible */
+struct x11_image
+{
+    XImage *ximage;
+#if defined HAVE_XSHM
+    XShmSegmentInfo shminfo;
+    int shm;
+#endif
+};
+
 /*
  * Local functions
  */
 static int x11_error_handler(Display *, XErrorEvent *);
 static void x11_put_glyph(caca_display_t *, int, int, int, int, int,
                           uint32_t, uint32_t);
+static void x11_init_image(caca_display_t *, char const *);
+static int x11_create_image(caca_display_t *, struct x11_image *, int, int);
+static void x11_free_image(caca_display_t *, struct x11_image *);
+static void x11_render_area(caca_display_t *, int, int, int, int);
+static void x11_copy_area(caca_display_t *, int, int, int, int);
+#if defined HAVE_XSHM
+static int x11_shm_error_handler(Display *, XErrorEvent *);
+static int x11_shm_error;
+#endif
 
 struct driver_private
 {
@@ -71,6 +95,10 @@ struct driver_private
     XIM im;
     XIC ic;
 #endif
+    /* Software rendering with a libcaca font, instead of the X font */
+    caca_font_t *caca_font;
+    struct x11_image image;
+    char const *format;
 };
 
 #define UNICODE_XLFD_SUFFIX "-iso10646-1"
@@ -115,13 +143,17 @@ static int x11_init_graphics(caca_display_t *dp)
 #endif
 
     dp->drv.p->dpy = XOpenDisplay(NULL);
-    if(dp->drv.p->dpy == NULL)
-        return -1;
 
 #if defined HAVE_LOCALE_H
     setlocale(LC_CTYPE, old_locale);
 #endif
 
+    if(dp->drv.p->dpy == NULL)
+    {
+        free(dp->drv.p);
+        return -1;
+    }
+
 #if defined HAVE_GETENV
     fonts[0] = getenv("CACA_FONT");
     if(fonts[0] && *fonts[0])
@@ -130,11 +162,16 @@ static int x11_init_graphics(caca_display_t *dp)
 #endif
         parser = fonts + 1;
 
+    /* If the font is one of ours, render the canvas ourselves */
+    dp->drv.p->caca_font = NULL;
+    if(parser == fonts)
+        x11_init_image(dp, fonts[0]);
+
     /* Ignore font errors */
     old_error_handler = XSetErrorHandler(x11_error_handler);
 
     /* Parse our font list */
-    for( ; ; parser++)
+    for( ; !dp->drv.p->caca_font; parser++)
     {
 #if defined X_HAVE_UTF8_STRING
         char **missing_charset_list;
@@ -147,6 +184,7 @@ static int x11_init_graphics(caca_display_t *dp)
         {
             XSetErrorHandler(old_error_handler);
             XCloseDisplay(dp->drv.p->dpy);
+            free(dp->drv.p);
             return -1;
         }
 
@@ -212,6 +250,13 @@ static int x11_init_graphics(caca_display_t *dp)
     XSetErrorHandler(old_error_handler);
 
     /* Set font width to the largest character in the set */
+    if(dp->drv.p->caca_font)
+    {
+        dp->drv.p->font_width = caca_get_font_width(dp->drv.p->caca_font);
+        dp->drv.p->font_height = caca_get_font_height(dp->drv.p->caca_font);
+        dp->drv.p->font_offset = 0;
+    }
+    else
 #if defined X_HAVE_UTF8_STRING
     if (dp->drv.p->font_set)
     {
@@ -300,9 +345,11 @@ static int x11_init_graphics(caca_display_t *dp)
 
     dp->drv.p->gc = XCreateGC(dp->drv.p->dpy, dp->drv.p->window, 0, NULL);
     XSetForeground(dp->drv.p->dpy, dp->drv.p->gc, dp->drv.p->colors[0x888]);
+    if(!dp->drv.p->caca_font
 #if defined X_HAVE_UTF8_STRING
-    if (!dp->drv.p->font_set)
+        && !dp->drv.p->font_set
 #endif
+       )
         XSetFont(dp->drv.p->dpy, dp->drv.p->gc, dp->drv.p->font);
 
     for(;;)
@@ -328,11 +375,32 @@ static int x11_init_graphics(caca_display_t *dp)
 
     XSync(dp->drv.p->dpy, False);
 
-    dp->drv.p->pixmap = XCreatePixmap(dp->drv.p->dpy, dp->drv.p->window,
-                                      width * dp->drv.p->font_width,
-                                      height * dp->drv.p->font_height,
-                                      DefaultDepth(dp->drv.p->dpy,
-                                      DefaultScreen(dp->drv.p->dpy)));
+    if(dp->drv.p->caca_font)
+    {
+        dp->drv.p->pixmap = None;
+        if(x11_create_image(dp, &dp->drv.p->image,
+                            width * dp->drv.p->font_width,
+                            height * dp->drv.p->font_height))
+        {
+#if defined HAVE_X11_XKBLIB_H
+            if(!dp->drv.p->autorepeat)
+                XAutoRepeatOn(dp->drv.p->dpy);
+#endif
+            caca_free_font(dp->drv.p->caca_font);
+            XFreeGC(dp->drv.p->dpy, dp->drv.p->gc);
+            XUnmapWindow(dp->drv.p->dpy, dp->drv.p->window);
+            XDestroyWindow(dp->drv.p->dpy, dp->drv.p->window);
+            XCloseDisplay(dp->drv.p->dpy);
+            free(dp->drv.p);
+            return -1;
+        }
+    }
+    else
+        dp->drv.p->pixmap = XCreatePixmap(dp->drv.p->dpy, dp->drv.p->window,
+                                          width * dp->drv.p->font_width,
+                                          height * dp->drv.p->font_height,
+                                          DefaultDepth(dp->drv.p->dpy,
+                                          DefaultScreen(dp->drv.p->dpy)));
     dp->drv.p->pointer = None;
 
     dp->drv.p->cursor_flags = 0;
@@ -371,13 +439,21 @@ static int x11_end_graphics(caca_display_t *dp)
     if(!dp->drv.p->autorepeat)
         XAutoRepeatOn(dp->drv.p->dpy);
 #endif
-    XFreePixmap(dp->drv.p->dpy, dp->drv.p->pixmap);
-#if defined X_HAVE_UTF8_STRING
-    if (dp->drv.p->font_set)
-        XFreeFontSet(dp->drv.p->dpy, dp->drv.p->font_set);
+    if(dp->drv.p->caca_font)
+    {
+        x11_free_image(dp, &dp->drv.p->image);
+        caca_free_font(dp->drv.p->caca_font);
+    }
     else
+    {
+        XFreePixmap(dp->drv.p->dpy, dp->drv.p->pixmap);
+#if defined X_HAVE_UTF8_STRING
+        if (dp->drv.p->font_set)
+            XFreeFontSet(dp->drv.p->dpy, dp->drv.p->font_set);
+        else
 #endif
-        XFreeFont(dp->drv.p->dpy, dp->drv.p->font_struct);
+            XFreeFont(dp->drv.p->dpy, dp->drv.p->font_struct);
+    }
     XFreeGC(dp->drv.p->dpy, dp->drv.p->gc);
     XUnmapWindow(dp->drv.p->dpy, dp->drv.p->window);
     XDestroyWindow(dp->drv.p->dpy, dp->drv.p->window);
@@ -415,6 +491,7 @@ static void x11_display(caca_display_t *dp)
     int width = caca_get_canvas_width(dp->cv);
     int height = caca_get_canvas_height(dp->cv);
     int x, y, i, len;
+    int xmin = width, ymin = height, xmax = 0, ymax = 0;
 
     /* XXX: the magic value -1 is used to handle the cursor area */
     for(i = -1; i < caca_get_dirty_rect_count(dp->cv); i++)
@@ -442,6 +519,18 @@ static void x11_display(caca_display_t *dp)
             caca_get_dirty_rect(dp->cv, i, &dx, &dy, &dw, &dh);
         }
 
+        /* Only the union of the dirty rectangles is sent to the window */
+        if(dx < xmin) xmin = dx;
+        if(dy < ymin) ymin = dy;
+        if(dx + dw > xmax) xmax = dx + dw;
+        if(dy + dh > ymax) ymax = dy + dh;
+
+        if(dp->drv.p->caca_font)
+        {
+            x11_render_area(dp, dx, dy, dw, dh);
+            continue;
+        }
+
         /* First draw the background colours. Splitting the process in two
          * loops like this is actually slightly faster. */
         for(y = dy; y < dy + dh; y++)
@@ -489,26 +578,42 @@ static void x11_display(caca_display_t *dp)
     }
 
     /* Print the cursor if necessary. */
-    if(dp->drv.p->cursor_flags)
+    x = caca_wherex(dp->cv);
+    y = caca_wherey(dp->cv);
+    if(dp->drv.p->cursor_flags && x < width && y < height)
     {
-        XSetForeground(dp->drv.p->dpy, dp->drv.p->gc,
-                       dp->drv.p->colors[0xfff]);
-        x = caca_wherex(dp->cv);
-        y = caca_wherey(dp->cv);
-        XFillRectangle(dp->drv.p->dpy, dp->drv.p->pixmap, dp->drv.p->gc,
-                       x * dp->drv.p->font_width, y * dp->drv.p->font_height,
-                       dp->drv.p->font_width, dp->drv.p->font_height);
+        if(dp->drv.p->caca_font)
+        {
+            XImage *image = dp->drv.p->image.ximage;
+            int fw = dp->drv.p->font_width, fh = dp->drv.p->font_height;
+            int bpl = image->bytes_per_line;
+            char *pixels = image->data + y * fh * bpl + x * fw * 4;
+
+            for(i = 0; i < fh; i++)
+                memset(pixels + i * bpl, 0xff, fw * 4);
+        }
+        else
+        {
+            XSetForeground(dp->drv.p->dpy, dp->drv.p->gc,
+                           dp->drv.p->colors[0xfff]);
+            XFillRectangle(dp->drv.p->dpy, dp->drv.p->pixmap, dp->drv.p->gc,
+                           x * dp->drv.p->font_width,
+                           y * dp->drv.p->font_height,
+                           dp->drv.p->font_width, dp->drv.p->font_height);
+        }
+
+        if(x < xmin) xmin = x;
+        if(y < ymin) ymin = y;
+        if(x + 1 > xmax) xmax = x + 1;
+        if(y + 1 > ymax) ymax = y + 1;
 
         /* Mark the area as dirty */
         dp->drv.p->dirty_cursor_x = x;
         dp->drv.p->dirty_cursor_y = y;
     }
 
-    XCopyArea(dp->drv.p->dpy, dp->drv.p->pixmap, dp->drv.p->window,
-              dp->drv.p->gc, 0, 0,
-              width * dp->drv.p->font_width,
-              height * dp->drv.p->font_height,
-              0, 0);
+    if(xmin < xmax && ymin < ymax)
+        x11_copy_area(dp, xmin, ymin, xmax - xmin, ymax - ymin);
     XFlush(dp->drv.p->dpy);
 }
 
@@ -516,6 +621,33 @@ static void x11_handle_resize(caca_display_t *dp)
 {
     Pixmap new_pixmap;
 
+    if(dp->drv.p->caca_font)
+    {
+        struct x11_image old = dp->drv.p->image;
+        int w = dp->resize.w * dp->drv.p->font_width;
+        int h = dp->resize.h * dp->drv.p->font_height;
+        int y;
+
+        if(x11_create_image(dp, &dp->drv.p->image, w, h))
+        {
+            /* Keep the old size */
+            dp->drv.p->image = old;
+            dp->resize.w = caca_get_canvas_width(dp->cv);
+            dp->resize.h = caca_get_canvas_height(dp->cv);
+            return;
+        }
+
+        if(w > old.ximage->width)
+            w = old.ximage->width;
+        for(y = 0; y < h && y < old.ximage->height; y++)
+            memcpy(dp->drv.p->image.ximage->data
+                    + y * dp->drv.p->image.ximage->bytes_per_line,
+                   old.ximage->data + y * old.ximage->bytes_per_line, w * 4);
+
+        x11_free_image(dp, &old);
+        return;
+    }
+
     new_pixmap = XCreatePixmap(dp->drv.p->dpy, dp->drv.p->window,
                                dp->resize.w * dp->drv.p->font_width,
                                dp->resize.h * dp->drv.p->font_height,
@@ -547,10 +679,7 @@ static int x11_get_event(caca_display_t *dp, caca_privevent_t *ev)
         /* Expose event */
         if(xevent.type == Expose)
         {
-            XCopyArea(dp->drv.p->dpy, dp->drv.p->pixmap,
-                      dp->drv.p->window, dp->drv.p->gc, 0, 0,
-                      width * dp->drv.p->font_width,
-                      height * dp->drv.p->font_height, 0, 0);
+            x11_copy_area(dp, 0, 0, width, height);
             continue;
         }
 
@@ -677,7 +806,9 @@ static int x11_get_event(caca_display_t *dp, caca_privevent_t *ev)
             case XK_KP_End:
             case XK_End:          ev->data.key.ch = CACA_KEY_END;      break;
 
-            default: ev->type = CACA_EVENT_NONE; return 0;
+            /* Keep reading: the events behind this one may already be
+             * queued by Xlib, where poll() would not see them */
+            default: continue;
         }
 
         ev->data.key.utf32 = 0;
@@ -738,6 +869,11 @@ static void x11_set_cursor(caca_display_t *dp, int flags)
     dp->drv.p->cursor_flags = flags;
 }
 
+static int x11_get_fd(caca_display_t const *dp)
+{
+    return ConnectionNumber(dp->drv.p->dpy);
+}
+
 /*
  * XXX: following functions are local
  */
@@ -748,6 +884,185 @@ static int x11_error_handler(Display *dpy, XErrorEvent *xevent)
     return 0;
 }
 
+/* Use one of the libcaca fonts if the visual lets us write pixels
+ * directly, which is much cheaper than one X request per glyph. */
+static void x11_init_image(caca_display_t *dp, char const *name)
+{
+    Visual *visual = DefaultVisual(dp->drv.p->dpy,
+                                   DefaultScreen(dp->drv.p->dpy));
+    char const * const *list = caca_get_font_list();
+    int i;
+
+    for(i = 0; list[i]; i++)
+        if(!strcmp(list[i], name))
+            break;
+
+    if(!list[i] || visual->class != TrueColor
+        || DefaultDepth(dp->drv.p->dpy, DefaultScreen(dp->drv.p->dpy)) < 24
+        || visual->red_mask != 0xff0000 || visual->green_mask != 0xff00
+        || visual->blue_mask != 0xff)
+        return;
+
+    dp->drv.p->caca_font = caca_load_font(name, 0);
+    if(!dp->drv.p->caca_font)
+        return;
+
+    /* 32-bit pixels, in the X server's byte order */
+    dp->drv.p->format = ImageByteOrder(dp->drv.p->dpy) == LSBFirst
+                         ? "bgra" : "argb";
+#if defined X_HAVE_UTF8_STRING
+    dp->drv.p->font_set = NULL;
+#endif
+}
+
+static int x11_create_image(caca_display_t *dp, struct x11_image *img,
+                            int w, int h)
+{
+    Display *dpy = dp->drv.p->dpy;
+    Visual *visual = DefaultVisual(dpy, DefaultScreen(dpy));
+    int depth = DefaultDepth(dpy, DefaultScreen(dpy));
+
+#if defined HAVE_XSHM
+    img->shm = 0;
+
+    if(XShmQueryExtension(dpy))
+    {
+        img->ximage = XShmCreateImage(dpy, visual, depth, ZPixmap, NULL,
+                                      &img->shminfo, w, h);
+        if(img->ximage && img->ximage->bits_per_pixel == 32)
+        {
+            img->shminfo.shmid = shmget(IPC_PRIVATE,
+                                        img->ximage->bytes_per_line * h,
+                                        IPC_CREAT | 0600);
+            img->shminfo.shmaddr = (char *)-1;
+            if(img->shminfo.shmid >= 0)
+                img->shminfo.shmaddr = shmat(img->shminfo.shmid, NULL, 0);
+            if(img->shminfo.shmaddr != (char *)-1)
+            {
+                int (*old_error_handler)(Display *, XErrorEvent *);
+
+                /* Attaching fails if the server is on another host */
+                x11_shm_error = 0;
+                old_error_handler = XSetErrorHandler(x11_shm_error_handler);
+                img->shminfo.readOnly = False;
+                XShmAttach(dpy, &img->shminfo);
+                XSync(dpy, False);
+                XSetErrorHandler(old_error_handler);
+                img->shm = !x11_shm_error;
+
+                if(!img->shm)
+                    shmdt(img->shminfo.shmaddr);
+            }
+
+            /* The segment goes away once both sides have detached */
+            if(img->shminfo.shmid >= 0)
+                shmctl(img->shminfo.shmid, IPC_RMID, NULL);
+        }
+
+        if(img->shm)
+        {
+            img->ximage->data = img->shminfo.shmaddr;
+            memset(img->ximage->data, 0, img->ximage->bytes_per_line * h);
+            return 0;
+        }
+
+        if(img->ximage)
+            XDestroyImage(img->ximage);
+    }
+#endif
+
+    img->ximage = XCreateImage(dpy, visual, depth, ZPixmap, 0, NULL,
+                               w, h, 32, 0);
+    if(!img->ximage)
+        return -1;
+
+    if(img->ximage->bits_per_pixel != 32)
+    {
+        XDestroyImage(img->ximage);
+        return -1;
+    }
+
+    img->ximage->data = calloc(img->ximage->bytes_per_line, h);
+    if(!img->ximage->data)
+    {
+        XDestroyImage(img->ximage);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void x11_free_image(caca_display_t *dp, struct x11_image *img)
+{
+#if defined HAVE_XSHM
+    if(img->shm)
+    {
+        XShmDetach(dp->drv.p->dpy, &img->shminfo);
+        XSync(dp->drv.p->dpy, False);
+        shmdt(img->shminfo.shmaddr);
+        img->ximage->data = NULL;
+    }
+#endif
+
+    XDestroyImage(img->ximage);
+}
+
+/* Render the given cells into the image */
+static void x11_render_area(caca_display_t *dp, int x, int y, int w, int h)
+{
+    XImage *image = dp->drv.p->image.ximage;
+    int fw = dp->drv.p->font_width, fh = dp->drv.p->font_height;
+    char *pixels = image->data + y * fh * image->bytes_per_line + x * fw * 4;
+    int i;
+
+    /* Cells with glyphs missing from the font are left untouched */
+    for(i = 0; i < h * fh; i++)
+        memset(pixels + i * image->bytes_per_line, 0, w * fw * 4);
+
+    caca_render_canvas_area(dp->cv, dp->drv.p->caca_font, pixels,
+                            x * fw, y * fh, w * fw, h * fh,
+                            image->bytes_per_line, dp->drv.p->format);
+}
+
+/* Send the given cells to the window */
+static void x11_copy_area(caca_display_t *dp, int x, int y, int w, int h)
+{
+    int fw = dp->drv.p->font_width, fh = dp->drv.p->font_height;
+
+    if(!dp->drv.p->caca_font)
+    {
+        XCopyArea(dp->drv.p->dpy, dp->drv.p->pixmap, dp->drv.p->window,
+                  dp->drv.p->gc, x * fw, y * fh, w * fw, h * fh,
+                  x * fw, y * fh);
+        return;
+    }
+
+#if defined HAVE_XSHM
+    if(dp->drv.p->image.shm)
+    {
+        XShmPutImage(dp->drv.p->dpy, dp->drv.p->window, dp->drv.p->gc,
+                     dp->drv.p->image.ximage, x * fw, y * fh,
+                     x * fw, y * fh, w * fw, h * fh, False);
+        /* The server reads the image asynchronously, wait for it to be
+         * done before we draw the next frame */
+        XSync(dp->drv.p->dpy, False);
+        return;
+    }
+#endif
+
+    XPutImage(dp->drv.p->dpy, dp->drv.p->window, dp->drv.p->gc,
+              dp->drv.p->image.ximage, x * fw, y * fh,
+              x * fw, y * fh, w * fw, h * fh);
+}
+
+#if defined HAVE_XSHM
+static int x11_shm_error_handler(Display *dpy, XErrorEvent *xevent)
+{
+    x11_shm_error = 1;
+    return 0;
+}
+#endif
+
 static void x11_put_glyph(caca_display_t *dp, int x, int y, int yoff,
                           int w, int h, uint32_t attr, uint32_t ch)
 {
@@ -986,6 +1301,7 @@ int x11_install(caca_display_t *dp)
     dp->drv.get_event = x11_get_event;
     dp->drv.set_mouse = x11_set_mouse;
     dp->drv.set_cursor = x11_set_cursor;
+    dp->drv.get_fd = x11_get_fd;
 
     return 0;
 }
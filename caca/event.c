@@ -19,6 +19,13 @@
 #if !defined(__KERNEL__)
 #   include <stdio.h>
 #   include <string.h>
+#   if defined(HAVE_POLL_H)
+#       include <poll.h>
+#   endif
+#   if defined(HAVE_PIPE)
+#       include <unistd.h>
+#       include <fcntl.h>
+#   endif
 #endif
 
 #include "caca.h"
@@ -26,6 +33,7 @@
 
 static int _get_next_event(caca_display_t *, caca_privevent_t *);
 static int _lowlevel_event(caca_display_t *, caca_privevent_t *);
+static void _wait_event(caca_display_t *, int);
 
 #if !defined(_DOXYGEN_SKIP_ME)
 /* If no new key was pressed after AUTOREPEAT_THRESHOLD usec, assume the
@@ -48,6 +56,11 @@ static int _lowlevel_event(caca_display_t *, caca_privevent_t *);
  *  if no more events are pending in the queue. A negative value causes the
  *  function to wait indefinitely until a matching event is received.
  *
+ *  When the display driver has an input file descriptor (see
+ *  caca_get_event_fd()), the function sleeps on it until input arrives or
+ *  the timeout expires, instead of checking for events at regular
+ *  intervals.
+ *
  *  If not null, \c ev will be filled with information about the event
  *  received. If null, the function will return but no information about
  *  the event will be sent.
@@ -78,7 +91,7 @@ int caca_get_event(caca_display_t *dp, int event_mask,
     if(!event_mask)
         goto end;
 
-    if(timeout > 0)
+    if(timeout >= 0)
         _caca_getticks(&timer);
 
     for( ; ; )
@@ -99,28 +112,27 @@ int caca_get_event(caca_display_t *dp, int event_mask,
             goto end;
         }
 
-        /* If there is no timeout, sleep and try again. */
-        if(timeout < 0)
-        {
-            _caca_sleep(1000);
-            continue;
-        }
-
         /* If we timeouted, return an empty event */
-        if(usec >= timeout)
+        if(timeout >= 0)
         {
-            privevent.type = CACA_EVENT_NONE;
-            if(ev)
-                memcpy(ev, &privevent, sizeof(privevent));
-            ret = 0;
-            goto end;
+            usec += _caca_getticks(&timer);
+
+            if(usec >= timeout)
+            {
+                privevent.type = CACA_EVENT_NONE;
+                if(ev)
+                    memcpy(ev, &privevent, sizeof(privevent));
+                ret = 0;
+                goto end;
+            }
         }
 
-        /* Otherwise sleep a bit. Our granularity is far too high for values
-         * below 10000 microseconds so we cheat a bit. */
-        _caca_sleep(usec > 10000 ? 10000 : 1000);
+        /* A discarded event may have more events behind it */
+        if(privevent.type != CACA_EVENT_NONE)
+            continue;
 
-        usec += _caca_getticks(&timer);
+        /* Otherwise wait for new input and try again */
+        _wait_event(dp, timeout < 0 ? -1 : timeout - usec);
     }
 
 end:
@@ -133,6 +145,35 @@ end:
     return ret;
 }
 
+/** \brief Get the file descriptor to wait on for input events.
+ *
+ *  Return a file descriptor that becomes readable when the display has
+ *  new input, such as the terminal for the ncurses, S-Lang and VT drivers
+ *  or the X server connection for the X11 driver. Applications with their
+ *  own poll(), select() or epoll loop can wait on it for reading, then
+ *  call caca_get_event() with a zero timeout until it returns 0: drivers
+ *  may buffer input, so the descriptor is only meaningful once the events
+ *  were drained.
+ *
+ *  The descriptor belongs to the display and must not be read from or
+ *  closed. It may change when caca_set_display_driver() is called.
+ *
+ *  If an error occurs, -1 is returned and \b errno is set accordingly:
+ *  - \c ENOSYS The display driver has no input file descriptor.
+ *
+ *  \param dp The libcaca graphical context.
+ *  \return The file descriptor, or -1 if an error occurred.
+ */
+int caca_get_event_fd(caca_display_t const *dp)
+{
+    int fd = dp->drv.get_fd ? dp->drv.get_fd(dp) : -1;
+
+    if(fd < 0)
+        seterrno(ENOSYS);
+
+    return fd;
+}
+
 /** \brief Return the X mouse coordinate.
  *
  *  Return the X coordinate of the mouse position last time
@@ -342,6 +383,57 @@ int caca_get_event_resize_height(caca_event_t const *ev)
     return ((caca_privevent_t const *)ev)->data.resize.h;
 }
 
+/*
+ * XXX: The following functions are private.
+ */
+
+/* Drivers that get resize requests from a signal handler open a pipe that
+ * the handler writes to, so that a signal arriving after the resize flag
+ * was checked but before _wait_event() blocks still wakes it up. */
+void _caca_open_resize_pipe(caca_display_t *dp)
+{
+#if defined(HAVE_PIPE) && !defined(__KERNEL__)
+    int i;
+
+    if(dp->resize.pipe[0] >= 0 || pipe(dp->resize.pipe))
+        return;
+
+    /* Never block in the handler, even if nobody drains the pipe */
+    for(i = 0; i < 2; i++)
+        fcntl(dp->resize.pipe[i], F_SETFL,
+              fcntl(dp->resize.pipe[i], F_GETFL) | O_NONBLOCK);
+#endif
+}
+
+void _caca_close_resize_pipe(caca_display_t *dp)
+{
+#if defined(HAVE_PIPE) && !defined(__KERNEL__)
+    if(dp->resize.pipe[0] < 0)
+        return;
+
+    close(dp->resize.pipe[0]);
+    close(dp->resize.pipe[1]);
+    dp->resize.pipe[0] = dp->resize.pipe[1] = -1;
+#endif
+}
+
+/* Request a resize event. This is safe to call from a signal handler. */
+void _caca_signal_resize(caca_display_t *dp)
+{
+    dp->resize.resized = 1;
+
+#if defined(HAVE_PIPE) && !defined(__KERNEL__)
+    if(dp->resize.pipe[1] >= 0)
+    {
+        /* If the pipe is full, a wakeup is already pending */
+        int saved_errno = errno;
+        ssize_t ret = write(dp->resize.pipe[1], "", 1);
+        (void)ret;
+        errno = saved_errno;
+    }
+#endif
+}
+
 /*
  * XXX: The following functions are local.
  */
@@ -422,9 +514,50 @@ static int _get_next_event(caca_display_t *dp, caca_privevent_t *ev)
 #endif
 }
 
+/* Wait for input for at most usec microseconds, or forever if negative */
+static void _wait_event(caca_display_t *dp, int usec)
+{
+#if defined(HAVE_POLL_H) && !defined(__KERNEL__)
+    struct pollfd pfd[2];
+    int n = 0;
+
+    pfd[n].fd = dp->drv.get_fd ? dp->drv.get_fd(dp) : -1;
+    pfd[n].events = POLLIN;
+    if(pfd[n].fd >= 0)
+        n++;
+
+    /* Also wait on the resize pipe, so that resize requests from signal
+     * handlers are not missed even if they came before poll() started */
+    pfd[n].fd = dp->resize.pipe[0];
+    pfd[n].events = POLLIN;
+    if(pfd[n].fd >= 0)
+        n++;
+
+    /* Round up so that we do not wake up just before the timeout */
+    if(n)
+    {
+        poll(pfd, n, usec < 0 ? -1 : (usec + 999) / 1000);
+#   if defined(HAVE_PIPE)
+        if(dp->resize.pipe[0] >= 0)
+        {
+            char buf[64];
+            while(read(dp->resize.pipe[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+#   endif
+        return;
+    }
+#endif
+
+    /* The driver has nothing to wait on, check again a bit later. Timed
+     * waits poll less often but never sleep past their timeout. */
+    _caca_sleep(usec < 0 ? 1000 : usec > 10000 ? 10000 : usec);
+}
+
 static int _lowlevel_event(caca_display_t *dp, caca_privevent_t *ev)
 {
-#if defined(USE_SLANG) || defined(USE_NCURSES) || defined(USE_CONIO)
+#if defined(USE_SLANG) || defined(USE_NCURSES) || defined(USE_CONIO) \
+     || defined(USE_VT)
     int ret = _caca_pop_event(dp, ev);
 
     if(ret)
@@ -434,7 +567,8 @@ static int _lowlevel_event(caca_display_t *dp, caca_privevent_t *ev)
     return dp->drv.get_event(dp, ev);
 }
 
-#if defined(USE_SLANG) || defined(USE_NCURSES) || defined(USE_CONIO) || defined(USE_GL)
+#if defined(USE_SLANG) || defined(USE_NCURSES) || defined(USE_CONIO) \
+     || defined(USE_GL) || defined(USE_VT)
 void _caca_push_event(caca_display_t *dp, caca_privevent_t *ev)
 {
     if(!ev->type || dp->events.queue == EVENTBUF_LEN)
@@ -23,6 +23,12 @@
 #   include <stdio.h>
 #   include <stdlib.h>
 #   include <string.h>
+#   if defined HAVE_UNISTD_H
+#       include <unistd.h>
+#   endif
+#   if defined HAVE_PTHREAD_H
+#       include <pthread.h>
+#   endif
 #endif
 
 #include "caca.h"
@@ -63,21 +69,62 @@ struct caca_font
     uint8_t *font_data;
 
     uint8_t *private;
+
+    /* Glyph pixels unpacked to one byte each, NULL for 8 bpp fonts, and
+     * glyph indices of the first code points, -1 for missing glyphs */
+    uint8_t *glyph_pixels;
+    int32_t *direct;
+};
+#endif
+
+#define DIRECT_GLYPHS 0x2600 /* Up to the block elements */
+#define COLOUR_CACHE 64 /* Colour tables kept during a render */
+
+/* A canvas rendered in bands of pixel rows by several threads, and
+ * handed over to the caller in order. A band is rendered into one of
+ * several slots, which is reused once the band has been handed over. */
+struct render_job
+{
+    caca_canvas_t const *cv;
+    caca_font_t const *f;
+    int const *order;
+    int width, height, rows, pitch, bands, slots;
+    uint8_t *buffers;
+    int (*callback)(void *, void const *, int, int, int);
+    void *data;
+
+    int next, delivered, delivering, error;
+    int *ready;
+#if defined HAVE_PTHREAD_H
+    int errnum; /* errno of the first failure, set on a worker thread */
+#endif
+#if defined HAVE_PTHREAD_H
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
 };
+
+static int const *get_order(char const *);
+static int render_area(caca_canvas_t const *, caca_font_t const *,
+                       uint8_t *, int, int, int, int, int, int const *);
+static int render_band(struct render_job *, int);
+#if defined HAVE_PTHREAD_H
+static void *render_worker(void *);
 #endif
 
+/* Pixels are unpacked to their level, not to their intensity, so that
+ * they can index a table of precomputed colours */
 #define DECLARE_UNPACKGLYPH(bpp) \
     static inline void \
-      unpack_glyph ## bpp(uint8_t *glyph, uint8_t *packed_data, int n) \
+      unpack_glyph ## bpp(uint8_t *glyph, uint8_t *packed_data, size_t n) \
 { \
-    int i; \
+    size_t i; \
     \
     for(i = 0; i < n; i++) \
     { \
         uint8_t pixel = packed_data[i / (8 / bpp)]; \
         pixel >>= bpp * ((8 / bpp) - 1 - (i % (8 / bpp))); \
         pixel %= (1 << bpp); \
-        pixel *= 0xff / ((1 << bpp) - 1); \
         *glyph++ = pixel; \
     } \
 }
@@ -86,6 +133,30 @@ DECLARE_UNPACKGLYPH(4)
 DECLARE_UNPACKGLYPH(2)
 DECLARE_UNPACKGLYPH(1)
 
+/* Find the glyph of a character, or return -1 if the font lacks it */
+static int find_glyph(caca_font_t const *f, uint32_t ch)
+{
+    int lo = 0, hi = f->header.blocks;
+
+    if(ch < DIRECT_GLYPHS && f->direct)
+        return f->direct[ch];
+
+    /* Blocks are sorted and do not overlap */
+    while(lo < hi)
+    {
+        int b = (lo + hi) / 2;
+
+        if(ch < f->block_list[b].start)
+            hi = b;
+        else if(ch >= f->block_list[b].stop)
+            lo = b + 1;
+        else
+            return f->block_list[b].index + ch - f->block_list[b].start;
+    }
+
+    return -1;
+}
+
 /** \brief Load a font from memory for future use.
  *
  *  This function loads a font and returns a handle to its internal
@@ -287,6 +358,49 @@ caca_font_t *caca_load_font(void const *data, size_t size)
 
     f->font_data = f->private + 4 + f->header.control_size;
 
+    /* Glyphs start on byte boundaries, so their unpacked data lies at
+     * their data offset times the number of pixels per byte */
+    f->glyph_pixels = NULL;
+    f->direct = malloc(DIRECT_GLYPHS * sizeof(int32_t));
+    if(f->header.bpp != 8)
+        f->glyph_pixels = malloc(f->header.data_size * (8 / f->header.bpp));
+    if(!f->direct || (f->header.bpp != 8 && !f->glyph_pixels))
+    {
+        free(f->glyph_pixels);
+        free(f->direct);
+        free(f->glyph_list);
+        free(f->user_block_list);
+        free(f->block_list);
+        free(f);
+        seterrno(ENOMEM);
+        return NULL;
+    }
+
+    switch(f->header.bpp)
+    {
+    case 4:
+        unpack_glyph4(f->glyph_pixels, f->font_data, f->header.data_size * 2);
+        break;
+    case 2:
+        unpack_glyph2(f->glyph_pixels, f->font_data, f->header.data_size * 4);
+        break;
+    case 1:
+        unpack_glyph1(f->glyph_pixels, f->font_data, f->header.data_size * 8);
+        break;
+    }
+
+    for(i = 0; i < DIRECT_GLYPHS; i++)
+        f->direct[i] = -1;
+    for(i = 0; i < f->header.blocks; i++)
+    {
+        uint32_t ch;
+
+        for(ch = f->block_list[i].start;
+            ch < f->block_list[i].stop && ch < DIRECT_GLYPHS; ch++)
+            f->direct[ch] = f->block_list[i].index
+                             + ch - f->block_list[i].start;
+    }
+
     return f;
 }
 
@@ -380,6 +494,8 @@ uint32_t const *caca_get_font_blocks(caca_font_t const *f)
  */
 int caca_free_font(caca_font_t *f)
 {
+    free(f->glyph_pixels);
+    free(f->direct);
     free(f->glyph_list);
     free(f->user_block_list);
     free(f->block_list);
@@ -398,11 +514,11 @@ int caca_free_font(caca_font_t *f)
  *  height can be computed using caca_get_canvas_height() and
  *  caca_get_font_height().
  *
- *  Glyphs that do not fit in the image buffer are currently not rendered at
- *  all. They may be cropped instead in future versions.
+ *  Glyphs that do not entirely fit in the image buffer are cropped.
  *
  *  If an error occurs, -1 is returned and \b errno is set accordingly:
  *  - \c EINVAL Specified width, height or pitch is invalid.
+ *  - \c ENOMEM Not enough memory to allocate the colour tables.
  *
  *  \param cv The canvas to render
  *  \param f The font, as returned by caca_load_font()
@@ -415,8 +531,7 @@ int caca_free_font(caca_font_t *f)
 int caca_render_canvas(caca_canvas_t const *cv, caca_font_t const *f,
                         void *buf, int width, int height, int pitch)
 {
-    uint8_t *glyph = NULL;
-    int x, y, xmax, ymax;
+    int xmax, ymax;
 
     if(width < 0 || height < 0 || pitch < 0)
     {
@@ -424,9 +539,6 @@ int caca_render_canvas(caca_canvas_t const *cv, caca_font_t const *f,
         return -1;
     }
 
-    if(f->header.bpp != 8)
-        glyph = _caca_alloc2d(f->header.width, f->header.height, 2);
-
     if(width < cv->width * f->header.width)
         xmax = width / f->header.width;
     else
@@ -437,84 +549,402 @@ int caca_render_canvas(caca_canvas_t const *cv, caca_font_t const *f,
     else
         ymax = cv->height;
 
-    for(y = 0; y < ymax; y++)
+    return render_area(cv, f, buf, 0, 0, xmax * f->header.width,
+                       ymax * f->header.height, pitch, get_order("argb"));
+}
+
+/** \brief Render part of the canvas onto an image buffer.
+ *
+ *  This function renders a rectangle of the image that caca_render_canvas()
+ *  would give for the whole canvas, so that big images can be produced
+ *  piece by piece, possibly by several threads at once. Glyphs crossing the
+ *  rectangle's edges are cropped.
+ *
+ *  Valid values for \c format are:
+ *  - \c "argb": bytes in A, R, G, B order, as with caca_render_canvas().
+ *  - \c "bgra": bytes in B, G, R, A order, as in TGA files.
+ *  - \c "rgba": bytes in R, G, B, A order, as in PNG files.
+ *
+ *  Pixels of the rectangle that lie outside the canvas, or in cells whose
+ *  glyph is missing from the font, are left untouched.
+ *
+ *  If an error occurs, -1 is returned and \b errno is set accordingly:
+ *  - \c EINVAL Specified rectangle, pitch or format is invalid.
+ *  - \c ENOMEM Not enough memory to allocate the colour tables.
+ *
+ *  \param cv The canvas to render
+ *  \param f The font, as returned by caca_load_font()
+ *  \param buf The image buffer, receiving the rectangle's top left pixel
+ *  \param x The leftmost pixel column of the rectangle
+ *  \param y The topmost pixel row of the rectangle
+ *  \param width The width (in pixels) of the rectangle
+ *  \param height The height (in pixels) of the rectangle
+ *  \param pitch The pitch (in bytes) of an image buffer line
+ *  \param format A string describing the pixel format
+ *  \return 0 in case of success, -1 if an error occurred.
+ */
+int caca_render_canvas_area(caca_canvas_t const *cv, caca_font_t const *f,
+                            void *buf, int x, int y, int width, int height,
+                            int pitch, char const *format)
+{
+    int const *order = get_order(format);
+
+    if(x < 0 || y < 0 || width < 0 || height < 0 || pitch < 0 || !order)
+    {
+        seterrno(EINVAL);
+        return -1;
+    }
+
+    return render_area(cv, f, buf, x, y, width, height, pitch, order);
+}
+
+/** \brief Render the canvas in bands of pixel rows.
+ *
+ *  This function renders the whole canvas image, as caca_render_canvas()
+ *  would, but only a few bands of \c rows pixel rows at a time, and hands
+ *  them over to \c callback from top to bottom. Images much bigger than the
+ *  available memory can thus be written to a file as they are rendered.
+ *
+ *  Bands are rendered by up to \c threads threads at once. A value of 1
+ *  renders everything in the calling thread, and a value of 0 uses one
+ *  thread per online CPU. Only one call to \c callback runs at a time,
+ *  and if libcaca was built without thread support, rendering stays
+ *  single-threaded.
+ *
+ *  The callback gets \c data, the band's pixels, the index of its first
+ *  pixel row in the image, its number of rows and its pitch in bytes. The
+ *  pixels are only valid until it returns. Cells whose glyph is missing
+ *  from the font are transparent black. If the callback returns a negative
+ *  value, rendering stops. See caca_render_canvas_area() for the valid
+ *  values of \c format.
+ *
+ *  If an error occurs, -1 is returned and \b errno is set accordingly:
+ *  - \c EINVAL Specified number of rows or threads, or format is invalid.
+ *  - \c ENOMEM Not enough memory to allocate the bands.
+ *  If the callback returns a negative value, -1 is returned and \b errno
+ *  is set to the value the callback left it at, even if it ran in another
+ *  thread.
+ *
+ *  \param cv The canvas to render
+ *  \param f The font, as returned by caca_load_font()
+ *  \param format A string describing the pixel format
+ *  \param rows The height (in pixels) of a band, or 0 for one text line
+ *  \param threads The maximum number of threads to use
+ *  \param callback The function receiving the bands
+ *  \param data Data passed to the callback
+ *  \return 0 in case of success, -1 if an error occurred.
+ */
+int caca_render_canvas_stream(caca_canvas_t const *cv, caca_font_t const *f,
+                              char const *format, int rows, int threads,
+                              int (*callback)(void *, void const *,
+                                              int, int, int),
+                              void *data)
+{
+    struct render_job job;
+    int band;
+
+    job.order = get_order(format);
+    if(rows < 0 || threads < 0 || !job.order)
+    {
+        seterrno(EINVAL);
+        return -1;
+    }
+
+#if defined HAVE_PTHREAD_H && defined _SC_NPROCESSORS_ONLN
+    if(threads == 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    job.cv = cv;
+    job.f = f;
+    job.width = cv->width * f->header.width;
+    job.height = cv->height * f->header.height;
+    job.rows = rows ? rows : f->header.height;
+    job.pitch = 4 * job.width;
+    job.bands = (job.height + job.rows - 1) / job.rows;
+    if(!job.bands)
+        return 0;
+    job.callback = callback;
+    job.data = data;
+    job.next = job.delivered = job.delivering = job.error = 0;
+
+    if(threads > job.bands)
+        threads = job.bands;
+#if !defined HAVE_PTHREAD_H
+    threads = 1;
+#endif
+
+    /* Two slots per thread, so that rendering goes on while a band is
+     * being handed over */
+    job.slots = threads > 1 ? 2 * threads : 1;
+    job.buffers = malloc((size_t)job.slots * job.rows * job.pitch);
+    job.ready = malloc(job.slots * sizeof(int));
+    if(!job.buffers || !job.ready)
+    {
+        free(job.buffers);
+        free(job.ready);
+        seterrno(ENOMEM);
+        return -1;
+    }
+    memset(job.ready, 0, job.slots * sizeof(int));
+
+    if(threads <= 1)
+    {
+        for(band = 0; band < job.bands && !job.error; band++)
+            job.error = render_band(&job, band) < 0;
+    }
+#if defined HAVE_PTHREAD_H
+    else
+    {
+        pthread_t *tids = malloc((threads - 1) * sizeof(pthread_t));
+        int i, started = 0;
+
+        pthread_mutex_init(&job.mutex, NULL);
+        pthread_cond_init(&job.cond, NULL);
+
+        /* If a thread cannot be created, the others simply get more work;
+         * the calling thread always takes part. */
+        for(i = 0; tids && i < threads - 1; i++)
+            if(!pthread_create(&tids[started], NULL, render_worker, &job))
+                started++;
+
+        render_worker(&job);
+
+        for(i = 0; i < started; i++)
+            pthread_join(tids[i], NULL);
+
+        pthread_cond_destroy(&job.cond);
+        pthread_mutex_destroy(&job.mutex);
+        free(tids);
+    }
+#endif
+
+    free(job.buffers);
+    free(job.ready);
+
+#if defined HAVE_PTHREAD_H
+    /* errno is per thread, so report the one from where it failed */
+    if(job.error && threads > 1)
+        seterrno(job.errnum);
+#endif
+
+    return job.error ? -1 : 0;
+}
+
+/*
+ * XXX: the following functions are local.
+ */
+
+/* Byte positions of the alpha, red, green and blue channels */
+static int const *get_order(char const *format)
+{
+    static int const argb[] = { 0, 1, 2, 3 };
+    static int const bgra[] = { 3, 2, 1, 0 };
+    static int const rgba[] = { 3, 0, 1, 2 };
+
+    if(!strcasecmp(format, "argb"))
+        return argb;
+    if(!strcasecmp(format, "bgra"))
+        return bgra;
+    if(!strcasecmp(format, "rgba"))
+        return rgba;
+
+    return NULL;
+}
+
+static int render_area(caca_canvas_t const *cv, caca_font_t const *f,
+                       uint8_t *buf, int x, int y, int width, int height,
+                       int pitch, int const *order)
+{
+    uint32_t keys[COLOUR_CACHE], *colours;
+    uint8_t used[COLOUR_CACHE];
+    uint8_t const *pixels;
+    int cx, cy, xmin, ymin, xmax, ymax, levels, perbyte;
+    int fw = f->header.width, fh = f->header.height;
+
+    /* One table per recently used attribute, giving the final pixel for
+     * each level a glyph pixel can have */
+    levels = 1 << f->header.bpp;
+    colours = malloc(COLOUR_CACHE * levels * sizeof(uint32_t));
+    if(!colours)
+    {
+        seterrno(ENOMEM);
+        return -1;
+    }
+    memset(used, 0, sizeof(used));
+
+    pixels = f->glyph_pixels ? f->glyph_pixels : f->font_data;
+    perbyte = 8 / f->header.bpp;
+
+    /* Cells whose glyph may reach the area; fullwidth glyphs are wider
+     * than a cell, and glyphs may be taller than a line */
+    xmin = x < f->header.maxwidth ? 0 : (x - f->header.maxwidth) / fw + 1;
+    ymin = y < f->header.maxheight ? 0 : (y - f->header.maxheight) / fh + 1;
+    xmax = (x + width + fw - 1) / fw;
+    ymax = (y + height + fh - 1) / fh;
+    if(xmax > cv->width)
+        xmax = cv->width;
+    if(ymax > cv->height)
+        ymax = cv->height;
+
+    for(cy = ymin; cy < ymax; cy++)
     {
-        for(x = 0; x < xmax; x++)
+        for(cx = xmin; cx < xmax; cx++)
         {
-            uint8_t argb[8];
-            int starty = y * f->header.height;
-            int startx = x * f->header.width;
-            uint32_t ch = cv->chars[y * cv->width + x];
-            uint32_t attr = cv->attrs[y * cv->width + x];
-            int b, i, j;
+            int startx = cx * fw - x;
+            int starty = cy * fh - y;
+            uint32_t ch = cv->chars[cy * cv->width + cx];
+            uint32_t attr = cv->attrs[cy * cv->width + cx];
+            uint32_t *table;
+            uint8_t const *glyph;
+            int i, j, imin, imax, jmin, jmax, slot, index;
             struct glyph_info *g;
 
-            /* Find the Unicode block where our glyph lies */
-            for(b = 0; b < f->header.blocks; b++)
-            {
-                if(ch < f->block_list[b].start)
-                {
-                    b = f->header.blocks;
-                    break;
-                }
-
-                if(ch < f->block_list[b].stop)
-                    break;
-            }
+            index = find_glyph(f, ch);
 
             /* Glyph not in font? Skip it. */
-            if(b == f->header.blocks)
+            if(index < 0)
                 continue;
 
-            g = &f->glyph_list[f->block_list[b].index
-                                + ch - f->block_list[b].start];
+            g = &f->glyph_list[index];
+            glyph = pixels + g->data_offset * perbyte;
 
-            caca_attr_to_argb64(attr, argb);
+            /* Crop the glyph to the area */
+            imin = startx < 0 ? -startx : 0;
+            jmin = starty < 0 ? -starty : 0;
+            imax = width - startx < g->width ? width - startx : g->width;
+            jmax = height - starty < g->height ? height - starty : g->height;
+            if(imin >= imax || jmin >= jmax)
+                continue;
 
-            /* Step 1: unpack glyph */
-            switch(f->header.bpp)
-            {
-            case 8:
-                glyph = f->font_data + g->data_offset;
-                break;
-            case 4:
-                unpack_glyph4(glyph, f->font_data + g->data_offset,
-                              g->width * g->height);
-                break;
-            case 2:
-                unpack_glyph2(glyph, f->font_data + g->data_offset,
-                              g->width * g->height);
-                break;
-            case 1:
-                unpack_glyph1(glyph, f->font_data + g->data_offset,
-                              g->width * g->height);
-                break;
-            }
+            slot = (((attr >> 4) * 0x9e3779b1u) >> 16) % COLOUR_CACHE;
+            table = colours + slot * levels;
 
-            /* Step 2: render glyph using colour attribute */
-            for(j = 0; j < g->height; j++)
+            if(!used[slot] || keys[slot] != attr)
             {
-                uint8_t *line = buf;
-                line += (starty + j) * pitch + 4 * startx;
+                uint8_t argb[8], pixel[4];
+                uint32_t p, q, t;
+                int v;
 
-                for(i = 0; i < g->width; i++)
-                {
-                    uint8_t *pixel = line + 4 * i;
-                    uint32_t p, q, t;
+                caca_attr_to_argb64(attr, argb);
 
-                    p = glyph[j * g->width + i];
+                for(v = 0; v < levels; v++)
+                {
+                    p = v * (0xff / (levels - 1));
                     q = 0xff - p;
 
                     for(t = 0; t < 4; t++)
-                        pixel[t] = (((q * argb[t]) + (p * argb[4 + t])) / 0xf);
+                        pixel[order[t]] = (((q * argb[t])
+                                             + (p * argb[4 + t])) / 0xf);
+
+                    memcpy(table + v, pixel, 4);
                 }
+
+                keys[slot] = attr;
+                used[slot] = 1;
+            }
+
+            /* Render glyph using colour attribute */
+            for(j = jmin; j < jmax; j++)
+            {
+                uint8_t *line = buf + (starty + j) * pitch;
+                uint8_t const *src = glyph + j * g->width;
+
+                for(i = imin; i < imax; i++)
+                    memcpy(line + 4 * (startx + i), table + src[i], 4);
             }
         }
     }
 
-    if(f->header.bpp != 8)
-        free(glyph);
+    free(colours);
 
     return 0;
 }
 
+/* Render a band into its slot and, when single-threaded, hand it over */
+static int render_band(struct render_job *job, int band)
+{
+    uint8_t *buf = job->buffers
+                    + (size_t)(band % job->slots) * job->rows * job->pitch;
+    int y = band * job->rows;
+    int rows = job->height - y < job->rows ? job->height - y : job->rows;
+
+    memset(buf, 0, (size_t)rows * job->pitch);
+    if(render_area(job->cv, job->f, buf, 0, y, job->width, rows,
+                   job->pitch, job->order) < 0)
+        return -1;
+
+    if(job->slots > 1)
+        return 0;
+
+    return job->callback(job->data, buf, y, rows, job->pitch);
+}
+
+#if defined HAVE_PTHREAD_H
+static void *render_worker(void *data)
+{
+    struct render_job *job = data;
+
+    pthread_mutex_lock(&job->mutex);
+
+    while(!job->error && job->next < job->bands)
+    {
+        int band = job->next++;
+        int ret;
+
+        /* Wait until the slot's previous band was handed over */
+        while(!job->error && job->delivered + job->slots <= band)
+            pthread_cond_wait(&job->cond, &job->mutex);
+        if(job->error)
+            break;
+
+        pthread_mutex_unlock(&job->mutex);
+        ret = render_band(job, band);
+        pthread_mutex_lock(&job->mutex);
+
+        if(ret < 0)
+        {
+            if(!job->error)
+                job->errnum = errno;
+            job->error = 1;
+            pthread_cond_broadcast(&job->cond);
+            break;
+        }
+
+        job->ready[band % job->slots] = 1;
+
+        /* Hand over all the bands that are ready, in order. Whoever is
+         * already doing so will also take care of ours. */
+        while(!job->error && !job->delivering
+               && job->delivered < job->bands
+               && job->ready[job->delivered % job->slots])
+        {
+            int d = job->delivered, y = d * job->rows;
+            int rows = job->height - y < job->rows ? job->height - y
+                                                   : job->rows;
+            uint8_t *buf = job->buffers
+                            + (size_t)(d % job->slots) * job->rows * job->pitch;
+
+            job->delivering = 1;
+            pthread_mutex_unlock(&job->mutex);
+            ret = job->callback(job->data, buf, y, rows, job->pitch);
+            pthread_mutex_lock(&job->mutex);
+
+            job->ready[d % job->slots] = 0;
+            job->delivered++;
+            job->delivering = 0;
+            if(ret < 0 && !job->error)
+            {
+                job->errnum = errno;
+                job->error = 1;
+            }
+            pthread_cond_broadcast(&job->cond);
+        }
+    }
+
+    pthread_mutex_unlock(&job->mutex);
+
+    return NULL;
+}
+#endif
+
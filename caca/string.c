@@ -31,11 +31,19 @@
 #   if defined(HAVE_SYS_IOCTL_H)
 #       include <sys/ioctl.h>
 #   endif
+#   if defined HAVE_SSE2_INTRINSICS
+#       include <emmintrin.h>
+#   endif
+#else
+#   undef HAVE_SSE2_INTRINSICS
 #endif
 
 #include "caca.h"
 #include "caca_internals.h"
 
+static int blit_row(uint32_t *, uint32_t *, uint32_t const *,
+                    uint32_t const *, uint32_t const *, int, int *);
+
 #if defined _WIN32 && defined __GNUC__ && __GNUC__ >= 3
 #   if !HAVE_VSNPRINTF_S
 int vsnprintf_s(char *s, size_t n, size_t c,
@@ -195,7 +203,7 @@ int caca_put_char(caca_canvas_t *cv, int x, int y, uint32_t ch)
      * but it's the caller's responsibility not to corrupt the contents. */
     if(!cv->dirty_disabled
         && (curchar[0] != ch || curattr[0] != attr))
-        caca_add_dirty_rect(cv, xmin, y, xmax - xmin + 1, 1);
+        _caca_mark_dirty_cells(cv, xmin, y, xmax - xmin + 1);
 
     curchar[0] = ch;
     curattr[0] = attr;
@@ -459,7 +467,7 @@ int caca_get_canvas_handle_y(caca_canvas_t const *cv)
 int caca_blit(caca_canvas_t *dst, int x, int y,
               caca_canvas_t const *src, caca_canvas_t const *mask)
 {
-    int i, j, starti, startj, endi, endj, stride, bleed_left, bleed_right;
+    int j, starti, startj, endi, endj, stride, bleed_left, bleed_right;
 
     if(mask && (src->width != mask->width || src->height != mask->height))
     {
@@ -484,14 +492,20 @@ int caca_blit(caca_canvas_t *dst, int x, int y,
 
     for(j = startj; j < endj; j++)
     {
+        int first, last;
         int dstix = (j + y) * dst->width + starti + x;
         int srcix = j * src->width + starti;
 
+        /* The span of cells that actually changed, relative to dstix */
+        first = stride;
+        last = -1;
+
         /* FIXME: we are ignoring the mask here */
         if((starti + x) && dst->chars[dstix] == CACA_MAGIC_FULLWIDTH)
         {
             dst->chars[dstix - 1] = ' ';
             bleed_left = 1;
+            first = -1;
         }
 
         if(endi + x < dst->width
@@ -499,46 +513,54 @@ int caca_blit(caca_canvas_t *dst, int x, int y,
         {
             dst->chars[dstix + stride] = ' ';
             bleed_right = 1;
+            last = stride;
         }
 
-        if(mask)
-        {
-            for(i = 0; i < stride; i++)
-            {
-                if(mask->chars[srcix + i] == (uint32_t)' ')
-                    continue;
-
-                if(dst->chars[dstix + i] != src->chars[srcix + i] ||
-                   dst->attrs[dstix + i] != src->attrs[srcix + i])
-                {
-                    dst->chars[dstix + i] = src->chars[srcix + i];
-                    dst->attrs[dstix + i] = src->attrs[srcix + i];
-                    if(!dst->dirty_disabled)
-                        caca_add_dirty_rect(dst, x + starti + i, y + j, 1, 1);
-                }
-            }
-        }
-        else
+        /* Unchanged rows are common, and memcmp() is faster than
+         * blit_row() at spotting them */
+        if(mask || memcmp(dst->chars + dstix, src->chars + srcix, stride * 4)
+                || memcmp(dst->attrs + dstix, src->attrs + srcix, stride * 4))
         {
-            if(memcmp(dst->chars + dstix, src->chars + srcix, stride * 4) ||
-               memcmp(dst->attrs + dstix, src->attrs + srcix, stride * 4))
+            int rowlast, rowfirst = blit_row(dst->chars + dstix,
+                                             dst->attrs + dstix,
+                                             src->chars + srcix,
+                                             src->attrs + srcix,
+                                             mask ? mask->chars + srcix : NULL,
+                                             stride, &rowlast);
+            if(rowfirst >= 0)
             {
-                /* FIXME be more precise ? */
-                memcpy(dst->chars + dstix, src->chars + srcix, stride * 4);
-                memcpy(dst->attrs + dstix, src->attrs + srcix, stride * 4);
-                if(!dst->dirty_disabled)
-                    caca_add_dirty_rect(dst, x + starti, y + j, stride, 1);
+                if(rowfirst < first)
+                    first = rowfirst;
+                if(rowlast > last)
+                    last = rowlast;
             }
         }
 
         /* Fix split fullwidth chars */
-        if(src->chars[srcix] == CACA_MAGIC_FULLWIDTH)
+        if(src->chars[srcix] == CACA_MAGIC_FULLWIDTH
+                && dst->chars[dstix] != ' ')
+        {
             dst->chars[dstix] = ' ';
+            if(first > 0)
+                first = 0;
+            if(last < 0)
+                last = 0;
+        }
 
-        if(endi < src->width && src->chars[endi] == CACA_MAGIC_FULLWIDTH)
+        if(endi < src->width && src->chars[endi] == CACA_MAGIC_FULLWIDTH
+                && dst->chars[dstix + stride - 1] != ' ')
+        {
             dst->chars[dstix + stride - 1] = ' ';
-    }
+            if(first > stride - 1)
+                first = stride - 1;
+            if(last < stride - 1)
+                last = stride - 1;
+        }
 
+        if(first <= last && !dst->dirty_disabled)
+            caca_add_dirty_rect(dst, x + starti + first, y + j,
+                                last - first + 1, 1);
+    }
 
     return 0;
 }
@@ -598,6 +620,16 @@ int caca_set_canvas_boundaries(caca_canvas_t *cv, int x, int y, int w, int h)
     free(cv->frames);
 
     cv->frames = new->frames;
+
+    /* Take the dirty cell map as well, since it has the new size */
+    free(cv->dirty_bits);
+    free(cv->dirty);
+    cv->dirty_bits = new->dirty_bits;
+    cv->dirty_stride = new->dirty_stride;
+    cv->dirty_valid = new->dirty_valid;
+    cv->ndirty = new->ndirty;
+    cv->dirty_size = new->dirty_size;
+    cv->dirty = new->dirty;
     free(new);
 
     caca_set_frame(cv, saved_f);
@@ -610,6 +642,81 @@ int caca_set_canvas_boundaries(caca_canvas_t *cv, int x, int y, int w, int h)
     return 0;
 }
 
+/*
+ * XXX: the following functions are local.
+ */
+
+/* Copy a row of n cells where the mask, if any, is not a space, and return
+ * the index of the first changed cell, or -1 if none changed. The index of
+ * the last changed cell is stored in last. */
+static int blit_row(uint32_t *chars, uint32_t *attrs,
+                    uint32_t const *srcchars, uint32_t const *srcattrs,
+                    uint32_t const *maskchars, int n, int *last)
+{
+    int i = 0, first = -1;
+
+#if defined HAVE_SSE2_INTRINSICS
+    /* Four cells at a time: find the lanes where the cell differs and the
+     * mask allows a copy, then merge the source into them */
+    __m128i const space = _mm_set1_epi32(' ');
+
+    for( ; i + 4 <= n; i += 4)
+    {
+        __m128i ch, attr, srcch, srcattr, keep;
+        int bits;
+
+        ch = _mm_loadu_si128((__m128i const *)(chars + i));
+        attr = _mm_loadu_si128((__m128i const *)(attrs + i));
+        srcch = _mm_loadu_si128((__m128i const *)(srcchars + i));
+        srcattr = _mm_loadu_si128((__m128i const *)(srcattrs + i));
+
+        /* Lanes to leave alone: equal cells, and spaces in the mask */
+        keep = _mm_and_si128(_mm_cmpeq_epi32(ch, srcch),
+                             _mm_cmpeq_epi32(attr, srcattr));
+        if(maskchars)
+            keep = _mm_or_si128(keep, _mm_cmpeq_epi32(space,
+                _mm_loadu_si128((__m128i const *)(maskchars + i))));
+
+        /* One bit per byte, so four per lane */
+        bits = _mm_movemask_epi8(keep) ^ 0xffff;
+        if(!bits)
+            continue;
+
+        if(maskchars)
+        {
+            srcch = _mm_or_si128(_mm_and_si128(keep, ch),
+                                 _mm_andnot_si128(keep, srcch));
+            srcattr = _mm_or_si128(_mm_and_si128(keep, attr),
+                                   _mm_andnot_si128(keep, srcattr));
+        }
+
+        _mm_storeu_si128((__m128i *)(chars + i), srcch);
+        _mm_storeu_si128((__m128i *)(attrs + i), srcattr);
+
+        if(first < 0)
+            first = i + __builtin_ctz(bits) / 4;
+        *last = i + (31 - __builtin_clz(bits)) / 4;
+    }
+#endif
+
+    for( ; i < n; i++)
+    {
+        if(maskchars && maskchars[i] == (uint32_t)' ')
+            continue;
+
+        if(chars[i] != srcchars[i] || attrs[i] != srcattrs[i])
+        {
+            chars[i] = srcchars[i];
+            attrs[i] = srcattrs[i];
+            if(first < 0)
+                first = i;
+            *last = i;
+        }
+    }
+
+    return first;
+}
+
 /*
  * Functions for the mingw32 runtime
  */
@@ -10,14 +10,33 @@
  *  http://www.wtfpl.net/ for more details.
  */
 
+/* For posix_openpt() and friends */
+#define _XOPEN_SOURCE 600
+
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#if (defined USE_NCURSES || defined USE_VT) && defined HAVE_POSIX_OPENPT
+#   include <fcntl.h>
+#   include <signal.h>
+#   include <unistd.h>
+#   include <sys/ioctl.h>
+#   include <sys/wait.h>
+#endif
 
 #include "caca.h"
 
 #define BLIT_LOOPS 1000000
 #define PUTCHAR_LOOPS 50000000
+#define DITHER_LOOPS 20
+#define SPRITE_LOOPS 100000
+#define EXPORT_LOOPS 5000
+#define IMPORT_LOOPS 200
+#define RENDER_LOOPS 20
+#define IMAGE_LOOPS 20
+#define MARKUP_LOOPS 100
+#define TERMINAL_LOOPS 200
 
 #define TIME(desc, code) \
 { \
@@ -67,6 +86,427 @@ static void putchars(int optim)
     caca_free_canvas(cv);
 }
 
+static void sprites(int count)
+{
+    caca_canvas_t *cv;
+    int i, j, n, area = 0;
+
+    /* Small sprites moving around, and a driver-like dirty list walk */
+    cv = caca_create_canvas(200, 60);
+    for(i = 0; i < SPRITE_LOOPS; i++)
+    {
+        caca_clear_dirty_rect_list(cv);
+        for(j = 0; j < count; j++)
+        {
+            caca_put_str(cv, ((i - 1) * 7 + j * 37) % 196,
+                         1 + ((i - 1) + j * 13) % 56, "   ");
+            caca_put_str(cv, (i * 7 + j * 37) % 196, 1 + (i + j * 13) % 56,
+                         i & 1 ? "<o>" : "[x]");
+        }
+        for(n = caca_get_dirty_rect_count(cv); n--; )
+        {
+            int x, y, w, h;
+            caca_get_dirty_rect(cv, n, &x, &y, &w, &h);
+            area += w * h;
+        }
+    }
+    caca_free_canvas(cv);
+    printf("%3d%% dirty, ", area / (SPRITE_LOOPS * 120));
+}
+
+static void export(char const *format, int reuse)
+{
+    caca_canvas_t *cv;
+    void *buf = NULL;
+    size_t bytes = 0;
+    int i;
+
+    cv = caca_create_canvas(200, 60);
+    for(i = 0; i < 200 * 60; i++)
+    {
+        if(i % 4 == 0)
+            caca_set_color_ansi(cv, i % 16, i / 7 % 16);
+        caca_put_char(cv, i % 200, i / 200, 'a' + i % 26);
+    }
+    if(reuse)
+    {
+        bytes = caca_export_canvas_to_buffer(cv, format, NULL, 0);
+        buf = malloc(bytes);
+    }
+    for(i = 0; i < EXPORT_LOOPS; i++)
+    {
+        if(reuse)
+            caca_export_canvas_to_buffer(cv, format, buf, bytes);
+        else
+            free(caca_export_canvas_to_memory(cv, format, &bytes));
+    }
+    free(buf);
+    caca_free_canvas(cv);
+}
+
+static void delta(int count)
+{
+    caca_canvas_t *cv, *old;
+    char buf[200 * 60 * 32];
+    size_t bytes = 0;
+    int i, j;
+
+    /* Sprites moving on a coloured 200x60 canvas, one delta per frame */
+    cv = caca_create_canvas(200, 60);
+    for(i = 0; i < 200 * 60; i++)
+    {
+        caca_set_color_ansi(cv, i % 16, i / 7 % 16);
+        caca_put_char(cv, i % 200, i / 200, 'a' + i % 26);
+    }
+    old = caca_create_canvas(200, 60);
+    caca_blit(old, 0, 0, cv, NULL);
+    for(i = 0; i < EXPORT_LOOPS; i++)
+    {
+        for(j = 0; j < count; j++)
+        {
+            caca_put_str(cv, ((i - 1) * 7 + j * 37) % 196,
+                         1 + ((i - 1) + j * 13) % 56, "   ");
+            caca_put_str(cv, (i * 7 + j * 37) % 196, 1 + (i + j * 13) % 56,
+                         i & 1 ? "<o>" : "[x]");
+        }
+        bytes += caca_export_canvas_delta_to_buffer(old, cv, buf,
+                                                    sizeof(buf));
+        caca_blit(old, 0, 0, cv, NULL);
+    }
+    caca_free_canvas(old);
+    caca_free_canvas(cv);
+    printf("%6d bytes/frame, ", (int)(bytes / EXPORT_LOOPS));
+}
+
+static void import(int frames)
+{
+    caca_display_t *dp;
+    caca_canvas_t *cv;
+    void *buf;
+    size_t bytes;
+    int i, f;
+
+    /* A multi-frame 200x60 animation, imported as a whole */
+    cv = caca_create_canvas(200, 60);
+    for(f = 0; f < frames; f++)
+    {
+        if(f)
+            caca_create_frame(cv, f);
+        caca_set_frame(cv, f);
+        for(i = 0; i < 200 * 60; i++)
+        {
+            if(i % 4 == 0)
+                caca_set_color_ansi(cv, (i + f) % 16, i / 7 % 16);
+            caca_put_char(cv, i % 200, i / 200, 'a' + (i + f) % 26);
+        }
+    }
+    buf = caca_export_canvas_to_memory(cv, "caca", &bytes);
+
+    dp = caca_create_display_with_driver(NULL, "null");
+    caca_refresh_display(dp);
+    for(i = 0; i < IMPORT_LOOPS; i++)
+        caca_import_canvas_from_memory(cv, buf, bytes, "caca");
+    caca_refresh_display(dp);
+    printf("%5d MB/s, ", (int)((double)bytes * IMPORT_LOOPS
+                               / caca_get_display_time(dp)));
+    caca_free_display(dp);
+
+    free(buf);
+    caca_free_canvas(cv);
+}
+
+static int discard(void *data, void const *pixels, int y, int height,
+                   int pitch)
+{
+    return 0;
+}
+
+static void render(char const *font, int threads)
+{
+    caca_canvas_t *cv;
+    caca_font_t *f;
+    void *buf;
+    int i, w, h;
+
+    /* A coloured 200x80 canvas, rendered to pixels */
+    cv = caca_create_canvas(200, 80);
+    for(i = 0; i < 200 * 80; i++)
+    {
+        if(i % 4 == 0)
+            caca_set_color_ansi(cv, i % 16, i / 7 % 16);
+        caca_put_char(cv, i % 200, i / 200, i % 9 ? 'a' + i % 26 : 0x2591);
+    }
+    f = caca_load_font(font, 0);
+    w = 200 * caca_get_font_width(f);
+    h = 80 * caca_get_font_height(f);
+    buf = malloc(4 * w * h);
+    for(i = 0; i < RENDER_LOOPS; i++)
+    {
+        if(threads < 0)
+            caca_render_canvas(cv, f, buf, w, h, 4 * w);
+        else
+            caca_render_canvas_stream(cv, f, "argb", 0, threads,
+                                      discard, NULL);
+    }
+    free(buf);
+    caca_free_font(f);
+    caca_free_canvas(cv);
+}
+
+static void markup(char const *format)
+{
+    caca_canvas_t *cv;
+    caca_dither_t *d;
+    uint32_t *pixels;
+    size_t bytes = 0;
+    int i, j;
+
+    /* A gradient dithered to a 200x80 canvas, exported to a document */
+    pixels = malloc(640 * 480 * sizeof(uint32_t));
+    for(j = 0; j < 480; j++)
+        for(i = 0; i < 640; i++)
+            pixels[j * 640 + i] = ((i * 255 / 640) << 16)
+                                | ((j * 255 / 480) << 8) | ((i ^ j) & 0xff);
+
+    cv = caca_create_canvas(200, 80);
+    d = caca_create_dither(32, 640, 480, 640 * 4,
+                           0x00ff0000, 0x0000ff00, 0x000000ff, 0x0);
+    caca_dither_bitmap(cv, 0, 0, 200, 80, d, pixels);
+    for(i = 0; i < MARKUP_LOOPS; i++)
+        free(caca_export_canvas_to_memory(cv, format, &bytes));
+    caca_free_dither(d);
+    caca_free_canvas(cv);
+    free(pixels);
+    printf("%5d kB, ", (int)(bytes / 1024));
+}
+
+static void image(char const *format)
+{
+    caca_canvas_t *cv;
+    size_t bytes = 0;
+    int i;
+
+    /* The canvas used for rendering, exported to an image file */
+    cv = caca_create_canvas(200, 80);
+    for(i = 0; i < 200 * 80; i++)
+    {
+        if(i % 4 == 0)
+            caca_set_color_ansi(cv, i % 16, i / 7 % 16);
+        caca_put_char(cv, i % 200, i / 200, i % 9 ? 'a' + i % 26 : 0x2591);
+    }
+    for(i = 0; i < IMAGE_LOOPS; i++)
+        free(caca_export_canvas_to_memory(cv, format, &bytes));
+    caca_free_canvas(cv);
+    printf("%5d kB, ", (int)(bytes / 1024));
+}
+
+#if ((defined USE_NCURSES || defined USE_VT) && defined HAVE_POSIX_OPENPT) \
+     || defined USE_X11
+/* Dithered video or coloured text frames, for the display drivers */
+static void animation(caca_canvas_t *frames[8], int video)
+{
+    caca_dither_t *d;
+    uint32_t *pixels;
+    int i, j;
+
+    pixels = malloc(320 * 240 * sizeof(uint32_t));
+    d = caca_create_dither(32, 320, 240, 320 * 4,
+                           0x00ff0000, 0x0000ff00, 0x000000ff, 0x0);
+    for(i = 0; i < 8; i++)
+    {
+        frames[i] = caca_create_canvas(200, 60);
+        if(!video)
+        {
+            for(j = 0; j < 200 * 60; j++)
+            {
+                if(j % 8 == 0)
+                    caca_set_color_ansi(frames[i], (j / 8 + i) % 16,
+                                        j / 200 % 8);
+                caca_put_char(frames[i], j % 200, j / 200,
+                              'a' + (i + j) % 26);
+            }
+            continue;
+        }
+        for(j = 0; j < 320 * 240; j++)
+            pixels[j] = ((j % 320 * 255 / 320 + i * 32) & 0xff) << 16
+                      | ((j / 320 * 255 / 240) << 8) | ((j ^ (i << 4)) & 0xff);
+        caca_dither_bitmap(frames[i], 0, 0, 200, 60, d, pixels);
+    }
+    caca_free_dither(d);
+    free(pixels);
+}
+
+/* Show the animation with the given driver, and return the frame rate */
+static int play(char const *driver, caca_canvas_t *frames[8])
+{
+    caca_display_t *dp, *timer;
+    caca_canvas_t *cv;
+    int i, fps;
+
+    cv = caca_create_canvas(200, 60);
+    dp = caca_create_display_with_driver(cv, driver);
+    if(!dp)
+    {
+        caca_free_canvas(cv);
+        return 0;
+    }
+    timer = caca_create_display_with_driver(NULL, "null");
+    caca_refresh_display(timer);
+    for(i = 0; i < TERMINAL_LOOPS; i++)
+    {
+        caca_blit(cv, 0, 0, frames[i % 8], NULL);
+        caca_refresh_display(dp);
+    }
+    caca_refresh_display(timer);
+    caca_free_display(dp);
+
+    fps = (int)((double)TERMINAL_LOOPS * 1000000
+                 / caca_get_display_time(timer));
+    caca_free_display(timer);
+    caca_free_canvas(cv);
+
+    return fps;
+}
+#endif
+
+#if (defined USE_NCURSES || defined USE_VT) && defined HAVE_POSIX_OPENPT
+static void terminal(char const *driver, int video)
+{
+    caca_canvas_t *frames[8];
+    struct winsize ws = { 60, 200, 0, 0 };
+    char buf[4096];
+    pid_t pid;
+    int master, slave, in, out, i, fps;
+
+    /* Displayed in a 200x60 pseudo-terminal */
+    animation(frames, video);
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    grantpt(master);
+    unlockpt(master);
+    slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    ioctl(slave, TIOCSWINSZ, &ws);
+
+    /* Play the terminal, reading everything the driver writes */
+    pid = fork();
+    if(pid == 0)
+    {
+        close(slave);
+        while(read(master, buf, sizeof(buf)) > 0)
+            ;
+        _exit(0);
+    }
+    close(master);
+
+    fflush(stdout);
+    in = dup(STDIN_FILENO);
+    out = dup(STDOUT_FILENO);
+    dup2(slave, STDIN_FILENO);
+    dup2(slave, STDOUT_FILENO);
+    setenv("TERM", "xterm-256color", 1);
+
+    fps = play(driver, frames);
+
+    dup2(in, STDIN_FILENO);
+    dup2(out, STDOUT_FILENO);
+    close(in);
+    close(out);
+    close(slave);
+    waitpid(pid, NULL, 0);
+
+    printf("%5d fps, ", fps);
+    for(i = 0; i < 8; i++)
+        caca_free_canvas(frames[i]);
+}
+#endif
+
+#if defined USE_X11 || defined USE_GL
+static void window(char const *driver, char const *font, int video)
+{
+    caca_canvas_t *frames[8];
+    int i;
+
+    /* Needs an X server, such as Xvfb */
+    if(!getenv("DISPLAY") || !*getenv("DISPLAY"))
+    {
+        printf("no X server, ");
+        return;
+    }
+
+    animation(frames, video);
+
+    /* The built-in fonts use the MIT-SHM backend */
+    if(font)
+        setenv("CACA_FONT", font, 1);
+    printf("%5d fps, ", play(driver, frames));
+
+    for(i = 0; i < 8; i++)
+        caca_free_canvas(frames[i]);
+}
+#endif
+
+static void dither(char const *algo, char const *color, char const *antialias,
+                   int lookup, int threads)
+{
+    caca_canvas_t *cv;
+    caca_dither_t *d;
+    uint32_t *pixels;
+    int i, j;
+
+    /* A 4K frame rendered to a 400x200 canvas */
+    pixels = malloc(3840 * 2160 * sizeof(uint32_t));
+    for(j = 0; j < 2160; j++)
+        for(i = 0; i < 3840; i++)
+            pixels[j * 3840 + i] = ((i * 255 / 3840) << 16)
+                                 | ((j * 255 / 2160) << 8) | ((i ^ j) & 0xff);
+
+    cv = caca_create_canvas(400, 200);
+    d = caca_create_dither(32, 3840, 2160, 3840 * 4,
+                           0x00ff0000, 0x0000ff00, 0x000000ff, 0x0);
+    caca_set_dither_algorithm(d, algo);
+    caca_set_dither_color(d, color);
+    caca_set_dither_antialias(d, antialias);
+    caca_set_dither_lookup(d, lookup);
+    caca_set_dither_threads(d, threads);
+    for(i = 0; i < DITHER_LOOPS; i++)
+        caca_dither_bitmap(cv, 0, 0, 400, 200, d, pixels);
+    caca_free_dither(d);
+    caca_free_canvas(cv);
+    free(pixels);
+}
+
+static void fetch(int bpp, float gamma)
+{
+    static uint32_t const masks[][4] =
+    {
+        { 0, 0, 0, 0 },
+        { 0x00ff0000, 0x0000ff00, 0x000000ff, 0x0 },
+        { 0x0000ff00, 0x00ff0000, 0xff000000, 0x000000ff },
+    };
+    caca_canvas_t *cv;
+    caca_dither_t *d;
+    uint8_t *pixels;
+    int i, m = bpp == 8 ? 0 : bpp == 24 ? 1 : 2;
+
+    /* A 4K frame in the given pixel format, with a cheap colour picker
+     * so that fetching the source pixels dominates */
+    pixels = malloc(3840 * 2160 * bpp / 8);
+    for(i = 0; i < 3840 * 2160 * bpp / 8; i++)
+        pixels[i] = (i * 7) ^ (i / 3840);
+
+    cv = caca_create_canvas(400, 200);
+    d = caca_create_dither(bpp, 3840, 2160, 3840 * bpp / 8, masks[m][0],
+                           masks[m][1], masks[m][2], masks[m][3]);
+    caca_set_dither_algorithm(d, "ordered4");
+    caca_set_dither_gamma(d, gamma);
+    caca_set_dither_lookup(d, 5);
+    for(i = 0; i < DITHER_LOOPS; i++)
+        caca_dither_bitmap(cv, 0, 0, 400, 200, d, pixels);
+    caca_free_dither(d);
+    caca_free_canvas(cv);
+    free(pixels);
+}
+
 int main(int argc, char *argv[])
 {
     TIME("blit no mask, no clear", blit(0, 0));
@@ -75,6 +515,69 @@ int main(int argc, char *argv[])
     TIME("blit mask, clear", blit(1, 1));
     TIME("putchars, no optim", putchars(0));
     TIME("putchars, optim", putchars(1));
+    TIME("sprites, 16", sprites(16));
+    TIME("sprites, 64", sprites(64));
+    TIME("export utf8cr, memory", export("utf8cr", 0));
+    TIME("export utf8cr, buffer", export("utf8cr", 1));
+    TIME("export ansi, memory", export("ansi", 0));
+    TIME("export ansi, buffer", export("ansi", 1));
+    TIME("export caca, memory", export("caca", 0));
+    TIME("export caca, buffer", export("caca", 1));
+    TIME("export delta, 16", delta(16));
+    TIME("export delta, 64", delta(64));
+    TIME("import caca, 1 frame", import(1));
+    TIME("import caca, 16 frames", import(16));
+    TIME("render mono9", render("Monospace 9", -1));
+    TIME("render monobold12", render("Monospace Bold 12", -1));
+    TIME("render mono9, stream", render("Monospace 9", 1));
+    TIME("render mono9, threads", render("Monospace 9", 0));
+    TIME("render bold12, threads", render("Monospace Bold 12", 0));
+    TIME("export html", markup("html"));
+    TIME("export htmlcss", markup("htmlcss"));
+    TIME("export svg", markup("svg"));
+    TIME("export svgcss", markup("svgcss"));
+    TIME("export tga", image("tga"));
+    TIME("export png", image("png"));
+#if defined USE_NCURSES && defined HAVE_POSIX_OPENPT
+    TIME("display ncurses, video", terminal("ncurses", 1));
+    TIME("display ncurses, text", terminal("ncurses", 0));
+#endif
+#if defined USE_VT && defined HAVE_POSIX_OPENPT
+    TIME("display vt, video", terminal("vt", 1));
+    TIME("display vt, text", terminal("vt", 0));
+#endif
+#if defined USE_X11
+    TIME("display x11, video", window("x11", "fixed", 1));
+    TIME("display x11, text", window("x11", "fixed", 0));
+    TIME("display x11 shm, video", window("x11", "Monospace 9", 1));
+    TIME("display x11 shm, text", window("x11", "Monospace 9", 0));
+#endif
+#if defined USE_GL
+    TIME("display gl, video", window("gl", NULL, 1));
+    TIME("display gl, text", window("gl", NULL, 0));
+#endif
+    TIME("dither ordered4",
+         dither("ordered4", "full16", "prefilter", 0, 1));
+    TIME("dither ordered4, threads",
+         dither("ordered4", "full16", "prefilter", 0, 0));
+    TIME("dither fstein",
+         dither("fstein", "full16", "prefilter", 0, 1));
+    TIME("dither fstein, threads",
+         dither("fstein", "full16", "prefilter", 0, 0));
+    TIME("dither full16, no aa",
+         dither("fstein", "full16", "none", 0, 1));
+    TIME("dither fullgray, no aa",
+         dither("fstein", "fullgray", "none", 0, 1));
+    TIME("dither ordered4, no aa",
+         dither("ordered4", "full16", "none", 0, 1));
+    TIME("dither ordered4, lookup5",
+         dither("ordered4", "full16", "none", 5, 1));
+    TIME("dither ordered4, lookup6",
+         dither("ordered4", "full16", "none", 6, 1));
+    TIME("fetch 32bpp BGRA", fetch(32, 1.0));
+    TIME("fetch 32bpp, gamma", fetch(32, 2.2));
+    TIME("fetch 24bpp RGB", fetch(24, 1.0));
+    TIME("fetch 8bpp palette", fetch(8, 1.0));
     return 0;
 }
 
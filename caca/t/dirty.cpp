@@ -25,9 +25,14 @@ class DirtyTest : public CppUnit::TestCase
     CPPUNIT_TEST(test_create);
     CPPUNIT_TEST(test_put_char_dirty);
     CPPUNIT_TEST(test_put_char_not_dirty);
+    CPPUNIT_TEST(test_put_attr_dirty);
     CPPUNIT_TEST(test_simplify);
     CPPUNIT_TEST(test_box);
     CPPUNIT_TEST(test_blit);
+    CPPUNIT_TEST(test_blit_span);
+    CPPUNIT_TEST(test_scattered);
+    CPPUNIT_TEST(test_remove);
+    CPPUNIT_TEST(test_resize);
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -171,6 +176,40 @@ public:
         CPPUNIT_ASSERT_EQUAL(0, caca_get_dirty_rect_count(cv));
     }
 
+    void test_put_attr_dirty()
+    {
+        caca_canvas_t *cv;
+        int dx, dy, dw, dh;
+
+        cv = caca_create_canvas(WIDTH, HEIGHT);
+
+        /* Check that changing an attribute creates a 1x1 dirty rect. */
+        caca_clear_dirty_rect_list(cv);
+        caca_put_attr(cv, 31, 4, CACA_BOLD);
+
+        CPPUNIT_ASSERT_EQUAL(1, caca_get_dirty_rect_count(cv));
+        caca_get_dirty_rect(cv, 0, &dx, &dy, &dw, &dh);
+        CPPUNIT_ASSERT_EQUAL(31, dx);
+        CPPUNIT_ASSERT_EQUAL(4, dy);
+        CPPUNIT_ASSERT_EQUAL(1, dw);
+        CPPUNIT_ASSERT_EQUAL(1, dh);
+
+        /* Check that the attribute of a fullwidth character covers both
+         * of its cells, even across a 32-cell boundary. */
+        caca_put_char(cv, 31, 6, 0x2f06 /* ⼆ */);
+        caca_clear_dirty_rect_list(cv);
+        caca_put_attr(cv, 32, 6, CACA_BOLD);
+
+        CPPUNIT_ASSERT_EQUAL(1, caca_get_dirty_rect_count(cv));
+        caca_get_dirty_rect(cv, 0, &dx, &dy, &dw, &dh);
+        CPPUNIT_ASSERT_EQUAL(31, dx);
+        CPPUNIT_ASSERT_EQUAL(6, dy);
+        CPPUNIT_ASSERT_EQUAL(2, dw);
+        CPPUNIT_ASSERT_EQUAL(1, dh);
+
+        caca_free_canvas(cv);
+    }
+
     void test_simplify()
     {
         caca_canvas_t *cv;
@@ -279,6 +318,240 @@ public:
 
     }
 
+    void test_blit_span()
+    {
+        caca_canvas_t *cv, *cv2, *mask, *ref;
+        int dx, dy, dw, dh;
+
+        cv = caca_create_canvas(WIDTH, HEIGHT);
+        cv2 = caca_create_canvas(30, 3);
+        mask = caca_create_canvas(30, 3);
+
+        /* Only the cells that change are dirty, even if the blit covers
+         * more of the row */
+        caca_blit(cv, 7, 2, cv2, NULL);
+        caca_put_char(cv2, 5, 1, 'x');
+        caca_put_char(cv2, 20, 1, 'y');
+        caca_clear_dirty_rect_list(cv);
+        caca_blit(cv, 7, 2, cv2, NULL);
+        CPPUNIT_ASSERT_EQUAL(1, caca_get_dirty_rect_count(cv));
+        caca_get_dirty_rect(cv, 0, &dx, &dy, &dw, &dh);
+        CPPUNIT_ASSERT_EQUAL(12, dx);
+        CPPUNIT_ASSERT_EQUAL(3, dy);
+        CPPUNIT_ASSERT_EQUAL(16, dw);
+        CPPUNIT_ASSERT_EQUAL(1, dh);
+        CPPUNIT_ASSERT_EQUAL((unsigned long)'x', caca_get_char(cv, 12, 3));
+        CPPUNIT_ASSERT_EQUAL((unsigned long)'y', caca_get_char(cv, 27, 3));
+
+        /* Masked cells are neither copied nor dirty */
+        caca_put_char(cv2, 5, 1, 'z');
+        caca_put_char(cv2, 20, 1, 'z');
+        caca_put_char(mask, 20, 1, '#');
+        caca_clear_dirty_rect_list(cv);
+        caca_blit(cv, 7, 2, cv2, mask);
+        CPPUNIT_ASSERT_EQUAL(1, caca_get_dirty_rect_count(cv));
+        caca_get_dirty_rect(cv, 0, &dx, &dy, &dw, &dh);
+        CPPUNIT_ASSERT_EQUAL(27, dx);
+        CPPUNIT_ASSERT_EQUAL(3, dy);
+        CPPUNIT_ASSERT_EQUAL(1, dw);
+        CPPUNIT_ASSERT_EQUAL(1, dh);
+        CPPUNIT_ASSERT_EQUAL((unsigned long)'x', caca_get_char(cv, 12, 3));
+        CPPUNIT_ASSERT_EQUAL((unsigned long)'z', caca_get_char(cv, 27, 3));
+
+        /* Halves of fullwidth characters cleared by the blit are dirty too,
+         * even if the mask hides them */
+        caca_canvas_t *wide = caca_create_canvas(2, 1);
+        caca_canvas_t *widemask = caca_create_canvas(2, 1);
+        caca_put_char(cv, 0, 6, 'q');
+        caca_put_char(cv, 10, 6, 0xff21);
+        caca_put_char(wide, 0, 0, 0xff21);
+        caca_clear_dirty_rect_list(cv);
+        caca_blit(cv, -1, 6, wide, widemask);
+        CPPUNIT_ASSERT_EQUAL((unsigned long)' ', caca_get_char(cv, 0, 6));
+        CPPUNIT_ASSERT_EQUAL(1, caca_get_dirty_rect_count(cv));
+        caca_get_dirty_rect(cv, 0, &dx, &dy, &dw, &dh);
+        CPPUNIT_ASSERT_EQUAL(0, dx);
+        CPPUNIT_ASSERT_EQUAL(6, dy);
+        CPPUNIT_ASSERT_EQUAL(1, dw);
+
+        caca_put_char(wide, 0, 0, 'x');
+        caca_clear_dirty_rect_list(cv);
+        caca_blit(cv, 11, 6, wide, NULL);
+        CPPUNIT_ASSERT_EQUAL((unsigned long)' ', caca_get_char(cv, 10, 6));
+        CPPUNIT_ASSERT_EQUAL(1, caca_get_dirty_rect_count(cv));
+        caca_get_dirty_rect(cv, 0, &dx, &dy, &dw, &dh);
+        CPPUNIT_ASSERT_EQUAL(10, dx);
+        CPPUNIT_ASSERT_EQUAL(6, dy);
+        CPPUNIT_ASSERT_EQUAL(2, dw);
+        caca_free_canvas(widemask);
+        caca_free_canvas(wide);
+
+        /* Random blits at all alignments give the same canvas as a plain
+         * cell by cell copy */
+        ref = caca_create_canvas(WIDTH, HEIGHT);
+        caca_blit(ref, 0, 0, cv, NULL);
+        srand(7);
+        for(int n = 0; n < 200; n++)
+        {
+            int x = rand() % 40 - 10, y = rand() % 10 - 2;
+
+            for(int j = 0; j < 3; j++)
+                for(int i = 0; i < 30; i++)
+                {
+                    caca_set_color_ansi(cv2, rand() % 3, CACA_BLACK);
+                    caca_put_char(cv2, i, j, 'a' + rand() % 3);
+                    caca_put_char(mask, i, j, rand() % 3 ? '#' : ' ');
+                }
+
+            caca_blit(cv, x, y, cv2, n & 1 ? mask : NULL);
+
+            for(int j = 0; j < 3; j++)
+                for(int i = 0; i < 30; i++)
+                {
+                    if((n & 1) && caca_get_char(mask, i, j) == ' ')
+                        continue;
+                    caca_set_attr(ref, caca_get_attr(cv2, i, j));
+                    caca_put_char(ref, x + i, y + j, caca_get_char(cv2, i, j));
+                }
+
+            for(int j = 0; j < HEIGHT; j++)
+                for(int i = 0; i < WIDTH; i++)
+                {
+                    CPPUNIT_ASSERT_EQUAL(caca_get_char(ref, i, j),
+                                         caca_get_char(cv, i, j));
+                    CPPUNIT_ASSERT_EQUAL(caca_get_attr(ref, i, j),
+                                         caca_get_attr(cv, i, j));
+                }
+        }
+
+        caca_free_canvas(ref);
+        caca_free_canvas(mask);
+        caca_free_canvas(cv2);
+        caca_free_canvas(cv);
+    }
+
+    void test_scattered()
+    {
+        caca_canvas_t *cv;
+        int dx, dy, dw, dh;
+
+        cv = caca_create_canvas(WIDTH, HEIGHT);
+
+        /* Check that a ticker at the top and a clock at the bottom do not
+         * get merged into one big rectangle. */
+        caca_clear_dirty_rect_list(cv);
+        caca_put_str(cv, 0, 0, "ticker");
+        caca_put_str(cv, WIDTH - 5, HEIGHT - 1, "12:00");
+
+        CPPUNIT_ASSERT_EQUAL(2, caca_get_dirty_rect_count(cv));
+        caca_get_dirty_rect(cv, 0, &dx, &dy, &dw, &dh);
+        CPPUNIT_ASSERT_EQUAL(0, dx);
+        CPPUNIT_ASSERT_EQUAL(0, dy);
+        CPPUNIT_ASSERT_EQUAL(6, dw);
+        CPPUNIT_ASSERT_EQUAL(1, dh);
+        caca_get_dirty_rect(cv, 1, &dx, &dy, &dw, &dh);
+        CPPUNIT_ASSERT_EQUAL(WIDTH - 5, dx);
+        CPPUNIT_ASSERT_EQUAL(HEIGHT - 1, dy);
+        CPPUNIT_ASSERT_EQUAL(5, dw);
+        CPPUNIT_ASSERT_EQUAL(1, dh);
+
+        /* Check that many scattered cells stay separate and exact. */
+        caca_clear_dirty_rect_list(cv);
+        for(int i = 0; i < 40; i++)
+            caca_put_char(cv, i * 2, i, '*');
+
+        CPPUNIT_ASSERT_EQUAL(40, caca_get_dirty_rect_count(cv));
+        for(int i = 0; i < 40; i++)
+        {
+            caca_get_dirty_rect(cv, i, &dx, &dy, &dw, &dh);
+            CPPUNIT_ASSERT_EQUAL(i * 2, dx);
+            CPPUNIT_ASSERT_EQUAL(i, dy);
+            CPPUNIT_ASSERT_EQUAL(1, dw);
+            CPPUNIT_ASSERT_EQUAL(1, dh);
+        }
+
+        caca_free_canvas(cv);
+    }
+
+    void test_remove()
+    {
+        caca_canvas_t *cv;
+        int dx, dy, dw, dh;
+
+        cv = caca_create_canvas(WIDTH, HEIGHT);
+
+        /* Check that removing the middle of a dirty rectangle leaves the
+         * rows above, the sides and the rows below. */
+        caca_clear_dirty_rect_list(cv);
+        caca_add_dirty_rect(cv, 10, 10, 10, 10);
+        CPPUNIT_ASSERT_EQUAL(0, caca_remove_dirty_rect(cv, 12, 12, 6, 6));
+
+        CPPUNIT_ASSERT_EQUAL(4, caca_get_dirty_rect_count(cv));
+        caca_get_dirty_rect(cv, 0, &dx, &dy, &dw, &dh);
+        CPPUNIT_ASSERT_EQUAL(10, dx);
+        CPPUNIT_ASSERT_EQUAL(10, dy);
+        CPPUNIT_ASSERT_EQUAL(10, dw);
+        CPPUNIT_ASSERT_EQUAL(2, dh);
+        caca_get_dirty_rect(cv, 1, &dx, &dy, &dw, &dh);
+        CPPUNIT_ASSERT_EQUAL(10, dx);
+        CPPUNIT_ASSERT_EQUAL(12, dy);
+        CPPUNIT_ASSERT_EQUAL(2, dw);
+        CPPUNIT_ASSERT_EQUAL(6, dh);
+        caca_get_dirty_rect(cv, 2, &dx, &dy, &dw, &dh);
+        CPPUNIT_ASSERT_EQUAL(18, dx);
+        CPPUNIT_ASSERT_EQUAL(12, dy);
+        CPPUNIT_ASSERT_EQUAL(2, dw);
+        CPPUNIT_ASSERT_EQUAL(6, dh);
+        caca_get_dirty_rect(cv, 3, &dx, &dy, &dw, &dh);
+        CPPUNIT_ASSERT_EQUAL(10, dx);
+        CPPUNIT_ASSERT_EQUAL(18, dy);
+        CPPUNIT_ASSERT_EQUAL(10, dw);
+        CPPUNIT_ASSERT_EQUAL(2, dh);
+
+        /* Check that removing a larger area clears everything. */
+        caca_remove_dirty_rect(cv, -5, -5, WIDTH + 10, HEIGHT + 10);
+        CPPUNIT_ASSERT_EQUAL(0, caca_get_dirty_rect_count(cv));
+
+        /* Check that out-of-canvas areas are rejected. */
+        CPPUNIT_ASSERT_EQUAL(-1, caca_remove_dirty_rect(cv, WIDTH, 0, 5, 5));
+
+        caca_free_canvas(cv);
+    }
+
+    void test_resize()
+    {
+        caca_canvas_t *cv;
+        int dx, dy, dw, dh;
+
+        cv = caca_create_canvas(WIDTH, HEIGHT);
+
+        /* Check that dirty cells survive a resize and are clipped to the
+         * new canvas size. */
+        caca_clear_dirty_rect_list(cv);
+        caca_add_dirty_rect(cv, 30, 5, 40, 3);
+        caca_set_canvas_size(cv, 50, HEIGHT);
+
+        CPPUNIT_ASSERT_EQUAL(1, caca_get_dirty_rect_count(cv));
+        caca_get_dirty_rect(cv, 0, &dx, &dy, &dw, &dh);
+        CPPUNIT_ASSERT_EQUAL(30, dx);
+        CPPUNIT_ASSERT_EQUAL(5, dy);
+        CPPUNIT_ASSERT_EQUAL(20, dw);
+        CPPUNIT_ASSERT_EQUAL(3, dh);
+
+        /* Check that growing the canvas only adds the new area. */
+        caca_clear_dirty_rect_list(cv);
+        caca_set_canvas_size(cv, 50, HEIGHT + 2);
+
+        CPPUNIT_ASSERT_EQUAL(1, caca_get_dirty_rect_count(cv));
+        caca_get_dirty_rect(cv, 0, &dx, &dy, &dw, &dh);
+        CPPUNIT_ASSERT_EQUAL(0, dx);
+        CPPUNIT_ASSERT_EQUAL(HEIGHT, dy);
+        CPPUNIT_ASSERT_EQUAL(50, dw);
+        CPPUNIT_ASSERT_EQUAL(2, dh);
+
+        caca_free_canvas(cv);
+    }
+
 private:
     static int const WIDTH, HEIGHT;
 };
@@ -0,0 +1,385 @@
+/*
+ *  caca-test     testsuite program for libcaca
+ *  Copyright © 2026 agent <agent@local>
+ *              All Rights Reserved
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+#include "config.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/TestCaller.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestSuite.h>
+#include <cstdlib>
+#include <cstring>
+#if defined HAVE_PTHREAD_H
+#   include <pthread.h>
+#endif
+
+#include "caca.h"
+
+struct dither_job
+{
+    caca_canvas_t *cv;
+    caca_dither_t const *d;
+    uint32_t const *pixels;
+    int loops;
+};
+
+static void *dither_thread(void *arg)
+{
+    struct dither_job *job = (struct dither_job *)arg;
+
+    for(int i = 0; i < job->loops; i++)
+        caca_dither_bitmap(job->cv, 0, 0, caca_get_canvas_width(job->cv),
+                           caca_get_canvas_height(job->cv), job->d,
+                           job->pixels);
+
+    return NULL;
+}
+
+class DitherTest : public CppUnit::TestCase
+{
+    CPPUNIT_TEST_SUITE(DitherTest);
+    CPPUNIT_TEST(test_threads);
+    CPPUNIT_TEST(test_parallel);
+    CPPUNIT_TEST(test_lookup);
+    CPPUNIT_TEST(test_formats);
+    CPPUNIT_TEST(test_canvas);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    DitherTest() : CppUnit::TestCase("Dither Test") {}
+
+    void setUp() {}
+
+    void tearDown() {}
+
+    void test_threads()
+    {
+        static char const * const algos[] =
+        {
+            "none", "ordered2", "ordered4", "ordered8", "fstein"
+        };
+        int const nalgos = sizeof(algos) / sizeof(*algos);
+
+        caca_dither_t *d[nalgos];
+        uint32_t *pixels[THREADS];
+        caca_canvas_t *ref[THREADS], *cv[THREADS];
+        struct dither_job jobs[THREADS];
+
+        for(int n = 0; n < nalgos; n++)
+        {
+            d[n] = caca_create_dither(32, PW, PH, 4 * PW, 0x00ff0000,
+                                      0x0000ff00, 0x000000ff, 0x0);
+            caca_set_dither_algorithm(d[n], algos[n]);
+        }
+
+        /* Build one distinct gradient per thread and its reference
+         * rendering, computed sequentially. */
+        for(int t = 0; t < THREADS; t++)
+        {
+            pixels[t] = new uint32_t[PW * PH];
+            for(int j = 0; j < PH; j++)
+                for(int i = 0; i < PW; i++)
+                    pixels[t][j * PW + i] = ((i * 255 / PW) << 16)
+                                          | ((j * 255 / PH) << 8)
+                                          | ((t * 37 + i * j) & 0xff);
+
+            ref[t] = caca_create_canvas(WIDTH, HEIGHT);
+            cv[t] = caca_create_canvas(WIDTH, HEIGHT);
+            caca_dither_bitmap(ref[t], 0, 0, WIDTH, HEIGHT,
+                               d[t % nalgos], pixels[t]);
+
+            jobs[t].cv = cv[t];
+            jobs[t].d = d[t % nalgos];
+            jobs[t].pixels = pixels[t];
+            jobs[t].loops = LOOPS;
+        }
+
+#if defined HAVE_PTHREAD_H
+        pthread_t threads[THREADS];
+
+        for(int t = 0; t < THREADS; t++)
+            pthread_create(&threads[t], NULL, dither_thread, &jobs[t]);
+        for(int t = 0; t < THREADS; t++)
+            pthread_join(threads[t], NULL);
+#else
+        for(int t = 0; t < THREADS; t++)
+            dither_thread(&jobs[t]);
+#endif
+
+        /* Check that every canvas matches its reference byte for byte. */
+        for(int t = 0; t < THREADS; t++)
+        {
+            size_t reflen, len;
+            void *refbuf = caca_export_canvas_to_memory(ref[t], "caca",
+                                                        &reflen);
+            void *buf = caca_export_canvas_to_memory(cv[t], "caca", &len);
+
+            CPPUNIT_ASSERT_EQUAL(reflen, len);
+            CPPUNIT_ASSERT(!memcmp(refbuf, buf, len));
+
+            free(refbuf);
+            free(buf);
+            caca_free_canvas(ref[t]);
+            caca_free_canvas(cv[t]);
+            delete[] pixels[t];
+        }
+
+        for(int n = 0; n < nalgos; n++)
+            caca_free_dither(d[n]);
+    }
+
+    void test_parallel()
+    {
+        static char const * const algos[] =
+        {
+            "none", "ordered4", "random", "fstein"
+        };
+        int const nalgos = sizeof(algos) / sizeof(*algos);
+
+        uint32_t *pixels = new uint32_t[PW * PH];
+
+        /* Make sure caca_rand() has seeded rand() before we do. */
+        caca_rand(0, 1);
+
+        for(int j = 0; j < PH; j++)
+            for(int i = 0; i < PW; i++)
+                pixels[j * PW + i] = ((uint32_t)(i * j / 4) << 24)
+                                   | ((i * 255 / PW) << 16)
+                                   | ((j * 255 / PH) << 8) | (i ^ j);
+
+        /* Check that threaded dithering gives the same output as
+         * single-threaded dithering, including partly visible areas. */
+        for(int n = 0; n < nalgos; n++)
+            for(int threads = 2; threads <= 8; threads *= 2)
+        {
+            caca_dither_t *d = caca_create_dither(32, PW, PH, 4 * PW,
+                                                  0x00ff0000, 0x0000ff00,
+                                                  0x000000ff, 0xff000000);
+            caca_canvas_t *ref = caca_create_canvas(WIDTH, HEIGHT);
+            caca_canvas_t *cv = caca_create_canvas(WIDTH, HEIGHT);
+            size_t reflen, len;
+            void *refbuf, *buf;
+
+            caca_set_dither_algorithm(d, algos[n]);
+
+            /* Random dithering only matches if both calls get the
+             * same seed. */
+            srand(42);
+            caca_dither_bitmap(ref, -3, 2, WIDTH + 5, HEIGHT, d, pixels);
+            CPPUNIT_ASSERT_EQUAL(0, caca_set_dither_threads(d, threads));
+            CPPUNIT_ASSERT_EQUAL(threads, caca_get_dither_threads(d));
+            srand(42);
+            caca_dither_bitmap(cv, -3, 2, WIDTH + 5, HEIGHT, d, pixels);
+
+            refbuf = caca_export_canvas_to_memory(ref, "caca", &reflen);
+            buf = caca_export_canvas_to_memory(cv, "caca", &len);
+            CPPUNIT_ASSERT_EQUAL(reflen, len);
+            CPPUNIT_ASSERT(!memcmp(refbuf, buf, len));
+
+            free(refbuf);
+            free(buf);
+            caca_free_canvas(ref);
+            caca_free_canvas(cv);
+            caca_free_dither(d);
+        }
+
+        delete[] pixels;
+    }
+
+    void test_lookup()
+    {
+        static char const * const colors[] = { "16", "fullgray", "full16" };
+        int const ncolors = sizeof(colors) / sizeof(*colors);
+
+        uint32_t *pixels = new uint32_t[PW * PH];
+        caca_dither_t *d = caca_create_dither(32, PW, PH, 4 * PW, 0x00ff0000,
+                                              0x0000ff00, 0x000000ff, 0x0);
+
+        for(int j = 0; j < PH; j++)
+            for(int i = 0; i < PW; i++)
+                pixels[j * PW + i] = ((i * 255 / PW) << 16)
+                                   | ((j * 255 / PH) << 8) | (i ^ j);
+
+        CPPUNIT_ASSERT_EQUAL(0, caca_get_dither_lookup(d));
+        CPPUNIT_ASSERT_EQUAL(-1, caca_set_dither_lookup(d, 3));
+        CPPUNIT_ASSERT_EQUAL(-1, caca_set_dither_lookup(d, 8));
+        CPPUNIT_ASSERT_EQUAL(0, caca_get_dither_lookup(d));
+
+        caca_set_dither_algorithm(d, "ordered4");
+
+        /* Check that the colour cube gives nearly the same output as the
+         * full search, and that changing the colour mode rebuilds it
+         * even when its size does not change. */
+        for(int n = 0; n < ncolors; n++)
+        {
+            caca_canvas_t *ref = caca_create_canvas(WIDTH, HEIGHT);
+            caca_canvas_t *cv = caca_create_canvas(WIDTH, HEIGHT);
+            int diff = 0;
+
+            caca_set_dither_color(d, colors[n]);
+            caca_set_dither_lookup(d, 0);
+            caca_dither_bitmap(ref, 0, 0, WIDTH, HEIGHT, d, pixels);
+            CPPUNIT_ASSERT_EQUAL(0, caca_set_dither_lookup(d, 6));
+            CPPUNIT_ASSERT_EQUAL(6, caca_get_dither_lookup(d));
+            caca_dither_bitmap(cv, 0, 0, WIDTH, HEIGHT, d, pixels);
+
+            for(int j = 0; j < HEIGHT; j++)
+                for(int i = 0; i < WIDTH; i++)
+                    if(caca_get_char(ref, i, j) != caca_get_char(cv, i, j)
+                        || caca_get_attr(ref, i, j) != caca_get_attr(cv, i, j))
+                        diff++;
+
+            /* Gray levels are cached exactly, colours are quantised. */
+            if(!strcmp(colors[n], "fullgray"))
+                CPPUNIT_ASSERT_EQUAL(0, diff);
+            else
+                CPPUNIT_ASSERT(diff < WIDTH * HEIGHT / 5);
+
+            caca_free_canvas(ref);
+            caca_free_canvas(cv);
+        }
+
+        caca_free_dither(d);
+        delete[] pixels;
+    }
+
+    void test_formats()
+    {
+        static float const gammas[] = { 1.0, 2.2 };
+
+        uint32_t *xrgb = new uint32_t[PW * PH];
+        uint8_t *rgba = new uint8_t[PW * PH * 4];
+        uint8_t *rgb = new uint8_t[PW * PH * 3];
+
+        for(int j = 0; j < PH; j++)
+            for(int i = 0; i < PW; i++)
+        {
+            int n = j * PW + i;
+            uint8_t r = i * 255 / PW, g = j * 255 / PH, b = i ^ j;
+
+            xrgb[n] = (r << 16) | (g << 8) | b;
+            rgba[4 * n] = r; rgba[4 * n + 1] = g;
+            rgba[4 * n + 2] = b; rgba[4 * n + 3] = 0;
+            rgb[3 * n] = r; rgb[3 * n + 1] = g; rgb[3 * n + 2] = b;
+        }
+
+        /* Masks describing the byte layout of the RGBA and RGB buffers */
+        uint32_t const probe = 0x12345678;
+        bool const big = *(uint8_t const *)&probe == 0x12;
+        uint32_t const masks[3][3] =
+        {
+            { 0x00ff0000, 0x0000ff00, 0x000000ff },
+            { big ? 0xff000000u : 0x000000ffu, big ? 0x00ff0000u : 0x0000ff00u,
+              big ? 0x0000ff00u : 0x00ff0000u },
+            { big ? 0x00ff0000u : 0x000000ffu, 0x0000ff00,
+              big ? 0x000000ffu : 0x00ff0000u },
+        };
+        int const bpp[3] = { 32, 32, 24 };
+        void const *pixels[3] = { xrgb, rgba, rgb };
+
+        /* The same image in different pixel formats must give the same
+         * output, whichever fetch kernel each format gets. */
+        for(int g = 0; g < 2; g++)
+            for(int aa = 0; aa < 2; aa++)
+        {
+            void *buf[3];
+            size_t len[3];
+
+            for(int f = 0; f < 3; f++)
+            {
+                caca_dither_t *d = caca_create_dither(bpp[f], PW, PH,
+                                                      bpp[f] / 8 * PW,
+                                                      masks[f][0],
+                                                      masks[f][1],
+                                                      masks[f][2], 0x0);
+                caca_canvas_t *cv = caca_create_canvas(WIDTH, HEIGHT);
+
+                caca_set_dither_gamma(d, gammas[g]);
+                caca_set_dither_antialias(d, aa ? "prefilter" : "none");
+                caca_set_dither_algorithm(d, "ordered4");
+                caca_dither_bitmap(cv, 0, 0, WIDTH, HEIGHT, d, pixels[f]);
+                buf[f] = caca_export_canvas_to_memory(cv, "caca", &len[f]);
+
+                caca_free_canvas(cv);
+                caca_free_dither(d);
+            }
+
+            for(int f = 1; f < 3; f++)
+            {
+                CPPUNIT_ASSERT_EQUAL(len[0], len[f]);
+                CPPUNIT_ASSERT(!memcmp(buf[0], buf[f], len[0]));
+            }
+
+            for(int f = 0; f < 3; f++)
+                free(buf[f]);
+        }
+
+        delete[] xrgb;
+        delete[] rgba;
+        delete[] rgb;
+    }
+
+    void test_canvas()
+    {
+        uint32_t *pixels = new uint32_t[PW * PH];
+        caca_canvas_t *cv = caca_create_canvas(WIDTH, HEIGHT);
+        caca_dither_t *d = caca_create_dither(32, PW, PH, 4 * PW, 0x00ff0000,
+                                              0x0000ff00, 0x000000ff, 0x0);
+        uint32_t attr;
+        int dx, dy, dw, dh;
+
+        for(int j = 0; j < PH; j++)
+            for(int i = 0; i < PW; i++)
+                pixels[j * PW + i] = ((i * 255 / PW) << 16)
+                                   | ((j * 255 / PH) << 8) | (i ^ j);
+
+        caca_set_dither_algorithm(d, "ordered4");
+
+        /* Fullwidth characters straddling both edges of the area */
+        caca_put_char(cv, 9, 2, 0x4e00);
+        caca_put_char(cv, 29, 2, 0x4e00);
+        caca_set_attr(cv, CACA_BOLD);
+        attr = caca_get_attr(cv, -1, -1);
+        caca_clear_dirty_rect_list(cv);
+
+        caca_dither_bitmap(cv, 10, 2, 20, 5, d, pixels);
+
+        CPPUNIT_ASSERT_EQUAL(attr, caca_get_attr(cv, -1, -1));
+        CPPUNIT_ASSERT(caca_get_attr(cv, 10, 2) & CACA_BOLD);
+        CPPUNIT_ASSERT_EQUAL((uint32_t)' ', caca_get_char(cv, 9, 2));
+        CPPUNIT_ASSERT_EQUAL((uint32_t)' ', caca_get_char(cv, 30, 2));
+
+        /* One dirty rectangle covers the area and the fixed halves */
+        CPPUNIT_ASSERT_EQUAL(1, caca_get_dirty_rect_count(cv));
+        caca_get_dirty_rect(cv, 0, &dx, &dy, &dw, &dh);
+        CPPUNIT_ASSERT_EQUAL(9, dx);
+        CPPUNIT_ASSERT_EQUAL(2, dy);
+        CPPUNIT_ASSERT_EQUAL(22, dw);
+        CPPUNIT_ASSERT_EQUAL(5, dh);
+
+        /* Dithering the same image again changes nothing */
+        caca_clear_dirty_rect_list(cv);
+        caca_dither_bitmap(cv, 10, 2, 20, 5, d, pixels);
+        CPPUNIT_ASSERT_EQUAL(0, caca_get_dirty_rect_count(cv));
+
+        caca_free_dither(d);
+        caca_free_canvas(cv);
+        delete[] pixels;
+    }
+
+private:
+    static int const WIDTH = 80, HEIGHT = 32;
+    static int const PW = 320, PH = 256;
+    static int const THREADS = 16, LOOPS = 20;
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(DitherTest);
@@ -16,6 +16,17 @@
 #include <cppunit/TestCaller.h>
 #include <cppunit/TestCase.h>
 #include <cppunit/TestSuite.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sys/time.h>
+
+#if defined USE_VT && defined HAVE_POSIX_OPENPT
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <sys/ioctl.h>
+#endif
 
 #include "caca.h"
 
@@ -23,6 +34,13 @@ class DriverTest : public CppUnit::TestCase
 {
     CPPUNIT_TEST_SUITE(DriverTest);
     CPPUNIT_TEST(test_list);
+    CPPUNIT_TEST(test_event_fd);
+#if defined USE_X11
+    CPPUNIT_TEST(test_x11);
+#endif
+#if defined USE_VT && defined HAVE_POSIX_OPENPT
+    CPPUNIT_TEST(test_vt);
+#endif
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -40,6 +58,296 @@ public:
         CPPUNIT_ASSERT(list != NULL);
         CPPUNIT_ASSERT(list[0] != NULL);
     }
+
+    void test_event_fd()
+    {
+        caca_canvas_t *cv = caca_create_canvas(WIDTH, HEIGHT);
+        caca_display_t *dp = caca_create_display_with_driver(cv, "null");
+        caca_event_t ev;
+        int64_t start;
+
+        /* Nothing to wait on, but the timeout is still honoured */
+        errno = 0;
+        CPPUNIT_ASSERT_EQUAL(-1, caca_get_event_fd(dp));
+        CPPUNIT_ASSERT_EQUAL(ENOSYS, errno);
+        start = now();
+        CPPUNIT_ASSERT_EQUAL(0,
+            caca_get_event(dp, CACA_EVENT_ANY, &ev, 20000));
+        CPPUNIT_ASSERT(now() - start >= 20000);
+
+        caca_free_display(dp);
+        caca_free_canvas(cv);
+    }
+
+#if defined USE_X11
+    void test_x11()
+    {
+        /* The core font path, and the image path with MIT-SHM if the
+         * server supports it */
+        static char const * const fonts[] = { "fixed", "Monospace 9" };
+
+        /* Needs an X server, such as Xvfb */
+        if(!getenv("DISPLAY") || !*getenv("DISPLAY"))
+            return;
+
+        for(int i = 0; i < 2; i++)
+        {
+            caca_canvas_t *cv = caca_create_canvas(WIDTH, HEIGHT);
+            caca_display_t *dp;
+
+            setenv("CACA_FONT", fonts[i], 1);
+            dp = caca_create_display_with_driver(cv, "x11");
+            unsetenv("CACA_FONT");
+            CPPUNIT_ASSERT(dp != NULL);
+            CPPUNIT_ASSERT(caca_get_display_width(dp) > 0);
+
+            caca_put_str(cv, 0, 0, "Hello, world!");
+            caca_refresh_display(dp);
+
+            /* Only a partial area is dirty in the following frames, then
+             * nothing at all */
+            caca_set_color_ansi(cv, CACA_YELLOW, CACA_BLUE);
+            caca_fill_box(cv, 10, 5, 20, 4, '#');
+            caca_put_char(cv, WIDTH - 2, HEIGHT - 1, 0x2f06 /* ⼆ */);
+            caca_refresh_display(dp);
+            caca_put_char(cv, WIDTH - 1, HEIGHT - 1, 'x');
+            caca_refresh_display(dp);
+            caca_refresh_display(dp);
+
+            caca_free_display(dp);
+            caca_free_canvas(cv);
+        }
+    }
+#endif
+
+#if defined USE_VT && defined HAVE_POSIX_OPENPT
+    void test_vt()
+    {
+        struct winsize ws;
+        int master, slave, in, out;
+
+        master = posix_openpt(O_RDWR | O_NOCTTY);
+        CPPUNIT_ASSERT(master >= 0);
+        CPPUNIT_ASSERT(!grantpt(master) && !unlockpt(master));
+        slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+        CPPUNIT_ASSERT(slave >= 0);
+        fcntl(master, F_SETFL, fcntl(master, F_GETFL, 0) | O_NONBLOCK);
+
+        memset(&ws, 0, sizeof(ws));
+        ws.ws_col = WIDTH;
+        ws.ws_row = HEIGHT;
+        ioctl(master, TIOCSWINSZ, &ws);
+
+        fflush(stdout);
+        in = dup(STDIN_FILENO);
+        out = dup(STDOUT_FILENO);
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+
+        /* Do not leave the test runner writing to the terminal */
+        try
+        {
+            vt_session(master);
+        }
+        catch(...)
+        {
+            restore(in, out);
+            throw;
+        }
+        restore(in, out);
+
+        close(slave);
+        close(master);
+    }
+#endif
+
+private:
+    static int const WIDTH = 60, HEIGHT = 20;
+
+#if defined USE_VT && defined HAVE_POSIX_OPENPT
+    static int const BUFSIZE = 65536;
+
+    void vt_session(int master)
+    {
+        caca_canvas_t *cv, *term;
+        caca_display_t *dp;
+        caca_event_t ev;
+        char buf[BUFSIZE];
+        size_t len = 0, frame;
+
+        cv = caca_create_canvas(0, 0);
+        dp = caca_create_display_with_driver(cv, "vt");
+        CPPUNIT_ASSERT(dp != NULL);
+        CPPUNIT_ASSERT(!strcmp(caca_get_display_driver(dp), "vt"));
+        CPPUNIT_ASSERT_EQUAL((int)WIDTH, caca_get_canvas_width(cv));
+        CPPUNIT_ASSERT_EQUAL((int)HEIGHT, caca_get_canvas_height(cv));
+
+        /* Colour runs, a lone cell, a wide character and gaps between
+         * them, so that every kind of cursor motion gets used */
+        caca_set_color_ansi(cv, CACA_LIGHTGRAY, CACA_BLUE);
+        caca_clear_canvas(cv);
+        for(int y = 0; y < HEIGHT; y += 3)
+        {
+            caca_set_color_ansi(cv, y % 16, (y / 3) % 8);
+            caca_printf(cv, y, y, "line %i", y);
+        }
+        caca_set_color_ansi(cv, CACA_YELLOW, CACA_RED);
+        caca_put_str(cv, 40, 2, "\xef\xbc\xa1\xef\xbc\xa2 wide");
+        caca_put_char(cv, WIDTH - 1, HEIGHT - 1, '#');
+
+        /* A right half without its left half, as found in imported
+         * streams, is painted as a space */
+        caca_canvas_t *stray = caca_create_canvas(0, 0);
+        size_t bytes;
+        caca_put_str(cv, 20, 8, "a@cdef");
+        uint8_t *data = (uint8_t *)caca_export_area_to_memory(cv, 20, 8, 6,
+                                                              1, "caca",
+                                                              &bytes);
+        for(size_t i = 0; i + 3 < bytes; i++)
+            if(!memcmp(data + i, "\0\0\0@", 4))
+            {
+                memcpy(data + i, "\0\x0f\xff\xfe", 4);
+                break;
+            }
+        caca_import_canvas_from_memory(stray, data, bytes, "caca");
+        CPPUNIT_ASSERT_EQUAL((uint32_t)CACA_MAGIC_FULLWIDTH,
+                             caca_get_char(stray, 1, 0));
+        caca_blit(cv, 20, 8, stray, NULL);
+        caca_free_canvas(stray);
+        free(data);
+
+        caca_refresh_display(dp);
+        len += drain(master, buf + len);
+        frame = len;
+
+        /* Only the changed cells are sent again */
+        caca_set_color_ansi(cv, CACA_WHITE, CACA_GREEN);
+        caca_put_str(cv, 10, 5, "ab");
+        caca_put_char(cv, 41, 2, 'x');
+        caca_refresh_display(dp);
+        len += drain(master, buf + len);
+        CPPUNIT_ASSERT(len - frame < 48);
+
+        caca_refresh_display(dp);
+        CPPUNIT_ASSERT_EQUAL((size_t)0, drain(master, buf + len));
+
+        /* With the cursor shown, the next frame moves from where the
+         * cursor was left */
+        caca_set_cursor(dp, 1);
+        caca_gotoxy(cv, 3, 12);
+        caca_refresh_display(dp);
+        caca_put_char(cv, 11, 5, 'Z');
+        caca_refresh_display(dp);
+        caca_refresh_display(dp);
+        caca_set_cursor(dp, 0);
+        len += drain(master, buf + len);
+
+        /* The importer moves to the first column on line feeds, which
+         * terminals only do in output processing mode */
+        char *vt = new char[len * 3];
+        size_t vtlen = 0;
+        for(size_t i = 0; i < len; i++)
+            if(buf[i] == '\n')
+            {
+                memcpy(vt + vtlen, "\033[B", 3);
+                vtlen += 3;
+            }
+            else
+                vt[vtlen++] = buf[i];
+
+        term = caca_create_canvas(WIDTH, HEIGHT);
+        caca_import_canvas_from_memory(term, vt, vtlen, "utf8");
+        check_same(cv, term);
+        caca_free_canvas(term);
+        delete[] vt;
+
+        /* Keys, escape sequences and mouse reports */
+        char const *input = "\033[Ax\033[<0;5;3M\033[3~";
+        CPPUNIT_ASSERT(write(master, input, strlen(input))
+                        == (ssize_t)strlen(input));
+        CPPUNIT_ASSERT(caca_get_event(dp, CACA_EVENT_ANY, &ev, 100000));
+        CPPUNIT_ASSERT_EQUAL((int)CACA_KEY_UP, caca_get_event_key_ch(&ev));
+        CPPUNIT_ASSERT(caca_get_event(dp, CACA_EVENT_ANY, &ev, 100000));
+        CPPUNIT_ASSERT_EQUAL((int)'x', caca_get_event_key_ch(&ev));
+        CPPUNIT_ASSERT(caca_get_event(dp, CACA_EVENT_ANY, &ev, 100000));
+        CPPUNIT_ASSERT_EQUAL(CACA_EVENT_MOUSE_MOTION,
+                             caca_get_event_type(&ev));
+        CPPUNIT_ASSERT_EQUAL(4, caca_get_event_mouse_x(&ev));
+        CPPUNIT_ASSERT_EQUAL(2, caca_get_event_mouse_y(&ev));
+        CPPUNIT_ASSERT(caca_get_event(dp, CACA_EVENT_ANY, &ev, 100000));
+        CPPUNIT_ASSERT_EQUAL(CACA_EVENT_MOUSE_PRESS, caca_get_event_type(&ev));
+        CPPUNIT_ASSERT_EQUAL(1, caca_get_event_mouse_button(&ev));
+        CPPUNIT_ASSERT(caca_get_event(dp, CACA_EVENT_ANY, &ev, 100000));
+        CPPUNIT_ASSERT_EQUAL((int)CACA_KEY_DELETE, caca_get_event_key_ch(&ev));
+
+        /* Waits sleep on the terminal for exactly as long as asked */
+        CPPUNIT_ASSERT_EQUAL((int)STDIN_FILENO, caca_get_event_fd(dp));
+        int64_t start = now();
+        CPPUNIT_ASSERT_EQUAL(0,
+            caca_get_event(dp, CACA_EVENT_ANY, &ev, 50000));
+        CPPUNIT_ASSERT(now() - start >= 50000);
+
+        /* A lone escape key is not kept waiting for the rest of a
+         * sequence */
+        CPPUNIT_ASSERT(write(master, "\033", 1) == 1);
+        CPPUNIT_ASSERT(caca_get_event(dp, CACA_EVENT_ANY, &ev, -1));
+        CPPUNIT_ASSERT_EQUAL((int)CACA_KEY_ESCAPE,
+                             caca_get_event_key_ch(&ev));
+
+        caca_free_display(dp);
+        caca_free_canvas(cv);
+    }
+
+#endif
+
+    static int64_t now()
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+
+#if defined USE_VT && defined HAVE_POSIX_OPENPT
+    static void restore(int in, int out)
+    {
+        fflush(stdout);
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        close(in);
+        close(out);
+    }
+
+    static size_t drain(int fd, char *buf)
+    {
+        ssize_t ret;
+        size_t len = 0;
+
+        while((ret = read(fd, buf + len, 4096)) > 0)
+            len += ret;
+
+        return len;
+    }
+
+    static void check_same(caca_canvas_t *a, caca_canvas_t *b)
+    {
+        for(int y = 0; y < HEIGHT; y++)
+            for(int x = 0; x < WIDTH; x++)
+            {
+                uint32_t ch = caca_get_char(a, x, y);
+                uint32_t left = x ? caca_get_char(a, x - 1, y) : ' ';
+
+                /* Stray right halves of fullwidth characters */
+                if(ch == CACA_MAGIC_FULLWIDTH
+                    && !caca_utf32_is_fullwidth(left))
+                    ch = ' ';
+
+                CPPUNIT_ASSERT_EQUAL(ch, caca_get_char(b, x, y));
+                CPPUNIT_ASSERT_EQUAL(
+                    caca_attr_to_ansi(caca_get_attr(a, x, y)),
+                    caca_attr_to_ansi(caca_get_attr(b, x, y)));
+            }
+    }
+#endif
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(DriverTest);
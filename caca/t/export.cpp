@@ -16,6 +16,12 @@
 #include <cppunit/TestCaller.h>
 #include <cppunit/TestCase.h>
 #include <cppunit/TestSuite.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#if defined HAVE_ZLIB_H
+#   include <zlib.h>
+#endif
 
 #include "caca.h"
 
@@ -23,6 +29,14 @@ class ExportTest : public CppUnit::TestCase
 {
     CPPUNIT_TEST_SUITE(ExportTest);
     CPPUNIT_TEST(test_export_area_caca);
+    CPPUNIT_TEST(test_export_buffer);
+    CPPUNIT_TEST(test_export_delta);
+    CPPUNIT_TEST(test_decode_stream);
+    CPPUNIT_TEST(test_export_css);
+    CPPUNIT_TEST(test_export_css_wide);
+#if defined HAVE_ZLIB_H
+    CPPUNIT_TEST(test_export_png);
+#endif
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -64,7 +78,390 @@ public:
         caca_free_canvas(cv);
     }
 
+    void test_export_buffer()
+    {
+        static char const * const formats[] =
+        {
+            "ansi", "utf8", "utf8cr", "caca"
+        };
+
+        caca_canvas_t *cv;
+        char *buf;
+
+        cv = caca_create_canvas(WIDTH, HEIGHT);
+        for(int y = 0; y < HEIGHT; y++)
+            for(int x = 0; x < WIDTH; x++)
+        {
+            caca_set_color_ansi(cv, (x + y) % 18, (x * y) % 18);
+            caca_put_char(cv, x, y, x % 7 ? 'a' + y % 26 : 0x2f06 /* ⼆ */);
+        }
+
+        /* Check that exporting to a buffer gives the same data as
+         * exporting to memory, and that it behaves like snprintf() when
+         * the buffer is too small. */
+        for(int f = 0; f < 4; f++)
+        {
+            size_t bytes;
+            void *data = caca_export_canvas_to_memory(cv, formats[f], &bytes);
+
+            CPPUNIT_ASSERT(data != NULL);
+            CPPUNIT_ASSERT_EQUAL((ssize_t)bytes,
+                caca_export_canvas_to_buffer(cv, formats[f], NULL, 0));
+
+            buf = (char *)malloc(bytes + 1);
+            buf[bytes] = 'X';
+            CPPUNIT_ASSERT_EQUAL((ssize_t)bytes,
+                caca_export_canvas_to_buffer(cv, formats[f], buf, bytes));
+            CPPUNIT_ASSERT(!memcmp(data, buf, bytes));
+            CPPUNIT_ASSERT_EQUAL('X', buf[bytes]);
+
+            memset(buf, 'X', bytes);
+            CPPUNIT_ASSERT_EQUAL((ssize_t)bytes,
+                caca_export_canvas_to_buffer(cv, formats[f], buf, bytes / 3));
+            CPPUNIT_ASSERT(!memcmp(data, buf, bytes / 3));
+            CPPUNIT_ASSERT_EQUAL('X', buf[bytes / 3]);
+
+            free(buf);
+            free(data);
+        }
+
+        CPPUNIT_ASSERT_EQUAL((ssize_t)-1,
+            caca_export_canvas_to_buffer(cv, "foo", NULL, 0));
+
+        caca_free_canvas(cv);
+    }
+
+    void test_export_delta()
+    {
+        caca_canvas_t *old, *cv, *term;
+
+        old = caca_create_canvas(WIDTH, HEIGHT);
+        for(int y = 0; y < HEIGHT; y++)
+            for(int x = 0; x < WIDTH; x++)
+        {
+            caca_set_color_ansi(old, (x + y) % 17, (x * y) % 17);
+            caca_put_char(old, x, y, x % 7 ? 'a' + y % 26 : 0x2f06 /* ⼆ */);
+        }
+
+        cv = caca_create_canvas(WIDTH, HEIGHT);
+        caca_blit(cv, 0, 0, old, NULL);
+
+        /* Nothing to send for identical canvases */
+        CPPUNIT_ASSERT_EQUAL((ssize_t)0,
+            caca_export_canvas_delta_to_buffer(old, cv, NULL, 0));
+
+        /* Scattered changes, some of them over fullwidth characters */
+        caca_set_color_ansi(cv, CACA_YELLOW, CACA_BLUE);
+        caca_put_str(cv, 3, 2, "hello");
+        caca_put_char(cv, 8, 4, 'x');
+        caca_put_char(cv, 20, 4, 0x2f06);
+        caca_put_char(cv, 15, 9, 0x2f06);
+        caca_set_color_ansi(cv, CACA_DEFAULT, CACA_TRANSPARENT);
+        caca_put_char(cv, 0, 10, 'y');
+        caca_put_char(cv, WIDTH - 1, HEIGHT - 1, 'z');
+
+        /* Applying the delta to the old screen gives the new one */
+        term = caca_create_canvas(WIDTH, HEIGHT);
+        caca_blit(term, 0, 0, old, NULL);
+        check_delta(old, cv, term);
+        CPPUNIT_ASSERT(caca_export_canvas_delta_to_buffer(old, cv, NULL, 0)
+                        < 200);
+
+        /* A missing or differently sized canvas triggers a full repaint */
+        caca_clear_canvas(term);
+        check_delta(NULL, cv, term);
+        caca_set_canvas_size(old, WIDTH, HEIGHT - 1);
+        caca_clear_canvas(term);
+        check_delta(old, cv, term);
+
+        caca_free_canvas(term);
+        caca_free_canvas(cv);
+        caca_free_canvas(old);
+    }
+
+    void test_decode_stream()
+    {
+        static size_t const chunks[] = { 1, 3, 7, 8, 13, 100, 4096 };
+
+        caca_canvas_t *cv, *dst;
+        caca_decoder_t *d;
+        void *frames[2];
+        size_t sizes[2];
+
+        cv = caca_create_canvas(WIDTH, HEIGHT);
+        caca_create_frame(cv, 1);
+        for(int y = 0; y < HEIGHT; y++)
+            for(int x = 0; x < WIDTH; x++)
+        {
+            caca_set_color_ansi(cv, (x + y) % 17, (x * y) % 17);
+            caca_put_char(cv, x, y, x % 7 ? 'a' + y % 26 : 0x2f06 /* ⼆ */);
+        }
+        frames[0] = caca_export_canvas_to_memory(cv, "caca", &sizes[0]);
+        caca_set_color_ansi(cv, CACA_YELLOW, CACA_BLUE);
+        caca_put_str(cv, 3, 2, "hello");
+        frames[1] = caca_export_canvas_to_memory(cv, "caca", &sizes[1]);
+
+        CPPUNIT_ASSERT(caca_create_decoder("utf8") == NULL);
+
+        /* Two frames after some garbage, cut in pieces of various sizes,
+         * decode to the same canvas as the original */
+        for(int c = 0; c < 7; c++)
+        {
+            size_t len = 5 + sizes[0] + sizes[1], done = 0;
+            char *stream = (char *)malloc(len);
+            int count = 0;
+
+            memcpy(stream, "\xca\xca\xcaxy", 5);
+            memcpy(stream + 5, frames[0], sizes[0]);
+            memcpy(stream + 5 + sizes[0], frames[1], sizes[1]);
+
+            dst = caca_create_canvas(0, 0);
+            d = caca_create_decoder("caca");
+            CPPUNIT_ASSERT_EQUAL((size_t)20, caca_get_decoder_needed(d));
+
+            while(done < len)
+            {
+                size_t n = len - done < chunks[c] ? len - done : chunks[c];
+                ssize_t ret = caca_decode_canvas(d, dst, stream + done, n);
+
+                CPPUNIT_ASSERT(ret > 0);
+                done += ret;
+                if(caca_get_decoder_needed(d))
+                    continue;
+
+                size_t bytes;
+                void *data = caca_export_canvas_to_memory(dst, "caca", &bytes);
+                CPPUNIT_ASSERT_EQUAL(sizes[count], bytes);
+                CPPUNIT_ASSERT(!memcmp(frames[count], data, bytes));
+                free(data);
+                count++;
+            }
+
+            CPPUNIT_ASSERT_EQUAL(2, count);
+            caca_free_decoder(d);
+            caca_free_canvas(dst);
+            free(stream);
+        }
+
+        free(frames[0]);
+        free(frames[1]);
+        caca_free_canvas(cv);
+    }
+
+    void test_export_css()
+    {
+        caca_canvas_t *cv;
+        size_t bytes;
+        char *buf;
+
+        /* Three runs on the first line, using two styles, and the
+         * default style everywhere else */
+        cv = caca_create_canvas(WIDTH, HEIGHT);
+        caca_set_color_ansi(cv, CACA_RED, CACA_BLUE);
+        caca_put_str(cv, 0, 0, "a<b");
+        caca_set_color_ansi(cv, CACA_WHITE, CACA_BLACK);
+        caca_put_str(cv, 3, 0, "cd");
+        caca_set_color_ansi(cv, CACA_RED, CACA_BLUE);
+        caca_put_str(cv, 5, 0, "ef ");
+
+        buf = (char *)caca_export_canvas_to_memory(cv, "htmlcss", &bytes);
+        CPPUNIT_ASSERT(buf != NULL);
+        buf = (char *)realloc(buf, bytes + 1);
+        buf[bytes] = '\0';
+        CPPUNIT_ASSERT(strstr(buf, ".c0{color:#a00;background-color:#00a;}"));
+        CPPUNIT_ASSERT(strstr(buf, ".c1{color:#fff;background-color:#000;}"));
+        CPPUNIT_ASSERT(!strstr(buf, ".c2"));
+        CPPUNIT_ASSERT(strstr(buf, "<pre>\n<span class=\"c0\">a&lt;b</span>"
+                                   "<span class=\"c1\">cd</span>"
+                                   "<span class=\"c0\">ef </span>"));
+        free(buf);
+
+        buf = (char *)caca_export_canvas_to_memory(cv, "svgcss", &bytes);
+        CPPUNIT_ASSERT(buf != NULL);
+        buf = (char *)realloc(buf, bytes + 1);
+        buf[bytes] = '\0';
+        CPPUNIT_ASSERT(strstr(buf, "<rect class=\"b0\" x=\"0\" y=\"0\" "
+                                   "width=\"18\" height=\"10\"/>"));
+        CPPUNIT_ASSERT(strstr(buf, "<text class=\"f0\" x=\"0 6 12\" "
+                                   "y=\"8\">a&lt;b</text>"));
+        CPPUNIT_ASSERT(strstr(buf, "<text class=\"f0\" x=\"30 36\" "
+                                   "y=\"8\">ef</text>"));
+        CPPUNIT_ASSERT(!strstr(buf, ".f2"));
+        free(buf);
+
+        caca_free_canvas(cv);
+    }
+
+    void test_export_css_wide()
+    {
+        caca_canvas_t *cv;
+        size_t bytes;
+        char *buf;
+
+        /* Coordinates past 100000 and escaped characters in a single run */
+        cv = caca_create_canvas(200000, 1);
+        caca_fill_box(cv, 0, 0, 200000, 1, '&');
+
+        buf = (char *)caca_export_canvas_to_memory(cv, "svgcss", &bytes);
+        CPPUNIT_ASSERT(buf != NULL);
+        buf = (char *)realloc(buf, bytes + 1);
+        buf[bytes] = '\0';
+        CPPUNIT_ASSERT(strstr(buf, " 1199988 1199994\" y=\"8\">&amp;"));
+        CPPUNIT_ASSERT(strstr(buf, "&amp;&amp;</text>\n </g>\n</svg>\n"));
+        free(buf);
+
+        buf = (char *)caca_export_canvas_to_memory(cv, "htmlcss", &bytes);
+        CPPUNIT_ASSERT(buf != NULL);
+        buf = (char *)realloc(buf, bytes + 1);
+        buf[bytes] = '\0';
+        CPPUNIT_ASSERT(strstr(buf, "&amp;&amp;\n</pre></body></html>\n"));
+        free(buf);
+
+        /* Then in runs of one cell */
+        for(int x = 0; x < 200000; x += 2)
+        {
+            caca_set_color_ansi(cv, CACA_RED, CACA_BLUE);
+            caca_put_char(cv, x, 0, '&');
+        }
+
+        buf = (char *)caca_export_canvas_to_memory(cv, "svgcss", &bytes);
+        CPPUNIT_ASSERT(buf != NULL);
+        buf = (char *)realloc(buf, bytes + 1);
+        buf[bytes] = '\0';
+        CPPUNIT_ASSERT(strstr(buf, "<rect class=\"b0\" x=\"1199988\" y=\"0\" "
+                                   "width=\"6\" height=\"10\"/>"));
+        CPPUNIT_ASSERT(strstr(buf, "<text class=\"f1\" x=\"1199994\" "
+                                   "y=\"8\">&amp;</text>\n </g>\n</svg>\n"));
+        free(buf);
+
+        buf = (char *)caca_export_canvas_to_memory(cv, "htmlcss", &bytes);
+        CPPUNIT_ASSERT(buf != NULL);
+        buf = (char *)realloc(buf, bytes + 1);
+        buf[bytes] = '\0';
+        CPPUNIT_ASSERT(strstr(buf, "<span class=\"c0\">&amp;</span>&amp;\n"
+                                   "</pre></body></html>\n"));
+        free(buf);
+
+        caca_free_canvas(cv);
+    }
+
+#if defined HAVE_ZLIB_H
+    void test_export_png()
+    {
+        caca_canvas_t *cv;
+        caca_font_t *f;
+        uint8_t *png, *ref, *img;
+        size_t bytes, pos = 8;
+        z_stream z;
+
+        cv = caca_create_canvas(WIDTH, HEIGHT);
+        for(int y = 0; y < HEIGHT; y++)
+            for(int x = 0; x < WIDTH; x++)
+        {
+            caca_set_color_ansi(cv, (x + y) % 16, (x * y) % 16);
+            caca_put_char(cv, x, y, x % 7 ? 'a' + y % 26 : 0x2591);
+        }
+
+        /* The image is what the first font renders */
+        f = caca_load_font(caca_get_font_list()[0], 0);
+        int w = WIDTH * caca_get_font_width(f);
+        int h = HEIGHT * caca_get_font_height(f);
+        ref = (uint8_t *)calloc(4 * w, h);
+        caca_render_canvas_area(cv, f, ref, 0, 0, w, h, 4 * w, "rgba");
+        caca_free_font(f);
+
+        png = (uint8_t *)caca_export_canvas_to_memory(cv, "png", &bytes);
+        CPPUNIT_ASSERT(png != NULL);
+        CPPUNIT_ASSERT(!memcmp(png, "\x89PNG\r\n\x1a\n", 8));
+
+        /* Walk the chunks, checking their CRC and inflating the data */
+        img = (uint8_t *)malloc((4 * w + 1) * h);
+        memset(&z, 0, sizeof(z));
+        inflateInit(&z);
+        z.next_out = img;
+        z.avail_out = (4 * w + 1) * h;
+
+        while(pos + 12 <= bytes)
+        {
+            uint32_t len = (png[pos] << 24) | (png[pos + 1] << 16)
+                             | (png[pos + 2] << 8) | png[pos + 3];
+            uint8_t const *data = png + pos + 8;
+            uint8_t const *end = data + len;
+            bool last = !memcmp(png + pos + 4, "IEND", 4);
+
+            CPPUNIT_ASSERT(pos + 12 + len <= bytes);
+            CPPUNIT_ASSERT_EQUAL(
+                (uint32_t)((end[0] << 24) | (end[1] << 16)
+                            | (end[2] << 8) | end[3]),
+                (uint32_t)crc32(0, png + pos + 4, len + 4));
+
+            if(!memcmp(png + pos + 4, "IHDR", 4))
+            {
+                CPPUNIT_ASSERT_EQUAL(13u, len);
+                CPPUNIT_ASSERT_EQUAL(w, (data[2] << 8) | data[3]);
+                CPPUNIT_ASSERT_EQUAL(h, (data[6] << 8) | data[7]);
+            }
+            else if(!memcmp(png + pos + 4, "IDAT", 4))
+            {
+                z.next_in = (Bytef *)data;
+                z.avail_in = len;
+                inflate(&z, Z_NO_FLUSH);
+            }
+
+            pos += 12 + len;
+            if(last)
+                break;
+        }
+        CPPUNIT_ASSERT_EQUAL(bytes, pos);
+        CPPUNIT_ASSERT_EQUAL(0u, (unsigned int)z.avail_out);
+        inflateEnd(&z);
+
+        /* Each row starts with its filter type */
+        for(int y = 0; y < h; y++)
+        {
+            uint8_t const *row = img + y * (4 * w + 1);
+
+            CPPUNIT_ASSERT_EQUAL(0, (int)row[0]);
+            CPPUNIT_ASSERT(!memcmp(ref + y * 4 * w, row + 1, 4 * w));
+        }
+
+        free(png);
+        free(ref);
+        free(img);
+
+        /* An empty image is not a valid PNG */
+        caca_set_canvas_size(cv, 0, 0);
+        errno = 0;
+        CPPUNIT_ASSERT(!caca_export_canvas_to_memory(cv, "png", &bytes));
+        CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+
+        caca_free_canvas(cv);
+    }
+#endif
+
 private:
+    static void check_delta(caca_canvas_t *old, caca_canvas_t *cv,
+                            caca_canvas_t *term)
+    {
+        size_t bytes, len;
+        char *buf;
+        void *a, *b;
+
+        bytes = caca_export_canvas_delta_to_buffer(old, cv, NULL, 0);
+        buf = (char *)malloc(bytes);
+        CPPUNIT_ASSERT_EQUAL((ssize_t)bytes,
+            caca_export_canvas_delta_to_buffer(old, cv, buf, bytes));
+        caca_import_canvas_from_memory(term, buf, bytes, "utf8");
+        free(buf);
+
+        a = caca_export_canvas_to_memory(cv, "utf8", &bytes);
+        b = caca_export_canvas_to_memory(term, "utf8", &len);
+        CPPUNIT_ASSERT_EQUAL(bytes, len);
+        CPPUNIT_ASSERT(!memcmp(a, b, bytes));
+        free(a);
+        free(b);
+    }
+
     static int const WIDTH = 80, HEIGHT = 50;
 };
 
@@ -0,0 +1,225 @@
+/*
+ *  caca-test     testsuite program for libcaca
+ *  Copyright © 2026 agent <agent@local>
+ *              All Rights Reserved
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+#include "config.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/TestCaller.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestSuite.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include "caca.h"
+
+struct stream_job
+{
+    uint8_t *image;
+    int next, calls;
+};
+
+static int stream_band(void *data, void const *pixels, int y, int height,
+                       int pitch)
+{
+    struct stream_job *job = (struct stream_job *)data;
+
+    /* Bands must come in order and without gaps */
+    if(y != job->next)
+        return -1;
+
+    memcpy(job->image + y * pitch, pixels, height * pitch);
+    job->next = y + height;
+    job->calls++;
+
+    return 0;
+}
+
+static int stream_abort(void *data, void const *, int, int, int)
+{
+    if(++((struct stream_job *)data)->calls < 2)
+        return 0;
+
+    errno = EPIPE;
+    return -1;
+}
+
+class FontTest : public CppUnit::TestCase
+{
+    CPPUNIT_TEST_SUITE(FontTest);
+    CPPUNIT_TEST(test_area);
+    CPPUNIT_TEST(test_formats);
+    CPPUNIT_TEST(test_stream);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    FontTest() : CppUnit::TestCase("Font Test") {}
+
+    void setUp()
+    {
+        char const * const *fonts = caca_get_font_list();
+
+        for(int n = 0; n < 2; n++)
+            f[n] = caca_load_font(fonts[n], 0);
+
+        cv = caca_create_canvas(WIDTH, HEIGHT);
+        for(int j = 0; j < HEIGHT; j++)
+            for(int i = 0; i < WIDTH; i++)
+            {
+                caca_set_color_ansi(cv, (i + j) % 16, (i * j) % 16);
+                caca_put_char(cv, i, j, 0x20 + (i * 7 + j * 3) % 0x5f);
+            }
+        caca_set_color_argb(cv, 0xf0f0, 0x8123);
+        caca_put_str(cv, 3, 2, "\xe2\x96\x92\xe2\x96\x88 libcaca");
+        caca_put_str(cv, 20, 5, "\xef\xbc\xa1\xef\xbc\xa2 fullwidth");
+    }
+
+    void tearDown()
+    {
+        caca_free_canvas(cv);
+        for(int n = 0; n < 2; n++)
+            caca_free_font(f[n]);
+    }
+
+    void test_area()
+    {
+        for(int n = 0; n < 2; n++)
+        {
+            int w = WIDTH * caca_get_font_width(f[n]);
+            int h = HEIGHT * caca_get_font_height(f[n]);
+            uint8_t *ref = new uint8_t[w * h * 4];
+            uint8_t *tiles = new uint8_t[w * h * 4];
+
+            memset(ref, 0, w * h * 4);
+            caca_render_canvas(cv, f[n], ref, w, h, w * 4);
+
+            /* Tiles that do not match cell boundaries, so that glyphs get
+             * cropped on every side */
+            memset(tiles, 0, w * h * 4);
+            for(int y = 0; y < h; y += 13)
+                for(int x = 0; x < w; x += 37)
+                {
+                    int tw = w - x < 37 ? w - x : 37;
+                    int th = h - y < 13 ? h - y : 13;
+                    CPPUNIT_ASSERT_EQUAL(0,
+                        caca_render_canvas_area(cv, f[n],
+                                                tiles + (y * w + x) * 4,
+                                                x, y, tw, th, w * 4,
+                                                "argb"));
+                }
+            CPPUNIT_ASSERT(!memcmp(ref, tiles, w * h * 4));
+
+            /* Nothing is written past the canvas */
+            memset(tiles, 0x55, 64 * 4);
+            CPPUNIT_ASSERT_EQUAL(0,
+                caca_render_canvas_area(cv, f[n], tiles, w, h, 64, 1,
+                                        64 * 4, "argb"));
+            for(int i = 0; i < 64 * 4; i++)
+                CPPUNIT_ASSERT_EQUAL(0x55, (int)tiles[i]);
+
+            CPPUNIT_ASSERT_EQUAL(-1,
+                caca_render_canvas_area(cv, f[n], tiles, -1, 0, 1, 1, 4,
+                                        "argb"));
+
+            delete[] ref;
+            delete[] tiles;
+        }
+    }
+
+    void test_formats()
+    {
+        static char const * const formats[] = { "bgra", "rgba" };
+        static int const order[][4] = { { 3, 2, 1, 0 }, { 1, 2, 3, 0 } };
+
+        int w = WIDTH * caca_get_font_width(f[0]);
+        int h = HEIGHT * caca_get_font_height(f[0]);
+        uint8_t *ref = new uint8_t[w * h * 4];
+        uint8_t *img = new uint8_t[w * h * 4];
+
+        memset(ref, 0, w * h * 4);
+        caca_render_canvas(cv, f[0], ref, w, h, w * 4);
+
+        for(int n = 0; n < 2; n++)
+        {
+            memset(img, 0, w * h * 4);
+            caca_render_canvas_area(cv, f[0], img, 0, 0, w, h, w * 4,
+                                    formats[n]);
+            for(int i = 0; i < w * h * 4; i += 4)
+                for(int k = 0; k < 4; k++)
+                    CPPUNIT_ASSERT_EQUAL((int)ref[i + order[n][k]],
+                                         (int)img[i + k]);
+        }
+
+        CPPUNIT_ASSERT_EQUAL(-1,
+            caca_render_canvas_area(cv, f[0], img, 0, 0, w, h, w * 4,
+                                    "yuv"));
+
+        delete[] ref;
+        delete[] img;
+    }
+
+    void test_stream()
+    {
+        static int const threads[] = { 1, 2, 4, 0 };
+        static int const rows[] = { 0, 1, 7, 1000 };
+
+        for(int n = 0; n < 2; n++)
+        {
+            int w = WIDTH * caca_get_font_width(f[n]);
+            int h = HEIGHT * caca_get_font_height(f[n]);
+            uint8_t *ref = new uint8_t[w * h * 4];
+            uint8_t *img = new uint8_t[w * h * 4];
+            struct stream_job job;
+
+            memset(ref, 0, w * h * 4);
+            caca_render_canvas(cv, f[n], ref, w, h, w * 4);
+
+            for(int t = 0; t < 4; t++)
+                for(int r = 0; r < 4; r++)
+                {
+                    memset(img, 0x55, w * h * 4);
+                    job.image = img;
+                    job.next = job.calls = 0;
+                    CPPUNIT_ASSERT_EQUAL(0,
+                        caca_render_canvas_stream(cv, f[n], "argb", rows[r],
+                                                  threads[t], stream_band,
+                                                  &job));
+                    CPPUNIT_ASSERT_EQUAL(h, job.next);
+                    CPPUNIT_ASSERT(!memcmp(ref, img, w * h * 4));
+                }
+
+            /* Stop as soon as the callback fails, and report its errno
+             * even if it ran in another thread */
+            for(int t = 0; t < 4; t++)
+            {
+                job.calls = 0;
+                errno = 0;
+                CPPUNIT_ASSERT_EQUAL(-1,
+                    caca_render_canvas_stream(cv, f[n], "argb", 1,
+                                              threads[t], stream_abort,
+                                              &job));
+                CPPUNIT_ASSERT_EQUAL(2, job.calls);
+                CPPUNIT_ASSERT_EQUAL(EPIPE, errno);
+            }
+
+            delete[] ref;
+            delete[] img;
+        }
+    }
+
+private:
+    static int const WIDTH = 67, HEIGHT = 23;
+    caca_canvas_t *cv;
+    caca_font_t *f[2];
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(FontTest);
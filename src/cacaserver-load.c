@@ -0,0 +1,305 @@
+/*
+ *  cacaserver-load  load test for cacaserver
+ *  Copyright © 2026 agent <agent@local>
+ *              All Rights Reserved
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by Sam Hocevar. See
+ *  http://www.wtfpl.net/ for more details.
+ */
+
+/*
+ *  Usage: cacaserver-load [clients [slow [seconds]]] | cacaserver
+ *
+ *  Writes an animation to stdout in the native caca format, and connects
+ *  the given number of telnet clients to cacaserver over loopback. The
+ *  slow clients only read a few kilobytes per second. When the animation
+ *  is over, prints how much data each kind of client received, and how
+ *  many full frames it got, which tells how often it had to catch up.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "caca.h"
+
+#define PORT 0xCACA     /* 51914 */
+#define FPS 25
+#define SPRITES 32
+#define BAND 4          /* Rows of the rainbow band, which is costly to send */
+#define SLOW_READ 8192  /* Bytes read by a slow client every 100 ms */
+
+/* Sent by cacaserver before every full frame */
+static char const full_prefix[] = "\033[1;1H\033[1;1H";
+
+struct client
+{
+    int fd, slow;
+    long int bytes, full;
+    int match;
+    int64_t next_read;
+};
+
+static int64_t now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int connect_client(int slow)
+{
+    struct sockaddr_in addr;
+    int fd, tries, size = SLOW_READ * 4;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    /* The server may still be starting */
+    for(tries = 0; tries < 50; tries++)
+    {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(fd < 0)
+            return -1;
+        /* Keep the kernel from buffering on behalf of slow clients */
+        if(slow)
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            return fd;
+        }
+        close(fd);
+        usleep(100000);
+    }
+
+    return -1;
+}
+
+static void read_client(struct client *c, int64_t t)
+{
+    char buf[65536];
+    ssize_t i, ret;
+    size_t len = c->slow ? SLOW_READ : sizeof(buf);
+
+    if(c->slow && t < c->next_read)
+        return;
+
+    ret = read(c->fd, buf, len);
+    if(ret <= 0)
+    {
+        if(ret < 0 && errno == EAGAIN)
+            return;
+        close(c->fd);
+        c->fd = -1;
+        return;
+    }
+
+    c->bytes += ret;
+    c->next_read = t + 100000;
+
+    for(i = 0; i < ret; i++)
+    {
+        if(buf[i] == full_prefix[c->match])
+            c->match++;
+        else
+            c->match = buf[i] == full_prefix[0];
+
+        if(c->match == (int)sizeof(full_prefix) - 1)
+        {
+            c->full++;
+            c->match = 0;
+        }
+    }
+}
+
+static void report(char const *name, struct client *clients, int count,
+                   int slow, int frames)
+{
+    long int minb = -1, maxb = 0, totb = 0, minf = -1, maxf = 0, totf = 0;
+    int i, n = 0, lost = 0;
+
+    for(i = 0; i < count; i++)
+    {
+        struct client *c = clients + i;
+
+        if(c->slow != slow)
+            continue;
+
+        n++;
+        lost += c->fd >= 0;
+        totb += c->bytes;
+        totf += c->full;
+        if(minb < 0 || c->bytes < minb)
+            minb = c->bytes;
+        if(c->bytes > maxb)
+            maxb = c->bytes;
+        if(minf < 0 || c->full < minf)
+            minf = c->full;
+        if(c->full > maxf)
+            maxf = c->full;
+    }
+
+    if(!n)
+        return;
+
+    fprintf(stderr, "%s clients: %i, %i still connected\n", name, n, lost);
+    fprintf(stderr, "  bytes: min %li, avg %li, max %li (%li per frame)\n",
+            minb, totb / n, maxb, totb / n / (frames ? frames : 1));
+    fprintf(stderr, "  full frames: min %li, avg %li, max %li\n",
+            minf, totf / n, maxf);
+}
+
+int main(int argc, char *argv[])
+{
+    caca_canvas_t *cv;
+    struct client *clients;
+    struct pollfd *pfds;
+    struct rlimit rl;
+    int64_t next, end;
+    int count = 100, slow = 0, seconds = 10, frames = 0, i, j, alive;
+    int stopped = 0;
+
+    if(argc > 1)
+        count = atoi(argv[1]);
+    if(argc > 2)
+        slow = atoi(argv[2]);
+    if(argc > 3)
+        seconds = atoi(argv[3]);
+
+    if(count <= 0 || slow < 0 || slow > count || seconds <= 0)
+    {
+        fprintf(stderr, "usage: %s [clients [slow [seconds]]] | cacaserver\n",
+                argv[0]);
+        return 1;
+    }
+
+    /* We need one descriptor per client, and so does the server */
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    cv = caca_create_canvas(200, 60);
+    clients = malloc(count * sizeof(struct client));
+    pfds = malloc(count * sizeof(struct pollfd));
+
+    for(i = 0; i < count; i++)
+    {
+        clients[i].fd = connect_client(i < slow);
+        if(clients[i].fd < 0)
+        {
+            fprintf(stderr, "%s: client %i could not connect\n", argv[0], i);
+            return 1;
+        }
+        clients[i].slow = i < slow;
+        clients[i].bytes = clients[i].full = 0;
+        clients[i].match = 0;
+        clients[i].next_read = 0;
+    }
+
+    fprintf(stderr, "%i clients connected, %i slow\n", count, slow);
+
+    next = now();
+    end = next + (int64_t)seconds * 1000000;
+
+    for(alive = count; alive; )
+    {
+        int64_t t = now();
+        int timeout;
+
+        /* Animate some sprites and a rainbow band over a background */
+        if(t >= next && t < end)
+        {
+            void *buf;
+            size_t bytes;
+
+            caca_set_color_ansi(cv, CACA_LIGHTGRAY, CACA_BLUE);
+            caca_clear_canvas(cv);
+            for(j = 0; j < 200 * BAND; j++)
+            {
+                caca_set_color_ansi(cv, CACA_WHITE, (j + frames) % 8);
+                caca_put_char(cv, j % 200, (frames + j / 200) % 60, '#');
+            }
+            caca_set_color_ansi(cv, CACA_YELLOW, CACA_BLUE);
+            for(j = 0; j < SPRITES; j++)
+                caca_put_str(cv, (frames * 3 + j * 37) % 196,
+                             (frames + j * 13) % 60,
+                             frames & 1 ? "<o>" : "[x]");
+            caca_printf(cv, 2, 0, "frame %i", frames);
+
+            buf = caca_export_canvas_to_memory(cv, "caca", &bytes);
+            if(fwrite(buf, 1, bytes, stdout) != bytes || fflush(stdout))
+            {
+                fprintf(stderr, "%s: server went away\n", argv[0]);
+                return 1;
+            }
+            free(buf);
+
+            frames++;
+            next += 1000000 / FPS;
+        }
+
+        /* Stop the server and let the clients drain */
+        if(t >= end && !stopped)
+        {
+            fclose(stdout);
+            stopped = 1;
+        }
+        if(t >= end + 5000000)
+            break;
+
+        for(i = 0, alive = 0; i < count; i++)
+        {
+            if(clients[i].fd < 0)
+                continue;
+            pfds[alive].fd = clients[i].fd;
+            pfds[alive].events = POLLIN;
+            alive++;
+        }
+
+        timeout = t < end ? (int)((next - t) / 1000) : 100;
+        if(slow)
+            timeout = timeout < 10 ? timeout : 10;
+        poll(pfds, alive, timeout > 0 ? timeout : 0);
+
+        t = now();
+        for(i = 0; i < count; i++)
+            if(clients[i].fd >= 0)
+                read_client(clients + i, t);
+    }
+
+    fprintf(stderr, "%i frames in %i s\n", frames, seconds);
+    report("fast", clients, count, 0, frames);
+    report("slow", clients, count, 1, frames);
+
+    for(i = 0; i < count; i++)
+        if(clients[i].fd >= 0)
+            close(clients[i].fd);
+    free(clients);
+    free(pfds);
+    caca_free_canvas(cv);
+
+    return 0;
+}
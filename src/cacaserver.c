@@ -32,11 +32,20 @@
 #endif
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
 #include <stdarg.h>
+#if defined(HAVE_SYS_EPOLL_H)
+#   include <sys/epoll.h>
+#else
+#   include <poll.h>
+#endif
+#if defined(HAVE_SYS_RESOURCE_H)
+#   include <sys/resource.h>
+#endif
 
 #ifndef USE_WINSOCK
 #   define USE_WINSOCK 0
@@ -46,7 +55,11 @@
 
 #define BACKLOG 1337     /* Number of pending connections */
 #define INBUFFER 32      /* Size of per-client input buffer */
-#define OUTBUFFER 300000 /* Size of per-client output buffer */
+#define OUTBUFFER 300000 /* Per-client backlog before skipping frames */
+#define MAXFRAMES 16     /* Per-client queued frames before skipping */
+#define SNDBUFFER 65536  /* Kernel send buffer, small so that we can skip */
+#define READSIZE 65536   /* Size of a read from stdin */
+#define MAXEVENTS 256    /* Events handled per loop iteration */
 
 /* Following vars are static */
 #define INIT_PREFIX \
@@ -63,11 +76,6 @@
     "\033[1;1H" /* move(0,0) */ \
     "\033[1;1H" /* move(0,0) again */
 
-#define ANSI_RESET \
-    "    " /* Garbage */ \
-    "\033[?1049h" /* Clear screen */ \
-    "\033[?1049h" /* Clear screen again */
-
 static char const telnet_commands[16][5] =
 {
     "SE  ", "NOP ", "DM  ", "BRK ", "IP  ", "AO  ", "AYT ", "EC  ",
@@ -86,20 +94,41 @@ static char const telnet_options[37][5] =
 #define COMMAND_NAME(x) (x>=240)?telnet_commands[x-240]:"????"
 #define OPTION_NAME(x) (x<=36)?telnet_options[x]:"????"
 
-struct client
+/* Everything the event loop waits on starts with this */
+struct watch
 {
     int fd;
-    int ready;
+    enum { WATCH_INPUT, WATCH_LISTEN, WATCH_CLIENT } type;
+};
+
+/* An encoded frame, shared by all the clients that have to send it */
+struct frame
+{
+    int refs;
+    size_t len;
+    uint8_t *data;
+};
+
+struct client
+{
+    struct watch w;
     uint8_t inbuf[INBUFFER];
     int inbytes;
-    uint8_t outbuf[OUTBUFFER];
-    int start, stop;
+
+    /* Frames waiting to be sent, how much of the first one is gone, and
+     * how much is left in total */
+    struct frame *queue[MAXFRAMES];
+    int frames;
+    size_t offset, len;
+
+    int writing; /* Waiting for the socket to become writable */
+    int synced; /* The client shows the last frame and can take deltas */
 };
 
 #define MAXSOCKS 16
 
 struct sock {
-    int sockfd;
+    struct watch w;
     struct sockaddr_in my_addr;
 };
 
@@ -109,27 +138,65 @@ struct server
     unsigned int port;
     int sock_count;
     struct sock socks[MAXSOCKS];
+    int paused; /* Not accepting connections, we ran out of descriptors */
 
-    /* Input buffer */
+    /* Input buffer, and the decoder that turns it into frames */
+    struct watch in;
     uint8_t *input;
-    unsigned int read;
+    caca_decoder_t *decoder;
+    size_t framebytes; /* Input used by the frame being decoded */
+    int eof, in_file;
 
     char prefix[sizeof(INIT_PREFIX)];
+    struct frame *init;
+
+    /* The frame being decoded, and the last frame sent to clients */
+    caca_canvas_t *canvas, *shown;
+
+    /* Changes between the last two frames, and full export of the last
+     * frame, only built when a client needs it */
+    struct frame *delta, *full;
+
+    /* Where frames are encoded before being copied to their own memory */
+    void *scratch;
+    size_t scratchsize;
 
-    caca_canvas_t *canvas;
-    void *buffer;
-    size_t buflen;
+    /* Connected clients, without holes */
+    int client_count, client_max;
+    struct client **clients;
 
-    int client_count;
-    struct client *clients;
+#if defined(HAVE_SYS_EPOLL_H)
+    int epfd;
+#else
+    struct pollfd *pfds;
+    struct watch **pwatches;
+    int pfd_max;
+#endif
 
     void (*sigpipe_handler)(int);
 };
 
+#define EVENT_READ 1
+#define EVENT_WRITE 2
+
 void fprint_ip(FILE *stream, struct sockaddr *ai);
-static void manage_connections(struct server *server, int sockfd);
-static int send_data(struct server *server, struct client *c);
-ssize_t nonblock_write(int fd, void *buf, size_t len);
+static int watch_add(struct server *server, struct watch *w);
+static void watch_output(struct server *server, struct client *c, int on);
+static void watch_remove(struct server *server, struct watch *w);
+static int wait_events(struct server *server, struct watch **ready,
+                       int *events, int timeout);
+static void read_input(struct server *server);
+static void broadcast(struct server *server);
+static void accept_clients(struct server *server, int sockfd);
+static int read_client(struct client *c);
+static struct frame *frame_new(size_t len);
+static void frame_unref(struct frame *f);
+static int encode_delta(struct server *server);
+static int export_frame(struct server *server);
+static int queue_frame(struct server *server, struct client *c);
+static int flush_client(struct server *server, struct client *c);
+static void drop_client(struct server *server, struct client *c);
+static int compact_clients(struct server *server);
 
 int main(void)
 {
@@ -138,6 +205,11 @@ int main(void)
     struct addrinfo ai_hints, *ai, *res;
     char port_str[6];
     char *tmp;
+    struct watch *ready[MAXEVENTS];
+    int events[MAXEVENTS];
+#if defined(HAVE_SYS_RESOURCE_H)
+    struct rlimit rl;
+#endif
 
 #if USE_WINSOCK
     WORD winsockVersion;
@@ -148,10 +220,16 @@ int main(void)
 #endif
     server = malloc(sizeof(struct server));
 
-    server->input = malloc(12);
-    server->read = 0;
+    server->input = malloc(READSIZE);
+    server->decoder = caca_create_decoder("caca");
+    server->framebytes = 0;
+    server->eof = server->in_file = 0;
+    server->in.fd = 0;
+    server->in.type = WATCH_INPUT;
 
-    server->client_count = 0;
+    server->sock_count = 0;
+    server->paused = 0;
+    server->client_count = server->client_max = 0;
     server->clients = NULL;
     server->port = 0xCACA; /* 51914 */
 
@@ -163,6 +241,31 @@ int main(void)
     tmp[2] = (uint8_t) (server->height & 0xff00) >> 8;
     tmp[3] = (uint8_t) server->height & 0xff;
 
+    server->init = frame_new(sizeof(INIT_PREFIX));
+    memcpy(server->init->data, server->prefix, sizeof(INIT_PREFIX));
+
+#if defined(HAVE_SYS_RESOURCE_H)
+    /* Each client needs a descriptor, allow as many as we can */
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+#endif
+
+#if defined(HAVE_SYS_EPOLL_H)
+    server->epfd = epoll_create(MAXEVENTS);
+    if(server->epfd == -1)
+    {
+        perror("epoll_create");
+        return -1;
+    }
+#else
+    server->pfds = NULL;
+    server->pwatches = NULL;
+    server->pfd_max = 0;
+#endif
+
     memset(&ai_hints, 0, sizeof(ai_hints));
     ai_hints.ai_family = AF_UNSPEC;
     ai_hints.ai_socktype = SOCK_STREAM;
@@ -207,7 +310,13 @@ int main(void)
             continue;
         }
 
-        server->socks[server->sock_count].sockfd = fd;
+        server->socks[server->sock_count].w.fd = fd;
+        server->socks[server->sock_count].w.type = WATCH_LISTEN;
+        if(watch_add(server, &server->socks[server->sock_count].w))
+        {
+            perror("watch");
+            continue;
+        }
         server->sock_count++;
         fprintf(stderr, "listening on ");
         fprint_ip(stderr, res->ai_addr);
@@ -221,8 +330,22 @@ int main(void)
         return -1;
     }
 
+    /* Read stdin without blocking. Regular files cannot be waited on with
+     * epoll, they are read on every iteration until the end instead. */
+    flags = fcntl(0, F_GETFL, 0);
+    fcntl(0, F_SETFL, flags | O_NONBLOCK);
+    if(watch_add(server, &server->in))
+        server->in_file = 1;
+
     server->canvas = caca_create_canvas(0, 0);
-    server->buffer = NULL;
+    server->shown = caca_create_canvas(0, 0);
+    /* Changes are found by comparing the canvases, so dirty cells are
+     * not needed, and decoding can write whole rows at once */
+    caca_disable_dirty_rect(server->canvas);
+    caca_disable_dirty_rect(server->shown);
+    server->delta = server->full = NULL;
+    server->scratch = NULL;
+    server->scratchsize = 0;
 
     /* Ignore SIGPIPE */
     server->sigpipe_handler = signal(SIGPIPE, SIG_IGN);
@@ -230,101 +353,77 @@ int main(void)
     fprintf(stderr, "initialised network, listening on port %i\n",
                     server->port);
 
-    /* Main loop */
+    /* Main loop, until stdin is closed and the clients got everything */
     for(;;)
     {
-restart:
-        /* Manage new connections as this function will be called sometimes
-         * more often than display */
-        for (i = 0; i < server->sock_count; i++)
-            manage_connections(server, server->socks[i].sockfd);
-
-        /* Read data from stdin */
-        if(server->read < 12)
-        {
-            read(0, server->input + server->read, 12 - server->read);
-            server->read = 12;
-        }
+        int n, timeout = -1;
 
-        while(caca_import_canvas_from_memory(server->canvas, server->input,
-                                             server->read, "caca") < 0)
+        if(server->in_file && !server->eof)
         {
-            memmove(server->input, server->input + 1, server->read - 1);
-            read(0, server->input + server->read - 1, 1);
+            read_input(server);
+            timeout = 0;
         }
 
-        for(;;)
-        {
-            ssize_t needed, wanted;
+        n = wait_events(server, ready, events, timeout);
 
-            needed = caca_import_canvas_from_memory(server->canvas,
-                                                    server->input,
-                                                    server->read, "caca");
-            if(needed < 0)
-                goto restart;
+        for(i = 0; i < n; i++)
+        {
+            struct client *c;
 
-            if(needed > 0)
+            switch(ready[i]->type)
             {
-                server->read -= needed;
-                memmove(server->input, server->input + needed, server->read);
+            case WATCH_INPUT:
+                read_input(server);
+                break;
+            case WATCH_LISTEN:
+                accept_clients(server, ready[i]->fd);
+                break;
+            case WATCH_CLIENT:
+                c = (struct client *)ready[i];
+                if(c->w.fd < 0)
+                    break; /* Dropped earlier in this iteration */
+                if((events[i] & EVENT_READ) && read_client(c))
+                    drop_client(server, c);
+                else if((events[i] & EVENT_WRITE) && flush_client(server, c))
+                    drop_client(server, c);
                 break;
             }
-
-            server->input = realloc(server->input, server->read + 128);
-            wanted = read(0, server->input + server->read, 128);
-            if(wanted < 0)
-                goto restart;
-            server->read += wanted;
         }
 
-        /* Free the previous export buffer, if any */
-        if(server->buffer)
-        {
-            free(server->buffer);
-            server->buffer = NULL;
-        }
-
-        /* Get ANSI representation of the image and skip the end-of buffer
-         * linefeed ("\r\n", 2 byte) */
-        server->buffer = caca_export_canvas_to_memory(server->canvas, "utf8cr",
-                                                      &server->buflen);
-        server->buflen -= 2;
-
-        for(i = 0; i < server->client_count; i++)
-        {
-            if(server->clients[i].fd == -1)
-                continue;
-
-            if(send_data(server, &server->clients[i]))
-            {
-                fprintf(stderr, "[%i] dropped connection\n",
-                                server->clients[i].fd);
-                close(server->clients[i].fd);
-                server->clients[i].fd = -1;
-            }
-        }
+        if(!compact_clients(server) && server->eof)
+            break;
     }
 
     /* Kill all remaining clients */
     for(i = 0; i < server->client_count; i++)
-    {
-        if(server->clients[i].fd == -1)
-            continue;
-
-        close(server->clients[i].fd);
-        server->clients[i].fd = -1;
-    }
-
-    if(server->buffer)
-        free(server->buffer);
+        drop_client(server, server->clients[i]);
+    compact_clients(server);
+    free(server->clients);
+
+    frame_unref(server->init);
+    if(server->delta)
+        frame_unref(server->delta);
+    if(server->full)
+        frame_unref(server->full);
+    free(server->scratch);
+    free(server->input);
+    caca_free_decoder(server->decoder);
 
     caca_free_canvas(server->canvas);
+    caca_free_canvas(server->shown);
 
     /* Restore SIGPIPE handler */
     signal(SIGPIPE, server->sigpipe_handler);
 
     for (i = 0; i < server->sock_count; i++)
-        close(server->socks[i].sockfd);
+        close(server->socks[i].w.fd);
+
+#if defined(HAVE_SYS_EPOLL_H)
+    close(server->epfd);
+#else
+    free(server->pfds);
+    free(server->pwatches);
+#endif
 
     free(server);
 
@@ -353,266 +452,582 @@ void fprint_ip(FILE *stream, struct sockaddr *ai)
         fprintf(stream, "%s", buffer);
 }
 
-static void manage_connections(struct server *server, int sockfd)
+static int watch_add(struct server *server, struct watch *w)
 {
-    int fd, flags;
-    struct sockaddr_in6 remote_addr;
-    socklen_t len = sizeof(struct sockaddr_in6);
+#if defined(HAVE_SYS_EPOLL_H)
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = w;
+    return epoll_ctl(server->epfd, EPOLL_CTL_ADD, w->fd, &ev);
+#else
+    return 0;
+#endif
+}
+
+static void watch_output(struct server *server, struct client *c, int on)
+{
+#if defined(HAVE_SYS_EPOLL_H)
+    struct epoll_event ev;
 
-    fd = accept(sockfd, (struct sockaddr*)&remote_addr, &len);
-    if(fd == -1)
+    if(c->writing == on)
         return;
 
-    fprintf(stderr, "[%i] connected from ", fd);
-    fprint_ip(stderr, (struct sockaddr*)&remote_addr);
-    fprintf(stderr, "\n");
+    ev.events = on ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.ptr = &c->w;
+    epoll_ctl(server->epfd, EPOLL_CTL_MOD, c->w.fd, &ev);
+#endif
+    c->writing = on;
+}
+
+static void watch_remove(struct server *server, struct watch *w)
+{
+#if defined(HAVE_SYS_EPOLL_H)
+    struct epoll_event ev;
+
+    /* Older kernels want a non-NULL event even for deletion */
+    epoll_ctl(server->epfd, EPOLL_CTL_DEL, w->fd, &ev);
+#endif
+}
+
+/* Wait for something to happen, and fill ready with the objects that need
+ * attention. Returns the number of objects. */
+static int wait_events(struct server *server, struct watch **ready,
+                       int *events, int timeout)
+{
+#if defined(HAVE_SYS_EPOLL_H)
+    struct epoll_event ev[MAXEVENTS];
+    int i, n;
 
-    /* Non blocking socket */
-    flags = fcntl(fd, F_SETFL, 0);
-    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    n = epoll_wait(server->epfd, ev, MAXEVENTS, timeout);
+    if(n < 0)
+        return 0; /* EINTR, the caller comes back soon enough */
 
-    if(server->clients == NULL)
+    for(i = 0; i < n; i++)
     {
-        server->clients = malloc(sizeof(struct client));
-        if(server->clients == NULL)
-        {
-            close(fd);
-            return;
-        }
+        ready[i] = (struct watch *)ev[i].data.ptr;
+        /* Errors are reported by the next read or write */
+        events[i] = 0;
+        if(ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            events[i] |= EVENT_READ;
+        if(ev[i].events & EPOLLOUT)
+            events[i] |= EVENT_WRITE;
     }
-    else
+
+    return n;
+#else
+    int i, n = 0, count = 0;
+
+    if(server->pfd_max < server->client_count + MAXSOCKS + 1)
     {
-        server->clients = realloc(server->clients,
-                            (server->client_count+1) * sizeof(struct client));
+        server->pfd_max = server->client_max + MAXSOCKS + 1;
+        server->pfds = realloc(server->pfds,
+                               server->pfd_max * sizeof(struct pollfd));
+        server->pwatches = realloc(server->pwatches,
+                                   server->pfd_max * sizeof(struct watch *));
     }
 
-    server->clients[server->client_count].fd = fd;
-    server->clients[server->client_count].ready = 0;
-    server->clients[server->client_count].inbytes = 0;
-    server->clients[server->client_count].start = 0;
-    server->clients[server->client_count].stop = 0;
+    if(!server->eof && !server->in_file)
+    {
+        server->pfds[n].fd = 0;
+        server->pfds[n].events = POLLIN;
+        server->pwatches[n++] = &server->in;
+    }
 
-    /* If we already have data to send, send it to the new client */
-    if(send_data(server, &server->clients[server->client_count]))
+    for(i = 0; i < server->sock_count && !server->paused; i++)
     {
-        fprintf(stderr, "[%i] dropped connection\n", fd);
-        close(fd);
-        server->clients[server->client_count].fd = -1;
-        return;
+        server->pfds[n].fd = server->socks[i].w.fd;
+        server->pfds[n].events = POLLIN;
+        server->pwatches[n++] = &server->socks[i].w;
+    }
+
+    for(i = 0; i < server->client_count; i++)
+    {
+        server->pfds[n].fd = server->clients[i]->w.fd;
+        server->pfds[n].events = server->clients[i]->writing
+                               ? POLLIN | POLLOUT : POLLIN;
+        server->pwatches[n++] = &server->clients[i]->w;
     }
 
-    server->client_count++;
+    if(poll(server->pfds, n, timeout) <= 0)
+        return 0;
+
+    for(i = 0; i < n && count < MAXEVENTS; i++)
+    {
+        short revents = server->pfds[i].revents;
+
+        if(!revents)
+            continue;
+
+        ready[count] = server->pwatches[i];
+        events[count] = 0;
+        if(revents & (POLLIN | POLLERR | POLLHUP))
+            events[count] |= EVENT_READ;
+        if(revents & POLLOUT)
+            events[count] |= EVENT_WRITE;
+        count++;
+    }
+
+    return count;
+#endif
 }
 
-static int send_data(struct server *server, struct client *c)
+/* Read everything available on stdin and decode it as it comes. Complete
+ * frames are sent to the clients, unless a whole frame of the same size
+ * is already waiting behind them. */
+static void read_input(struct server *server)
 {
-    ssize_t ret;
+    int frames = 0;
 
-    /* Not for us */
-    if(c->fd < 0)
-        return -1;
-
-    /* Listen to incoming data */
     for(;;)
     {
-        ret = read(c->fd, c->inbuf + c->inbytes, 1);
-        if(ret <= 0)
-            break;
+        ssize_t ret, used, n;
 
-        c->inbytes++;
+        ret = read(0, server->input, READSIZE);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
 
-        /* Check for telnet sequences */
-        if(c->inbuf[0] == 0xff)
+        if(ret <= 0)
         {
-            if(c->inbytes == 1)
-            {
-                ;
-            }
-            else if(c->inbuf[1] == 0xfd || c->inbuf[1] == 0xfc)
-            {
-                if(c->inbytes == 3)
-                {
-                    fprintf(stderr, "[%i] said: %.02x %.02x %.02x (%s %s %s)\n",
-                            c->fd, c->inbuf[0], c->inbuf[1], c->inbuf[2],
-                            COMMAND_NAME(c->inbuf[0]), COMMAND_NAME(c->inbuf[1]), OPTION_NAME(c->inbuf[2]));
-                    /* Just ignore, lol */
-                    c->inbytes = 0;
-                }
-            }
-            else
-                c->inbytes = 0;
+            if(ret < 0)
+                perror("read");
+            server->eof = 1;
+            if(!server->in_file)
+                watch_remove(server, &server->in);
+            break;
         }
-        else if(c->inbytes == 1)
+
+        for(used = 0; used < ret; used += n)
         {
-            if(c->inbuf[0] == 0x03)
+            n = caca_decode_canvas(server->decoder, server->canvas,
+                                   server->input + used, ret - used);
+            if(n < 0)
             {
-                fprintf(stderr, "[%i] pressed C-c\n", c->fd);
-                return -1; /* User requested to quit */
+                perror("caca_decode_canvas");
+                server->framebytes = 0;
+                break;
             }
 
-            c->inbytes = 0;
+            server->framebytes += n;
+            if(caca_get_decoder_needed(server->decoder))
+                continue;
+
+            if((size_t)(ret - used - n) < server->framebytes)
+                broadcast(server);
+            server->framebytes = 0;
+            frames++;
         }
+
+        /* Send what we have before a fast producer keeps us here */
+        if(frames)
+            break;
     }
+}
+
+static void broadcast(struct server *server)
+{
+    caca_canvas_t *cv;
+    int i;
+
+    if(encode_delta(server))
+        return;
 
-    /* Send the telnet initialisation commands */
-    if(!c->ready)
+    /* The new frame is now the shown one, and the old one gets
+     * overwritten by the next decoded one */
+    cv = server->shown;
+    server->shown = server->canvas;
+    server->canvas = cv;
+    if(server->full)
     {
-        ret = nonblock_write(c->fd, server->prefix, sizeof(INIT_PREFIX));
-        if(ret == -1)
-            return (errno == EAGAIN) ? 0 : -1;
+        frame_unref(server->full);
+        server->full = NULL;
+    }
+
+    /* Clients that wait for their socket to drain will be flushed when
+     * it does, there is no need to try now */
+    for(i = 0; i < server->client_count; i++)
+    {
+        struct client *c = server->clients[i];
 
-        if(ret < (ssize_t)sizeof(INIT_PREFIX))
-            return 0;
+        if(c->w.fd < 0)
+            continue;
 
-        c->ready = 1;
+        if(queue_frame(server, c) || (!c->writing && flush_client(server, c)))
+            drop_client(server, c);
     }
+}
 
-    /* No error, there's just nothing to send yet */
-    if(!server->buffer)
-        return 0;
+static void accept_clients(struct server *server, int sockfd)
+{
+    int fd, flags, i, size = SNDBUFFER;
+    struct sockaddr_in6 remote_addr;
+    socklen_t len;
+    struct client *c;
 
-    /* If we have backlog, send the backlog */
-    if(c->stop)
+    for(;;)
     {
-        ret = nonblock_write(c->fd, c->outbuf + c->start, c->stop - c->start);
+        len = sizeof(struct sockaddr_in6);
+        fd = accept(sockfd, (struct sockaddr*)&remote_addr, &len);
+        if(fd == -1)
+        {
+            /* Stop listening until a client leaves, or the listening
+             * sockets would wake us up forever */
+            if(errno == EMFILE || errno == ENFILE)
+            {
+                fprintf(stderr, "too many connections, pausing\n");
+                for(i = 0; i < server->sock_count; i++)
+                    watch_remove(server, &server->socks[i].w);
+                server->paused = 1;
+            }
+            return;
+        }
+
+        fprintf(stderr, "[%i] connected from ", fd);
+        fprint_ip(stderr, (struct sockaddr*)&remote_addr);
+        fprintf(stderr, "\n");
+
+        /* Non blocking socket */
+        flags = fcntl(fd, F_SETFL, 0);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+        /* Frames that are late should wait in our queue, where they can
+         * be skipped, rather than in a large kernel buffer */
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
 
-        if(ret == -1)
+        if(server->client_count == server->client_max)
         {
-            if(errno == EAGAIN)
-                ret = 0;
-            else
+            int max = server->client_max ? server->client_max * 2 : 16;
+            struct client **clients = realloc(server->clients,
+                                              max * sizeof(struct client *));
+            if(!clients)
             {
-                fprintf(stderr, "[%i] failed (%s)\n",
-                        c->fd, strerror(errno));
-                return -1;
+                close(fd);
+                continue;
             }
+            server->clients = clients;
+            server->client_max = max;
         }
 
-        if(ret == c->stop - c->start)
+        c = malloc(sizeof(struct client));
+        if(!c)
         {
-            /* We got rid of the backlog! */
-            c->start = c->stop = 0;
+            close(fd);
+            continue;
         }
-        else
+
+        c->w.fd = fd;
+        c->w.type = WATCH_CLIENT;
+        c->inbytes = 0;
+        c->frames = 0;
+        c->offset = c->len = 0;
+        c->writing = 0;
+        c->synced = 0;
+
+        if(watch_add(server, &c->w))
         {
-            c->start += ret;
+            close(fd);
+            free(c);
+            continue;
+        }
 
-            if(c->stop - c->start + strlen(ANSI_PREFIX) + server->buflen
-                > OUTBUFFER)
-            {
-                /* Overflow! Empty buffer and start again */
-                memcpy(c->outbuf, ANSI_RESET, strlen(ANSI_RESET));
-                c->start = 0;
-                c->stop = strlen(ANSI_RESET);
+        server->clients[server->client_count++] = c;
+
+        /* Send the telnet initialisation commands, and the current frame
+         * if we already have one */
+        server->init->refs++;
+        c->queue[c->frames++] = server->init;
+        c->len = server->init->len;
+
+        if((server->delta && queue_frame(server, c))
+            || flush_client(server, c))
+            drop_client(server, c);
+    }
+}
+
+/* Handle incoming telnet data. Returns -1 if the client must go. */
+static int read_client(struct client *c)
+{
+    uint8_t buf[256];
+    ssize_t ret, i;
+
+    for(;;)
+    {
+        ret = read(c->w.fd, buf, sizeof(buf));
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
                 return 0;
-            }
+            return -1;
+        }
+
+        if(ret == 0)
+            return -1; /* Connection closed */
+
+        for(i = 0; i < ret; i++)
+        {
+            c->inbuf[c->inbytes++] = buf[i];
 
-            /* Need to move? */
-            if(c->stop + strlen(ANSI_PREFIX) + server->buflen > OUTBUFFER)
+            /* Check for telnet sequences */
+            if(c->inbuf[0] == 0xff)
             {
-                memmove(c->outbuf, c->outbuf + c->start, c->stop - c->start);
-                c->stop -= c->start;
-                c->start = 0;
+                if(c->inbytes == 1)
+                {
+                    ;
+                }
+                else if(c->inbuf[1] == 0xfd || c->inbuf[1] == 0xfc)
+                {
+                    if(c->inbytes == 3)
+                    {
+                        fprintf(stderr, "[%i] said: %.02x %.02x %.02x (%s %s %s)\n",
+                                c->w.fd, c->inbuf[0], c->inbuf[1], c->inbuf[2],
+                                COMMAND_NAME(c->inbuf[0]), COMMAND_NAME(c->inbuf[1]), OPTION_NAME(c->inbuf[2]));
+                        /* Just ignore, lol */
+                        c->inbytes = 0;
+                    }
+                }
+                else
+                    c->inbytes = 0;
             }
+            else if(c->inbytes == 1)
+            {
+                if(c->inbuf[0] == 0x03)
+                {
+                    fprintf(stderr, "[%i] pressed C-c\n", c->w.fd);
+                    return -1; /* User requested to quit */
+                }
 
-            memcpy(c->outbuf + c->stop, ANSI_PREFIX, strlen(ANSI_PREFIX));
-            c->stop += strlen(ANSI_PREFIX);
-            memcpy(c->outbuf + c->stop, server->buffer, server->buflen);
-            c->stop += server->buflen;
-
-            return 0;
+                c->inbytes = 0;
+            }
         }
     }
+}
+
+static struct frame *frame_new(size_t len)
+{
+    struct frame *f = malloc(sizeof(struct frame) + len);
+
+    if(!f)
+        return NULL;
 
-    /* We no longer have backlog, send our new data */
+    f->refs = 1;
+    f->len = len;
+    f->data = (uint8_t *)(f + 1);
 
-    /* Send ANSI prefix */
-    ret = nonblock_write(c->fd, ANSI_PREFIX, strlen(ANSI_PREFIX));
-    if(ret == -1)
+    return f;
+}
+
+static void frame_unref(struct frame *f)
+{
+    if(--f->refs == 0)
+        free(f);
+}
+
+/* Encode what changed since the shown frame once for all clients. The
+ * delta is built in the scratch buffer, growing it if necessary, then
+ * copied to a frame of the right size. */
+static int encode_delta(struct server *server)
+{
+    struct frame *f;
+    ssize_t len;
+
+    len = caca_export_canvas_delta_to_buffer(server->shown, server->canvas,
+                                             server->scratch,
+                                             server->scratchsize);
+    if(len > (ssize_t)server->scratchsize)
     {
-        if(errno == EAGAIN)
-            ret = 0;
-        else
-        {
-            fprintf(stderr, "[%i] failed (%s)\n", c->fd, strerror(errno));
+        void *newbuf = realloc(server->scratch, len);
+        if(!newbuf)
             return -1;
-        }
+        server->scratch = newbuf;
+        server->scratchsize = len;
+        caca_export_canvas_delta_to_buffer(server->shown, server->canvas,
+                                           server->scratch,
+                                           server->scratchsize);
     }
 
-    if(ret < (ssize_t)strlen(ANSI_PREFIX))
+    f = frame_new(len);
+    if(!f)
+        return -1;
+    memcpy(f->data, server->scratch, len);
+
+    if(server->delta)
+        frame_unref(server->delta);
+    server->delta = f;
+
+    return 0;
+}
+
+/* Export the shown frame in full for the clients that need it, and skip
+ * the end-of buffer linefeed ("\r\n", 2 byte) */
+static int export_frame(struct server *server)
+{
+    size_t prefixlen = strlen(ANSI_PREFIX);
+    struct frame *f;
+    ssize_t len;
+
+    if(server->full)
+        return 0;
+
+    len = caca_export_canvas_to_buffer(server->shown, "utf8cr",
+                                       server->scratch, server->scratchsize);
+    if(len > (ssize_t)server->scratchsize)
     {
-        if(strlen(ANSI_PREFIX) + server->buflen > OUTBUFFER)
-        {
-            /* Overflow! Empty buffer and start again */
-            memcpy(c->outbuf, ANSI_RESET, strlen(ANSI_RESET));
-            c->start = 0;
-            c->stop = strlen(ANSI_RESET);
-            return 0;
-        }
+        void *newbuf = realloc(server->scratch, len);
+        if(!newbuf)
+            return -1;
+        server->scratch = newbuf;
+        server->scratchsize = len;
+        caca_export_canvas_to_buffer(server->shown, "utf8cr",
+                                     server->scratch, server->scratchsize);
+    }
+    len = len > 2 ? len - 2 : 0;
 
-        memcpy(c->outbuf, ANSI_PREFIX, strlen(ANSI_PREFIX) - ret);
-        c->stop = strlen(ANSI_PREFIX) - ret;
-        memcpy(c->outbuf + c->stop, server->buffer, server->buflen);
-        c->stop += server->buflen;
+    f = frame_new(prefixlen + len);
+    if(!f)
+        return -1;
+    memcpy(f->data, ANSI_PREFIX, prefixlen);
+    memcpy(f->data + prefixlen, server->scratch, len);
+    server->full = f;
 
+    return 0;
+}
+
+/* Queue the last frame for a client: only the changes if it has the
+ * previous one, or a full frame otherwise. */
+static int queue_frame(struct server *server, struct client *c)
+{
+    struct frame *f = server->delta;
+
+    if(c->synced && !f->len)
         return 0;
+
+    if(!c->synced)
+    {
+        if(export_frame(server))
+            return -1;
+        f = server->full;
     }
 
-    /* Send actual data */
-    ret = nonblock_write(c->fd, server->buffer, server->buflen);
-    if(ret == -1)
+    /* A client that is too far behind skips to the newest frame. It keeps
+     * the frame it is receiving, loses the ones after it, and gets the
+     * newest frame in full. */
+    if(c->frames && (c->frames == MAXFRAMES
+                      || c->len + f->len > OUTBUFFER))
     {
-        if(errno == EAGAIN)
-            ret = 0;
-        else
+        while(c->frames > 1)
+            frame_unref(c->queue[--c->frames]);
+        c->len = c->queue[0]->len - c->offset;
+
+        if(f != server->full)
         {
-            fprintf(stderr, "[%i] failed (%s)\n", c->fd, strerror(errno));
-            return -1;
+            if(export_frame(server))
+                return -1;
+            f = server->full;
         }
     }
 
-    if(ret < (int)server->buflen)
+    f->refs++;
+    c->queue[c->frames++] = f;
+    c->len += f->len;
+    c->synced = 1;
+
+    return 0;
+}
+
+/* Write as much of the queued frames as the socket takes, all at once.
+ * Returns -1 if the client must go. */
+static int flush_client(struct server *server, struct client *c)
+{
+    struct iovec iov[MAXFRAMES];
+    ssize_t ret;
+    size_t done;
+    int i;
+
+    while(c->len)
     {
-        if(server->buflen > OUTBUFFER)
+        for(i = 0; i < c->frames; i++)
         {
-            /* Overflow! Empty buffer and start again */
-            memcpy(c->outbuf, ANSI_RESET, strlen(ANSI_RESET));
-            c->start = 0;
-            c->stop = strlen(ANSI_RESET);
-            return 0;
+            iov[i].iov_base = c->queue[i]->data;
+            iov[i].iov_len = c->queue[i]->len;
         }
+        iov[0].iov_base = c->queue[0]->data + c->offset;
+        iov[0].iov_len -= c->offset;
 
-        memcpy(c->outbuf, server->buffer, server->buflen - ret);
-        c->stop = server->buflen - ret;
+        ret = writev(c->w.fd, iov, c->frames);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            fprintf(stderr, "[%i] failed (%s)\n", c->w.fd, strerror(errno));
+            return -1;
+        }
 
-        return 0;
+        /* Forget about the frames that are fully sent */
+        c->len -= ret;
+        done = c->offset + ret;
+        while(c->frames && done >= c->queue[0]->len)
+        {
+            done -= c->queue[0]->len;
+            frame_unref(c->queue[0]);
+            c->frames--;
+            memmove(c->queue, c->queue + 1,
+                    c->frames * sizeof(struct frame *));
+        }
+        c->offset = done;
     }
 
+    watch_output(server, c, c->len != 0);
+
     return 0;
 }
 
-ssize_t nonblock_write(int fd, void *buf, size_t len)
+/* Close a client's connection. It is freed by compact_clients(), because
+ * it may still appear in the events being processed. */
+static void drop_client(struct server *server, struct client *c)
 {
-    size_t total = 0;
-    ssize_t ret;
+    fprintf(stderr, "[%i] dropped connection\n", c->w.fd);
+    watch_remove(server, &c->w);
+    close(c->w.fd);
+    c->w.fd = -1;
+}
 
-    while(total < len)
+/* Free the dropped clients and fill the holes they leave. Returns the
+ * number of clients that still have data to receive. */
+static int compact_clients(struct server *server)
+{
+    int i, busy = 0, freed = 0;
+
+    for(i = 0; i < server->client_count; )
     {
-        do
+        struct client *c = server->clients[i];
+
+        if(c->w.fd >= 0)
         {
-            ret = write(fd, buf, len);
+            busy += c->len != 0;
+            i++;
+            continue;
         }
-        while(ret < 0 && errno == EINTR);
 
-        if(ret < 0)
-            return ret;
-        else if(ret == 0)
-            return total;
+        while(c->frames)
+            frame_unref(c->queue[--c->frames]);
+        free(c);
+        server->clients[i] = server->clients[--server->client_count];
+        freed++;
+    }
 
-        total += len;
-        buf = (void *)((uintptr_t)buf + len);
+    /* There are descriptors again for new connections */
+    if(freed && server->paused)
+    {
+        for(i = 0; i < server->sock_count; i++)
+            watch_add(server, &server->socks[i].w);
+        server->paused = 0;
     }
 
-    return total;
+    return busy;
 }
-